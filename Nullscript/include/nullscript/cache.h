@@ -0,0 +1,101 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <nullscript/nullscript.h>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace NULLSCR
+{
+    class TokenizeCache
+    {
+    public:
+        typedef std::shared_ptr<const std::vector<TokenEntity>> Result;
+        typedef std::function<void(const std::vector<TokenEntity>&,std::string&)> Encoder;
+        typedef std::function<bool(const std::string&,std::vector<TokenEntity>&)> Decoder;
+
+        struct Stats
+        {
+            std::size_t hits,misses,evictions,disk_hits,disk_writes;
+            std::size_t entries,bytes;
+            Stats(): hits(0), misses(0), evictions(0), disk_hits(0), disk_writes(0), entries(0), bytes(0) {};
+        };
+    private:
+        struct Key
+        {
+            std::uint64_t fingerprint,hash,size; //hash is seeded with fingerprint
+            bool operator == (const Key& k) const
+            {
+                return fingerprint == k.fingerprint && hash == k.hash && size == k.size;
+            }
+        };
+        struct KeyHash
+        {
+            std::size_t operator () (const Key& k) const
+            {
+                return static_cast<std::size_t>(k.hash ^ (k.size * 0x9E3779B97F4A7C15ULL));
+            }
+        };
+        struct Entry
+        {
+            Key key;
+            std::string source; //compared on every hit, hash alone may collide
+            Result result;
+            std::size_t bytes;
+        };
+        //copied under lock by every call, so it may change while cache is in use
+        struct Persistence
+        {
+            std::string directory;
+            Encoder encoder;
+            Decoder decoder;
+        };
+
+        const Tokenizer& tokenizer_;
+        const std::uint64_t seed_;
+        std::uint64_t fingerprint_; //of entries in memory
+        std::size_t budget_;
+
+        std::list<Entry> lru_; //most recently used first
+        std::unordered_map<Key,std::list<Entry>::iterator,KeyHash> index_;
+        Stats stats_;
+        mutable std::mutex mutex_;
+
+        Persistence persistence_;
+
+        std::string entryPath(const Key& key,const Persistence& persistence) const;
+        //entries on disk hold source before tokens
+        Result load(const Key& key,const std::string& source,const Persistence& persistence);
+        void store(const Key& key,const std::string& source,const std::vector<TokenEntity>& tokens,const Persistence& persistence);
+        void insert(const Key& key,const std::string& source,const Result& result);
+        void evict();
+        //mutex has to be locked
+        void drop();
+    public:
+        static std::uint64_t hash(const char* data,std::size_t size,std::uint64_t seed = 0);
+        static std::uint64_t hash(const std::string& data,std::uint64_t seed = 0);
+        static std::size_t estimateSize(const std::vector<TokenEntity>& tokens);
+
+        //results are shared with other callers, tokens are cloned before their scopes are edited
+        Result tokenize(const std::string& source);
+
+        void setPersistence(const std::string& directory,const Encoder& encoder,const Decoder& decoder);
+        void setBudget(std::size_t bytes);
+        void clear();
+
+        Stats getStats() const;
+        //of tokenizer as it is set up now mixed with seed, entries made under another one are dropped from memory
+        //and not looked up on disk
+        std::uint64_t getFingerprint() const;
+
+        //seed stands for what fingerprint of tokenizer can not see, like token creators and mergers,
+        //it should change with them
+        TokenizeCache(const Tokenizer& tokenizer,std::uint64_t seed = 0,std::size_t budget = 64 << 20): tokenizer_(tokenizer), seed_(seed), fingerprint_(0), budget_(budget) {};
+        TokenizeCache(const TokenizeCache&) = delete;
+    };
+}
+
+#endif // CACHE_H
@@ -0,0 +1,46 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <nullscript/rules.h>
+
+namespace NULLSCR
+{
+    //buffers kept between tokenize calls made with it, so repeated calls on small sources barely allocate
+    //serves one call at a time
+    class TokenizeContext
+    {
+    private:
+        std::vector<TokenEntity> tokens;
+        std::deque<LexicalRule::Scratch> lexers; //one per rule of a LexicalChain, first one also for single rules
+        LexicalChain::Scratch chain;
+        LayeredMergingRule::Scratch merger;
+        Diagnostics* diagnostics;
+        LineIndex* lines;
+        SymbolTable* symbols;
+    public:
+        //tokens of last call, cleared by next one
+        std::vector<TokenEntity>& getTokens();
+        LexicalRule::Scratch& getLexer(unsigned level = 0);
+        LexicalChain::Scratch& getChain();
+        LayeredMergingRule::Scratch& getMerger();
+
+        //errors are recorded instead of thrown when set
+        void setDiagnostics(Diagnostics* d);
+        Diagnostics* getDiagnostics() const;
+        //rebuilt for every source when set
+        void setLineIndex(LineIndex* l);
+        LineIndex* getLineIndex() const;
+        //names of interned tokens go there, table is kept across calls and must outlive their tokens,
+        //results do not keep it alive, contexts used by different threads at once need tables of their own
+        void setSymbols(SymbolTable* s);
+        SymbolTable* getSymbols() const;
+
+        //frees tokens and all buffers
+        void release();
+
+        TokenizeContext(Diagnostics* d = nullptr,LineIndex* l = nullptr,SymbolTable* s = nullptr): diagnostics(d), lines(l), symbols(s) {};
+        TokenizeContext(const TokenizeContext&) = delete;
+    };
+}
+
+#endif // CONTEXT_H
@@ -0,0 +1,74 @@
+#ifndef GENERATOR_H
+#define GENERATOR_H
+
+#include <nullscript/rules.h>
+#include <ostream>
+
+namespace NULLSCR
+{
+    /*
+        writes C++ source of a lexer specialized for one LexicalRule, giving the same tokens as the rule:
+            keywords    nested switches over bytes, runs of bytes without branches compared at once
+            regexes     only those added with addParsePattern, as sequences of characters, escapes like \w,
+                        bracket classes and ., each optionally followed by *, + or ?,
+                        they may not match empty and may not need backtracking,
+                        so a repeated class has nothing in common with what may follow it
+        generated function matches GeneratedLexer::Function and takes tokens from creator of rule it is given,
+        rules with longest match or with other regexes are rejected with a logic_error
+    */
+    class LexerGenerator
+    {
+    private:
+        struct Atom
+        {
+            bool table[256];
+            unsigned min,max; //max of 0 for unbounded
+        };
+
+        const LexicalRule& rule;
+        std::string name;
+        std::vector<std::vector<Atom>> patterns; //by entry point
+        std::vector<const LexicalRule::CharClass*> classes; //boundaries, first one is empty
+
+        static std::vector<Atom> parse(const std::string& pattern);
+        void addClass(const LexicalRule::CharClass* boundary);
+        void addClasses(const LexicalRule::WordsTrieNode& node);
+        //index of class with same bytes, size of classes when there is none
+        unsigned classOf(const LexicalRule::CharClass* boundary) const;
+
+        void writeClasses(std::ostream& out) const;
+        void writePatterns(std::ostream& out) const;
+        void writeNode(std::ostream& out,const LexicalRule::WordsTrieNode& node,bool root,unsigned indent) const;
+        void writeTerminators(std::ostream& out) const;
+    public:
+        //definition of function
+        void writeSource(std::ostream& out) const;
+        //declaration of function, for source to include
+        void writeHeader(std::ostream& out) const;
+
+        //rule is not copied, it has to stay as it is until source is written
+        LexerGenerator(const LexicalRule& r,const std::string& function);
+        LexerGenerator(const LexerGenerator&) = delete;
+    };
+
+    //rule with matching done by a generated function, the rule it owns gives token creator and interned ids
+    class GeneratedLexer: public Rule
+    {
+    public:
+        typedef void (*Function)(const LexicalRule& rule,std::vector<TokenEntity>& source,Diagnostics* diagnostics,SymbolTable* symbols);
+    private:
+        std::unique_ptr<LexicalRule> rule;
+        Function function;
+    public:
+        const LexicalRule& getRule() const;
+
+        virtual void apply(std::vector<TokenEntity>& source) const override;
+        virtual void apply(std::vector<TokenEntity>& source,Diagnostics& diagnostics) const override;
+        virtual void apply(std::vector<TokenEntity>& source,TokenizeContext& context) const override;
+
+        GeneratedLexer(std::unique_ptr<LexicalRule>&& r,Function f);
+        GeneratedLexer(const GeneratedLexer&) = delete;
+    };
+}
+
+#endif // GENERATOR_H
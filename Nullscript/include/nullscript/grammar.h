@@ -0,0 +1,82 @@
+#ifndef GRAMMAR_H
+#define GRAMMAR_H
+
+#include <nullscript/nullscript.h>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+namespace NULLSCR
+{
+    /*
+        tokenizer that can be replaced while other threads tokenize with it
+        published tokenizers are compiled and never changed again, readers pin the current one
+        by writing the epoch they started in to a slot, without locking
+        replaced tokenizers are freed once no slot holds an epoch older than their replacement
+    */
+    class Grammar
+    {
+    private:
+        struct Slot
+        {
+            std::atomic<std::uint64_t> epoch; //0 when free
+            char padding[64 - sizeof(std::atomic<std::uint64_t>)]; //one reader per cache line
+        };
+
+        struct Version
+        {
+            std::unique_ptr<const Tokenizer> tokenizer;
+            std::uint64_t number;
+            Version(std::unique_ptr<Tokenizer>&& t,std::uint64_t n): tokenizer(std::move(t)), number(n) {};
+        };
+
+        std::atomic<const Version*> current;
+        std::atomic<std::uint64_t> epoch;
+        std::unique_ptr<Slot[]> slots;
+        unsigned slot_count;
+
+        std::mutex writer; //publishers only
+        std::vector<std::pair<std::uint64_t,const Version*>> retired; //with epoch of their replacement
+
+        unsigned pin() const;
+        void unpin(unsigned slot) const;
+        //frees retired versions older than every pinned epoch, writer has to be locked
+        std::size_t reclaim();
+    public:
+        //keeps version that was current when created alive until destroyed
+        class Reader
+        {
+        private:
+            const Grammar& grammar;
+            unsigned slot;
+            const Version* version;
+        public:
+            const Tokenizer& get() const;
+            const Tokenizer* operator -> () const;
+            std::uint64_t getVersion() const;
+
+            Reader(const Grammar& g);
+            Reader(const Reader&) = delete;
+            ~Reader();
+        };
+
+        //compiles tokenizer and makes it current, calls already running finish with previous one
+        //returns its version
+        std::uint64_t publish(std::unique_ptr<Tokenizer> tokenizer);
+        //frees replaced tokenizers no reader uses any more, returns how many are still in use
+        std::size_t collect();
+        std::uint64_t getVersion() const;
+
+        std::vector<TokenEntity> tokenize(const std::string& source) const;
+        //diagnostics name their stages by stage_name, stage is left null
+        std::vector<TokenEntity> tokenize(const std::string& source,Diagnostics& diagnostics) const;
+
+        //at most readers threads hold a Reader at once, others wait for a free slot
+        Grammar(std::unique_ptr<Tokenizer> tokenizer,unsigned readers = 64);
+        Grammar(const Grammar&) = delete;
+        //no readers may be left
+        ~Grammar();
+    };
+}
+
+#endif // GRAMMAR_H
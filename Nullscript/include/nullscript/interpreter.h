@@ -0,0 +1,163 @@
+#ifndef INTERPRETER_H
+#define INTERPRETER_H
+
+#include <nullscript/tokens.h>
+#include <cstdint>
+#include <functional>
+
+namespace NULLSCR
+{
+    namespace Interpreter
+    {
+        typedef double Value;
+        typedef std::function<Value(const Value*,unsigned)> Native;
+
+        /*
+            register machine, r is the register window of current frame:
+                Move a b        r[a] = r[b]
+                Const a w       r[a] = constants[w]
+                Add..Mod a b c  r[a] = r[b] op r[c]
+                Neg,Not a b     r[a] = op r[b]
+                Eq..Le a b c    r[a] = r[b] op r[c] ? 1 : 0
+                Jump w          continue at w
+                JumpIf(Not) a w continue at w if r[a] is (not) zero
+                Call a b c      r[b] = functions[c](r[b] .. r[b + a - 1]), callee window starts at r[b]
+                Native a b c    r[b] = natives[c](r[b] .. r[b + a - 1])
+                Return a        return r[a]
+            w is the wide operand, b | c << 16
+        */
+        namespace Ops
+        {
+            enum OPS
+            {
+                Move,
+                Const,
+                Add,
+                Sub,
+                Mul,
+                Div,
+                Mod,
+                Neg,
+                Not,
+                Eq,
+                Ne,
+                Lt,
+                Le,
+                Jump,
+                JumpIf,
+                JumpIfNot,
+                Call,
+                Native,
+                Return,
+                Count
+            };
+        }
+
+        struct Instruction
+        {
+            std::uint8_t op,a;
+            std::uint16_t b,c;
+
+            std::uint32_t wide() const
+            {
+                return b | (static_cast<std::uint32_t>(c) << 16);
+            }
+
+            Instruction(unsigned o,unsigned x,unsigned y,unsigned z): op(o), a(x), b(y), c(z) {};
+        };
+
+        class Program
+        {
+        public:
+            struct Function
+            {
+                std::string name;
+                std::size_t entry;
+                unsigned params,registers;
+            };
+
+            std::vector<Instruction> code;
+            std::vector<Value> constants;
+            std::vector<Function> functions; //first one runs top level code
+            std::vector<Native> natives;
+
+            int findFunction(const std::string& name) const;
+        };
+
+        //turns merged token trees into a program, handlers registered per entity type emit code for it
+        class Compiler
+        {
+        public:
+            //compiles entity so that its value ends up in given register
+            typedef std::function<void(Compiler&,const TokenEntity&,unsigned)> Handler;
+        private:
+            struct Function
+            {
+                unsigned index,top,registers;
+                std::vector<Instruction> code;
+                std::map<std::string,unsigned> locals;
+            };
+
+            std::vector<Handler> handlers;
+            std::vector<std::pair<std::string,Native>> natives;
+            std::map<std::string,unsigned> function_names;
+            std::map<std::uint64_t,unsigned> constant_ids;
+            std::vector<Function> open; //innermost last
+            Program program;
+
+            Function& current();
+        public:
+            void setHandler(unsigned type,const Handler& h);
+            bool hasHandler(unsigned type) const;
+            unsigned addNative(const std::string& name,const Native& f);
+            int findNative(const std::string& name) const;
+
+            //functions may be declared before their body is compiled, for recursion and forward calls
+            unsigned declare(const std::string& name,unsigned params);
+            int findFunction(const std::string& name) const;
+            unsigned beginFunction(const std::string& name,const std::vector<std::string>& params);
+            void endFunction();
+
+            //registers of current function, temporaries are released in stack order
+            unsigned local(const std::string& name);
+            int findLocal(const std::string& name) const;
+            unsigned temp();
+            unsigned getTop() const;
+            void release(unsigned top);
+            unsigned constant(Value v);
+
+            //positions are relative to current function
+            std::size_t emit(unsigned op,unsigned a = 0,unsigned b = 0,unsigned c = 0);
+            std::size_t emitWide(unsigned op,unsigned a,std::uint32_t w);
+            std::size_t here() const;
+            void patch(std::size_t at,std::size_t target);
+
+            void compile(const TokenEntity& entity,unsigned target);
+            //value of last entity is left in target
+            void compile(const std::vector<TokenEntity>& tokens,unsigned target);
+
+            Program build(const std::vector<TokenEntity>& tokens);
+        };
+
+        //executes a program, frames and registers are allocated once up front
+        class VM
+        {
+        private:
+            const Program& program;
+            std::vector<Value> registers;
+            std::vector<Frame> frames;
+            std::vector<const void*> threaded; //handler address of each instruction
+
+            Value execute(unsigned function);
+        public:
+            Value call(unsigned function,const std::vector<Value>& args = std::vector<Value>());
+            Value call(const std::string& name,const std::vector<Value>& args = std::vector<Value>());
+            Value run();
+
+            VM(const Program& p,std::size_t depth = 256,std::size_t size = 1 << 16);
+            VM(const VM&) = delete;
+        };
+    }
+}
+
+#endif // INTERPRETER_H
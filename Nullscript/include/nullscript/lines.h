@@ -0,0 +1,39 @@
+#ifndef LINES_H
+#define LINES_H
+
+#include <nullscript/nullscript.h>
+
+namespace NULLSCR
+{
+    //offsets of line starts, for turning token positions into line and column
+    class LineIndex
+    {
+    public:
+        struct Location
+        {
+            std::size_t line,column; //both start at 1, column counts bytes
+        };
+    private:
+        std::vector<Position> starts;
+        Position size_;
+    public:
+        //one scan for newlines, 16 bytes at a time where SSE2 is there,
+        //kept apart from lexing so that it holds for every rule setup and for skipped blocks
+        void build(const char* data,std::size_t size);
+        void build(const std::string& source);
+
+        //binary search over line starts, positions past the end map to the last line
+        Location locate(Position pos) const;
+        Position getLineStart(std::size_t line) const;
+        std::size_t getLines() const;
+        Position getSize() const;
+
+        LineIndex(): starts(1,0), size_(0) {};
+        LineIndex(const std::string& source): size_(0)
+        {
+            build(source);
+        }
+    };
+}
+
+#endif // LINES_H
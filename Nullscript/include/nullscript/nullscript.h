@@ -1,23 +1,31 @@
 #ifndef NULLSCRIPT_H
 #define NULLSCRIPT_H
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <memory>
 #include <map>
 #include <set>
+#include <deque>
 #include <exception>
+#include <stdexcept>
 #include <typeindex>
 
 namespace NULLSCR
 {
+    //byte offset into the source
+    typedef std::size_t Position;
+
     class Token
     {
     private:
-        unsigned pos;
+        Position pos;
     public:
-        unsigned getPos() const noexcept;
-        void setPos(unsigned p);
+        Position getPos() const noexcept;
+        void setPos(Position p);
 
         virtual std::unique_ptr<Token> clone() const = 0;
         virtual std::type_index getType() const = 0;
@@ -44,11 +52,67 @@ namespace NULLSCR
     {
     private:
         std::string err_;
+        Position pos_;
     public:
+        static const Position npos = static_cast<Position>(-1);
+
         const char* what() const noexcept;
+        Position getPos() const noexcept;
 
-        TokenizerException(unsigned pos,const std::string& error);
-        TokenizerException(const std::string& error): err_(error) {};
+        TokenizerException(Position pos,const std::string& error);
+        TokenizerException(const std::string& error): err_(error), pos_(npos) {};
+        //same error, with context prepended to message
+        TokenizerException(const std::string& prefix,const TokenizerException& cause): err_(prefix + cause.err_), pos_(cause.pos_) {};
+    };
+
+    class Stage;
+    class LineIndex;
+    class TokenizeContext;
+    class LexerCheckpoints;
+
+    //errors collected instead of thrown, storage is reserved up front
+    class Diagnostics
+    {
+    public:
+        enum Codes
+        {
+            ScopeMismatch,
+            UnclosedScope,
+            UnclosedBlock,
+            RuleFailed,
+            InvalidEncoding
+        };
+
+        struct Diagnostic
+        {
+            Position pos;
+            unsigned code;
+            const char* message;
+            const Stage* stage;
+            const char* stage_name; //set by detach, stays valid after stage is freed
+        };
+    private:
+        std::vector<Diagnostic> list;
+        std::deque<std::string> details;
+        std::size_t capacity,dropped;
+        const Stage* stage;
+    public:
+        //reports past capacity are counted, not stored
+        void report(Position pos,unsigned code,const char* message);
+        void report(Position pos,const std::string& message);
+
+        const std::vector<Diagnostic>& get() const;
+        std::size_t size() const;
+        std::size_t getDropped() const;
+        bool empty() const;
+        void clear();
+
+        void setStage(const Stage* s);
+        const Stage* getStage() const;
+        //copies names of stages of diagnostics from index on and forgets stages, for tokenizers that may be freed
+        void detach(std::size_t from = 0);
+
+        Diagnostics(std::size_t cap = 256);
     };
 
     class TokenEntity
@@ -65,23 +129,72 @@ namespace NULLSCR
         TokenEntity(TokenEntity&&) noexcept = default;
     };
 
+    //hash of configuration fed in the order it is set up, same in every process
+    class Fingerprint
+    {
+    private:
+        std::uint64_t h;
+    public:
+        Fingerprint& add(std::uint64_t v);
+        Fingerprint& add(const std::string& s);
+        std::uint64_t get() const;
+
+        Fingerprint(std::uint64_t seed = 0): h(seed) {};
+    };
+
     class Rule
     {
     public:
         virtual void apply(std::vector<TokenEntity>& data) const = 0;
+        //reports errors instead of throwing them, rules that can recover override this
+        virtual void apply(std::vector<TokenEntity>& data,Diagnostics& diagnostics) const;
+        //may keep its buffers in context, reports to diagnostics of context when it has them
+        virtual void apply(std::vector<TokenEntity>& data,TokenizeContext& context) const;
+        //prepares rule for applying, called by Stage::compile after rule was set up
+        virtual void compile() {};
+        //hash of what rule was set up with, functions given to it are left out
+        //rules that do not override it are told apart only by their class
+        virtual std::uint64_t fingerprint() const;
+        virtual ~Rule() = default;
     };
 
     class Stage
     {
     private:
         std::string name_;
+        std::vector<const Rule*> plan,planned; //what compile made of rules, and rules it was made from
+        std::vector<std::unique_ptr<Rule>> compiled;
+
+        bool isCompiled() const;
+        template<class F> void forEach(const F& f) const
+        {
+            if (isCompiled())
+            {
+                for (const Rule* rule: plan)
+                    f(*rule);
+            }
+            else
+            {
+                for (const auto& rule: rules)
+                    f(*rule);
+            }
+        }
     public:
         std::vector<std::unique_ptr<Rule>> rules;
 
+        //compiles rules and fuses runs of consecutive lexical ones, applies as before once rules are changed
+        void compile();
+        //rules to apply in order, compiled ones when they are up to date
+        std::vector<const Rule*> getPlan() const;
+
         void apply(std::vector<TokenEntity>& source) const;
+        void apply(std::vector<TokenEntity>& source,Diagnostics& diagnostics) const;
+        void apply(std::vector<TokenEntity>& source,TokenizeContext& context) const;
 
         std::string getName() const;
         void setName(const std::string& new_name);
+        //of name and fingerprints of rules
+        std::uint64_t fingerprint() const;
 
         Stage(const std::string& name): name_(name) {};
         Stage(Stage&&) noexcept = default;
@@ -89,12 +202,39 @@ namespace NULLSCR
     class Tokenizer
     {
         std::vector<std::unique_ptr<Stage>> stages;
+        bool fused;
+
+        void applyFused(std::vector<TokenEntity>& source,Diagnostics* diagnostics,TokenizeContext* context = nullptr) const;
     public:
         bool addStage(const std::string& name);
         Stage& getStage(const std::string& name) const;
         Stage* findStage(const std::string& name) const;
 
+        //feed lexical rules straight into merging rules that follow them, also across stages
+        void setFused(bool f);
+        bool isFused() const;
+        //compiles every stage
+        void compile();
+        //changes whenever stages or their rules are set up differently, cheap enough to ask for every source
+        std::uint64_t fingerprint() const;
+
         std::vector<TokenEntity> tokenize(const std::string& source) const;
+        //keeps going past errors, recording them in diagnostics
+        std::vector<TokenEntity> tokenize(const std::string& source,Diagnostics& diagnostics) const;
+        //also indexes line starts of source, for locating tokens and errors
+        //in a pass of its own before lexing, as lexers jump over text they do not have to match
+        std::vector<TokenEntity> tokenize(const std::string& source,LineIndex& lines) const;
+        //reuses buffers of context, returned tokens belong to it and are replaced by its next call
+        std::vector<TokenEntity>& tokenize(const std::string& source,TokenizeContext& context) const;
+
+        //checkpoints of lexing source by first rule of first stage, which has to be a LexicalRule
+        void index(const std::string& source,LexerCheckpoints& out,Position every = 1 << 16,Diagnostics* diagnostics = nullptr) const;
+        //tokens of source starting in [begin,end) inside the scopes holding them, lexed from nearest checkpoint and put through all stages,
+        //stages run one after another even when fused, tokens near ends of range may merge differently than in whole source
+        std::vector<TokenEntity> tokenizeRange(const std::string& source,const LexerCheckpoints& index,Position begin,Position end,
+                                               Diagnostics* diagnostics = nullptr) const;
+
+        Tokenizer(): fused(false) {};
     };
 
     namespace Interpreter
@@ -112,52 +252,259 @@ namespace NULLSCR
 
         template<typename T> class ScopedTrieNode
         {
-        private:
-            std::map<T,ScopedTrieNode<T>*> nodes;
         public:
-            unsigned action;
+            unsigned first,count; //range of edges owned by node
+            unsigned action,state; //state is index of scope entered by PushState
 
-            ScopedTrieNode<T>* at(T t)
-            {
-                return nodes.at(t);
-            }
-            void set(T t,ScopedTrieNode<T>* node)
-            {
-                nodes[t] = node;
-            }
-            void remove(T t);
+            ScopedTrieNode(unsigned f = 0): first(f), count(0), action(Actions::None), state(0) {};
         };
+        //nodes and edges live in two arrays, edges of a node are kept together and sorted by key
+        //a range that grows is moved to the end of edges first, holes left behind are packed once they are half of them
         template<typename T> class ScopedTrie
         {
+        public:
+            typedef unsigned Node;
+            static const Node npos = static_cast<Node>(-1);
         private:
-            std::set<ScopedTrieNode<T>*> nodes;
-            ScopedTrieNode<T> root;
+            struct Edge
+            {
+                T key;
+                Node target;
+                Edge(const T& k,Node t): key(k), target(t) {};
+            };
+
+            std::vector<ScopedTrieNode<T>> nodes;
+            std::vector<Edge> edges;
+            std::size_t holes; //edges owned by no node
+
+            std::size_t find(Node n,const T& t) const
+            {
+                auto b = edges.begin() + nodes[n].first,e = b + nodes[n].count;
+                return std::lower_bound(b,e,t,[](const Edge& a,const T& k)
+                {
+                    return a.key < k;
+                }) - edges.begin();
+            }
+            bool found(Node n,std::size_t at,const T& t) const
+            {
+                return at != nodes[n].first + nodes[n].count && !(t < edges[at].key);
+            }
         public:
-            ScopedTrieNode<T>* getRoot();
+            Node getRoot() const
+            {
+                return 0;
+            }
+            ScopedTrieNode<T>& get(Node n)
+            {
+                return nodes[n];
+            }
+            const ScopedTrieNode<T>& get(Node n) const
+            {
+                return nodes[n];
+            }
+            std::size_t size() const
+            {
+                return nodes.size();
+            }
+
+            Node step(Node n,const T& t) const
+            {
+                std::size_t at = find(n,t);
+                return found(n,at,t) ? edges[at].target : npos;
+            }
+            //edge changes touch only edges of n, stepping never allocates
+            void set(Node n,const T& t,Node target)
+            {
+                std::size_t at = find(n,t);
+                if (found(n,at,t))
+                {
+                    edges[at].target = target;
+                    return;
+                }
+                ScopedTrieNode<T>& node = nodes[n];
+                if (node.first + node.count != edges.size())
+                {
+                    std::size_t from = node.first;
+                    for (std::size_t i=from; i<from + node.count; ++i)
+                    {
+                        Edge e = edges[i];
+                        edges.push_back(e);
+                    }
+                    holes += node.count;
+                    node.first = edges.size() - node.count;
+                    at += node.first - from;
+                }
+                edges.insert(edges.begin() + at,Edge(t,target));
+                ++node.count;
+                if (holes > edges.size() / 2)
+                    pack();
+            }
+            //nodes left unreachable keep their slots
+            void remove(Node n,const T& t)
+            {
+                std::size_t at = find(n,t);
+                if (!found(n,at,t))
+                    return;
+                ScopedTrieNode<T>& node = nodes[n];
+                std::size_t end = node.first + node.count;
+                std::move(edges.begin() + at + 1,edges.begin() + end,edges.begin() + at);
+                --node.count;
+                if (end == edges.size())
+                    edges.pop_back();
+                else
+                    ++holes;
+                if (holes > edges.size() / 2)
+                    pack();
+            }
+            //drops holes and lays ranges out in order of nodes
+            void pack()
+            {
+                std::vector<Edge> packed;
+                packed.reserve(edges.size() - holes);
+                for (auto& i: nodes)
+                {
+                    std::size_t first = packed.size();
+                    packed.insert(packed.end(),edges.begin() + i.first,edges.begin() + i.first + i.count);
+                    i.first = first;
+                }
+                edges.swap(packed);
+                holes = 0;
+            }
+
+            Node addPath(const std::vector<T>& path)
+            {
+                return appendPath(getRoot(),path);
+            }
+            Node appendPath(Node origin,const std::vector<T>& path)
+            {
+                Node c = origin;
+                for (const auto& i: path)
+                {
+                    Node n = step(c,i);
+                    if (n == npos)
+                    {
+                        n = nodes.size();
+                        nodes.emplace_back(edges.size());
+                        set(c,i,n);
+                    }
+                    c = n;
+                }
+                return c;
+            }
+            void reserve(std::size_t n,std::size_t e)
+            {
+                nodes.reserve(n);
+                edges.reserve(e);
+            }
 
-            ScopedTrieNode<T>* addPath(const std::vector<T>& path);
-            ScopedTrieNode<T>* appendPath(ScopedTrieNode<T>* origin,const std::vector<T>& path);
+            ScopedTrie(): nodes(1), holes(0) {};
         };
 
+        //call record of the bytecode vm, see interpreter.h
         class Frame
         {
         public:
-            //
+            std::size_t pc,base; //return address while a callee runs, first register of window
+            unsigned function;
+
+            Frame(): pc(0), base(0), function(0) {};
         };
 
         template<typename T> class State
         {
         public:
-            ScopedTrie<T>* parsingScopePaths;
+            const ScopedTrie<T>* parsingScopePaths;
+            typename ScopedTrie<T>::Node node;
             Frame frame;
+
+            State(): parsingScopePaths(nullptr), node(0) {};
         };
 
+        //walks parse paths of the scope on top of a fixed size state stack
         template<typename T> class Interpreter
         {
         private:
-            std::map<std::string,ScopedTrie<T>> scopes;
+            std::vector<ScopedTrie<T>> scopes;
+            std::map<std::string,unsigned> names;
+            std::vector<State<T>> stack;
+            std::size_t depth;
         public:
-            //
+            //scopes are added before begin, as states point into them
+            unsigned addScope(const std::string& name)
+            {
+                auto it = names.find(name);
+                if (it != names.end())
+                    return it -> second;
+                depth = 0;
+                scopes.emplace_back();
+                names[name] = scopes.size() - 1;
+                return scopes.size() - 1;
+            }
+            int findScope(const std::string& name) const
+            {
+                auto it = names.find(name);
+                if (it == names.end())
+                    return -1;
+                return it -> second;
+            }
+            ScopedTrie<T>& getScope(unsigned i)
+            {
+                return scopes[i];
+            }
+
+            void begin(unsigned scope)
+            {
+                if (stack.empty())
+                    throw std::runtime_error("Interpreter exception: state stack overflow");
+                depth = 1;
+                stack[0] = State<T>();
+                stack[0].parsingScopePaths = &scopes[scope];
+            }
+            //advances current path, returns action of node reached; paths end at nodes with an action or without edges
+            unsigned feed(const T& t)
+            {
+                if (depth == 0)
+                    return Actions::None;
+                State<T>& s = stack[depth - 1];
+                const ScopedTrie<T>& trie = *s.parsingScopePaths;
+                typename ScopedTrie<T>::Node next = trie.step(s.node,t);
+                if (next == ScopedTrie<T>::npos && s.node != trie.getRoot()) //broken path, t may start another one
+                    next = trie.step(trie.getRoot(),t);
+                if (next == ScopedTrie<T>::npos)
+                {
+                    s.node = trie.getRoot();
+                    return Actions::None;
+                }
+                const ScopedTrieNode<T>& n = trie.get(next);
+                if (n.action == Actions::None)
+                {
+                    s.node = n.count ? next : trie.getRoot();
+                    return Actions::None;
+                }
+                s.node = trie.getRoot();
+                if ((n.action & Actions::PopState) && depth > 1)
+                    --depth;
+                if (n.action & Actions::PushState)
+                {
+                    if (depth == stack.size())
+                        throw std::runtime_error("Interpreter exception: state stack overflow");
+                    State<T>& p = stack[depth++];
+                    p = State<T>();
+                    p.parsingScopePaths = &scopes[n.state];
+                }
+                return n.action;
+            }
+
+            const State<T>& getState() const
+            {
+                return stack[depth - 1];
+            }
+            std::size_t getDepth() const
+            {
+                return depth;
+            }
+
+            Interpreter(std::size_t max_depth = 256): stack(max_depth), depth(0) {};
         };
     }
 }
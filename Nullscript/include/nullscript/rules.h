@@ -7,32 +7,88 @@
 #include <algorithm>
 #include <list>
 #include <set>
+#include <unordered_set>
+#include <cstdint>
 
 namespace NULLSCR
 {
+    class TokenizeContext;
+    class SymbolTable;
+    class LexerCheckpoints;
+
     class LexicalRule: public Rule
     {
+    public:
+        class Scratch;
+
+        //bytes that continue a word, keywords match only where bytes around them are not in class of their mode
+        class CharClass
+        {
+        private:
+            bool table[256];
+        public:
+            CharClass& add(unsigned char c);
+            CharClass& add(unsigned char from,unsigned char to);
+            CharClass& add(const std::string& chars);
+            CharClass& remove(unsigned char c);
+            CharClass& remove(const std::string& chars);
+
+            bool contains(char c) const
+            {
+                return table[static_cast<unsigned char>(c)];
+            }
+
+            //letters and digits, bytes of multibyte UTF-8 sequences count as letters
+            static CharClass word();
+            //letters, digits and underscore
+            static CharClass keyword();
+
+            CharClass()
+            {
+                for (auto& i: table)
+                    i = false;
+            };
+        };
+
+        //state of lexing one source between two steps, positions are offsets in it
+        struct Checkpoint
+        {
+            Position offset,lastOffset;
+            std::vector<unsigned> scopes;
+            std::vector<Position> opens,sizes; //where scopes were opened and size of text their tokens were made from
+            bool blocked;
+            Position block_start;
+            unsigned block_id;
+            //of point source
+            Position scan;
+            std::vector<Position> heads; //match every regex is at, npos when there are no more
+            bool skipped; //looking only for terminator of block
+
+            Checkpoint(): offset(0), lastOffset(0), blocked(false), block_start(0), block_id(0), scan(0), skipped(false) {};
+        };
     protected:
         struct RegexPoint
         {
             bool scoped;
             std::regex regex;
+            std::string pattern; //source of regex, empty when it was given compiled
             unsigned state,id;
-            RegexPoint(const std::regex& reg,unsigned i,unsigned s,bool sc): scoped(sc), regex(reg), state(s), id(i) {};
+            RegexPoint(const std::regex& reg,unsigned i,unsigned s,bool sc,const std::string& p = std::string()): scoped(sc), regex(reg), pattern(p), state(s), id(i) {};
         };
 
         struct WordPoint
         {
-            static bool checkChar(char c,unsigned mode);
-            unsigned id,state,mode,size;
+            unsigned id,state,size;
+            const CharClass* boundary; //of its mode, owned by rule or static
             bool scoped;
-            WordPoint(unsigned i,unsigned s,unsigned m,unsigned siz,bool sc): id(i), state(s), mode(m), size(siz), scoped(sc) {};
+            unsigned rule; //index of owning rule in a LexicalChain
+            WordPoint(unsigned i,unsigned s,const CharClass* b,unsigned siz,bool sc,unsigned r = 0): id(i), state(s), size(siz), boundary(b), scoped(sc), rule(r) {};
             WordPoint(const WordPoint&) = default;
         };
 
         struct WordsTrieNode
         {
-            std::unique_ptr<WordsTrieNode> nodes[128];
+            std::unique_ptr<WordsTrieNode> nodes[256];
             unsigned refs;
             std::unique_ptr<std::vector<WordPoint>> value;
 
@@ -56,29 +112,273 @@ namespace NULLSCR
 
         struct SavedPoint
         {
-            unsigned pos,state,id,size;
+            Position pos;
+            unsigned state,id;
+            Position size;
             bool scoped;
-            SavedPoint(unsigned p,unsigned st,unsigned i,unsigned siz,bool sc): pos(p), state(st),id(i), size(siz), scoped(sc) {};
+            SavedPoint(Position p,unsigned st,unsigned i,Position siz,bool sc): pos(p), state(st),id(i), size(siz), scoped(sc) {};
         };
 
         struct UnscopedBlock
         {
-            unsigned start,end,id;
-            UnscopedBlock(unsigned s,unsigned i): start(s), end(0), id(i) {};
+            Position start,end;
+            unsigned id;
+            UnscopedBlock(Position s,unsigned i): start(s), end(0), id(i) {};
+        };
+
+        //keywords closing unscoped blocks, by block id
+        struct Terminators
+        {
+            std::vector<std::pair<std::string,WordPoint>> words;
+            bool regex;
+            Terminators(): regex(false) {};
+        };
+
+        //yields parse points lazily, ordered by position, longer matches first
+        class PointSource
+        {
+        public:
+            //points before offset will be ignored by caller and may be skipped
+            virtual bool next(SavedPoint& out,Position offset) = 0;
+            //unscoped block id was opened, points before its end may be skipped
+            virtual void skip(unsigned,Position) {};
+            //false when state can not be resumed from, like with points of a position still pending
+            virtual bool save(Checkpoint&) const
+            {
+                return false;
+            }
+            virtual ~PointSource() = default;
+        };
+
+        class Scanner: public PointSource
+        {
+        protected:
+            struct RegexHead
+            {
+                std::sregex_iterator it;
+                Position origin; //match positions are relative to start of iteration
+                const RegexPoint* point;
+                RegexHead(const std::sregex_iterator& i,const RegexPoint* p): it(i), origin(0), point(p) {};
+            };
+
+            const LexicalRule& rule;
+            const std::string& source;
+            std::vector<RegexHead> heads;
+            std::vector<SavedPoint> pending,words;
+            unsigned pending_at;
+            Position scan;
+            Scratch* scratch; //lends its buffers for lifetime of scanner
+
+            virtual void walk(Position start);
+        public:
+            virtual bool next(SavedPoint& out,Position offset) override;
+            //finds nearest keyword terminator by byte search, regex heads restart from it
+            virtual void skip(unsigned id,Position offset) override;
+            virtual bool save(Checkpoint& out) const override;
+
+            Scanner(const LexicalRule& r,const std::string& s,Scratch* sc = nullptr);
+            //regex heads restart at matches they were at
+            Scanner(const LexicalRule& r,const std::string& s,const Checkpoint& c);
+            virtual ~Scanner();
+        };
+
+        //maximal munch, yields one point per position: longest match anchored there, regexes first on ties
+        //text it covers is not searched again, inside unscoped blocks only their terminators are looked for,
+        //so remainder of an unterminated block starts right after its opening
+        class LongestScanner: public PointSource
+        {
+        private:
+            struct RegexHead
+            {
+                const RegexPoint* point;
+                Position at,size; //leftmost match at or after last search start
+                RegexHead(const RegexPoint* p): point(p), at(0), size(0) {};
+            };
+
+            const LexicalRule& rule;
+            const std::string& source;
+            std::vector<RegexHead> heads;
+            std::vector<SavedPoint> words;
+            const Terminators* block;
+            unsigned blockId;
+            Position scan;
+
+            void search(RegexHead& h,Position start);
+            static void consider(const SavedPoint& p,SavedPoint& best,bool& found);
+        public:
+            virtual bool next(SavedPoint& out,Position offset) override;
+            virtual void skip(unsigned id,Position offset) override;
+            virtual bool save(Checkpoint& out) const override;
+
+            LongestScanner(const LexicalRule& r,const std::string& s);
+            //regex heads are searched again from scan, which finds matches they were at
+            LongestScanner(const LexicalRule& r,const std::string& s,const Checkpoint& c);
+        };
+
+        //receives tokens produced by Machine
+        class Sink
+        {
+        public:
+            virtual void insert(std::unique_ptr<Token>&& token,unsigned id) = 0;
+            virtual void open(std::unique_ptr<Token>&& token,unsigned id) = 0;
+            virtual void close() = 0;
+            //remainder of source, always placed at top level
+            virtual void tail(std::unique_ptr<Token>&& token) = 0;
+            virtual ~Sink() = default;
         };
 
+        //applies states of parse points one at a time
+        class Machine
+        {
+        private:
+            const LexicalRule& rule;
+            const std::string& source;
+            Position base;
+            PointSource& points;
+
+            Diagnostics* diagnostics;
+
+            std::vector<unsigned> scopes;
+            std::vector<Position> opens,sizes;
+            UnscopedBlock block;
+            bool blocked,done;
+            Position offset,lastOffset;
+            Scratch* scratch;
+            SymbolTable* symbols;
+
+            void mismatch(const SavedPoint& point,Sink& sink);
+        public:
+            bool step(Sink& sink);
+            const std::vector<unsigned>& getScopes() const;
+            //tokens made by later steps start at or after it
+            Position getLastOffset() const;
+            //false when done or when points can not be saved
+            bool save(Checkpoint& out) const;
+
+            //without diagnostics errors are thrown
+            Machine(const LexicalRule& r,const std::string& s,Position b,PointSource& p,Diagnostics* d = nullptr,Scratch* sc = nullptr,SymbolTable* sy = nullptr);
+            //resumes where checkpoint was saved, with encoding of source checked before
+            Machine(const LexicalRule& r,const std::string& s,Position b,PointSource& p,const Checkpoint& c,Diagnostics* d = nullptr,SymbolTable* sy = nullptr);
+            Machine(const Machine&) = delete;
+            ~Machine();
+        };
+
+        class Builder;
+        class RangeBuilder;
+        friend class LexicalChain;
+        friend class LexerGenerator;
+
         std::function<std::unique_ptr<Token>(const std::string&,unsigned)> creator;
+        bool utf8,skipping,longest;
+        std::map<unsigned,Terminators> terminators;
         std::vector<RegexPoint> entry_points;
         WordsTrie keyword_points; ///TODO: add connections to siblings?
+        std::deque<CharClass> classes; //custom modes, deque keeps them in place for word points
+        std::vector<bool> interned; //by id
+        Fingerprint config; //of parse points, modes and interned ids, in order they were added
+
+        const CharClass* getBoundary(unsigned mode) const;
+
+        //symbols of interned ids are made without creator when there is a table
+        std::unique_ptr<Token> create(const std::string& source,Position from,Position size,unsigned id,Position pos,SymbolTable* symbols = nullptr) const;
+        std::unique_ptr<PointSource> scan(const std::string& source,Scratch* scratch = nullptr) const;
+        std::unique_ptr<PointSource> resume(const std::string& source,const Checkpoint& checkpoint) const;
+        //keywords starting at start, with boundaries checked
+        void walk(const std::string& source,Position start,std::vector<SavedPoint>& out) const;
+        //first occurrence of word in [from,to) passing boundary checks, to when there is none
+        static Position findWord(const std::string& source,const std::string& word,const CharClass& boundary,Position from,Position to);
+        void lex(std::vector<TokenEntity>& source,Diagnostics* diagnostics,Scratch* scratch = nullptr,SymbolTable* symbols = nullptr) const;
+    public:
+        //buffers of one lexing pass, kept by TokenizeContext between calls
+        class Scratch
+        {
+        private:
+            friend class LexicalRule;
+            friend class LexicalChain;
+
+            std::vector<SavedPoint> pending,words;
+            std::vector<unsigned> scopes;
+            std::vector<Position> opens,sizes;
+            std::vector<TokenEntity> tokens;
+            std::vector<std::pair<unsigned,unsigned>> moved;
+        };
 
-        std::unique_ptr<Token> create(const std::string& source,unsigned id,unsigned pos) const;
+        typedef LexerCheckpoints Checkpoints;
 
-        void savePoints(const std::string& source, std::vector<SavedPoint>& ps) const;
-    public:
+        //pulls tokens of a single source one by one, keeping only open scopes in memory
+        class Cursor: private Sink
+        {
+        public:
+            enum Events
+            {
+                Insert,
+                Open,
+                Close
+            };
+        private:
+            struct Event
+            {
+                unsigned event;
+                TokenEntity entity;
+                Event(unsigned e,std::unique_ptr<Token>&& t,unsigned id): event(e), entity(std::move(t),id) {};
+            };
+
+            std::unique_ptr<PointSource> points;
+            Machine machine;
+            std::vector<Event> events;
+            unsigned events_at,opened;
+            std::vector<unsigned> scopes;
+
+            void closeAll();
+
+            virtual void insert(std::unique_ptr<Token>&& token,unsigned id) override;
+            virtual void open(std::unique_ptr<Token>&& token,unsigned id) override;
+            virtual void close() override;
+            virtual void tail(std::unique_ptr<Token>&& token) override;
+        public:
+            bool next();
+
+            unsigned getEvent() const;
+            //scopes left open at the end of source are closed before its remainder
+            //token of Insert and Open events, scopes are delivered empty
+            TokenEntity& get();
+            unsigned getDepth() const;
+            const std::vector<unsigned>& getScopes() const;
+
+            Cursor(const LexicalRule& rule,const std::string& source,Position base = 0,Diagnostics* diagnostics = nullptr,SymbolTable* symbols = nullptr);
+            Cursor(const Cursor&) = delete;
+        };
 
         void addParsePoint(const std::regex& reg,unsigned id,unsigned state = States::insert,bool scoped = false);
         void addParsePoint(const std::string& key,unsigned id,unsigned mode = Modes::Keyword,unsigned state = States::insert,bool scoped = false);
+        //regex given by its ECMAScript source, which is kept for LexerGenerator
+        void addParsePattern(const std::string& pattern,unsigned id,unsigned state = States::insert,bool scoped = false);
+        //registers boundaries for keywords, returns mode to add them with, unknown modes behave like String
+        unsigned addMode(const CharClass& word);
         void setTokenCreator(const std::function<std::unique_ptr<Token>(const std::string&,unsigned)>& f);
+        bool hasTokenCreator() const;
+        const std::function<std::unique_ptr<Token>(const std::string&,unsigned)>& getTokenCreator() const;
+        //text of id becomes a SymbolToken of table set in TokenizeContext instead of going through creator,
+        //0 stands for raw text between parse points, which is then not lexed by later rules, scopes are never interned
+        void setInterned(unsigned id,bool v = true);
+        bool isInterned(unsigned id) const;
+        //reject sources that are not well formed UTF-8 before lexing them
+        void setUtf8Validation(bool v);
+        bool hasUtf8Validation() const;
+        //jump over contents of unscoped blocks straight to their terminator instead of matching inside them
+        //blocks closed by a regex are scanned as usual
+        void setBlockSkipping(bool v);
+        bool hasBlockSkipping() const;
+        //lexes whole source taking a checkpoint about every given number of bytes, tokens are dropped
+        void index(const std::string& source,Checkpoints& out,Position every = 1 << 16,Diagnostics* diagnostics = nullptr) const;
+        //tokens of source starting in [begin,end), same as whole source would give with positions as offsets in it,
+        //lexed from nearest checkpoint, scopes opened before begin are made again around tokens of range they hold
+        //source is expected to be same as when indexed, with its encoding checked then
+        void tokenizeRange(const std::string& source,const Checkpoints& index,Position begin,Position end,std::vector<TokenEntity>& out,
+                           Diagnostics* diagnostics = nullptr,SymbolTable* symbols = nullptr) const;
+        //scan with LongestScanner instead of reporting every match at every position
+        void setLongestMatch(bool v);
+        bool hasLongestMatch() const;
 
         enum States
         {
@@ -95,10 +395,92 @@ namespace NULLSCR
         {
             Word,
             Keyword,
-            String
+            String, //no boundary checks
+            Custom //first mode returned by addMode
         };
 
         virtual void apply(std::vector<TokenEntity>& source) const override;
+        //mismatched scope ends are reported and skipped, or close the scopes above their match
+        virtual void apply(std::vector<TokenEntity>& source,Diagnostics& diagnostics) const override;
+        virtual void apply(std::vector<TokenEntity>& source,TokenizeContext& context) const override;
+        //regexes given compiled are told apart only by ids and states of their points
+        virtual std::uint64_t fingerprint() const override;
+
+        LexicalRule(): utf8(false), skipping(false), longest(false) {};
+    };
+
+    //checkpoints of one source taken by LexicalRule::index, in order of offset, may be stored along with source
+    class LexerCheckpoints
+    {
+    private:
+        friend class LexicalRule;
+
+        std::vector<LexicalRule::Checkpoint> list;
+        Position size,every;
+    public:
+        static const unsigned version = 2;
+
+        //last checkpoint with offset before pos, nullptr when lexing has to start at beginning of source
+        const LexicalRule::Checkpoint* find(Position pos) const;
+        std::size_t count() const;
+        Position getSourceSize() const;
+        Position getDistance() const;
+        void clear();
+
+        void encode(std::string& out) const;
+        //false for data of other versions or cut short, leaves checkpoints empty then
+        bool decode(const char* data,std::size_t size);
+        bool decode(const std::string& data);
+
+        LexerCheckpoints(): size(0), every(0) {};
+    };
+
+    //consecutive lexical rules applied in one pass, raw text left at top level by one rule goes straight to the next,
+    //so earlier rules take precedence just like when applied one after another
+    //keywords of all rules share one trie, walked once per position of source
+    class LexicalChain: public Rule
+    {
+    public:
+        //keyword walks of one source, kept by TokenizeContext between calls
+        class Scratch
+        {
+        private:
+            friend class LexicalChain;
+
+            struct Entry
+            {
+                Position pos;
+                std::size_t first,last;
+                Entry(Position p,std::size_t f,std::size_t l): pos(p), first(f), last(l) {};
+            };
+
+            std::vector<Entry> entries;
+            std::vector<const LexicalRule::WordPoint*> hits,found;
+        };
+    private:
+        class Walker;
+        class Scanner;
+        class Builder;
+
+        std::vector<const LexicalRule*> rules;
+        LexicalRule::WordsTrie keywords; //tagged with index of their rule
+
+        static void copyKeywords(const LexicalRule::WordsTrieNode& node,std::string& key,unsigned rule,LexicalRule::WordsTrie& out);
+        //first rule from level on that has a token creator
+        unsigned next(unsigned level) const;
+        void run(unsigned level,const StringToken& source,Position offset,Walker& walker,std::vector<TokenEntity>& out,Diagnostics* diagnostics,TokenizeContext* context) const;
+        void lex(std::vector<TokenEntity>& source,Diagnostics* diagnostics,TokenizeContext* context) const;
+    public:
+        const std::vector<const LexicalRule*>& getRules() const;
+
+        virtual void apply(std::vector<TokenEntity>& source) const override;
+        //diagnostics come in order of source rather than rule by rule
+        virtual void apply(std::vector<TokenEntity>& source,Diagnostics& diagnostics) const override;
+        virtual void apply(std::vector<TokenEntity>& source,TokenizeContext& context) const override;
+
+        //rules are not owned, keywords added to them later are not seen by the chain
+        LexicalChain(const std::vector<const LexicalRule*>& r);
+        LexicalChain(const LexicalChain&) = delete;
     };
 
     class ComplexRule: public Rule
@@ -107,6 +489,7 @@ namespace NULLSCR
         bool deep;
         std::function<void(std::vector<TokenEntity>&)> func;
 
+        using Rule::apply;
         virtual void apply(std::vector<TokenEntity>& source) const override;
 
         ComplexRule(const std::function<void(std::vector<TokenEntity>&)>& f,bool d = false): deep(d), func(f) {};
@@ -119,80 +502,230 @@ namespace NULLSCR
     public:
         struct TypesTrieNode
         {
-            TypesTrieNode* nodes[128];
+            static const unsigned npos = static_cast<unsigned>(-1);
+
+            TypesTrieNode* nodes[256];
             unsigned refs;
             int value;
+            unsigned id; //index within its trie, npos for nodes made outside of it
 
             TypesTrieNode& operator = (TypesTrieNode&& t) noexcept;
 
             TypesTrieNode* step(unsigned k) const;
             void set(unsigned k,TypesTrieNode* val);
 
-            TypesTrieNode():refs(1),value(-1)
+            TypesTrieNode():refs(1),value(-1),id(npos)
             {
                 for(auto& i: nodes)
                     i = nullptr;
             };
-            TypesTrieNode(int v):refs(0), value(v) {};
+            TypesTrieNode(int v):refs(0), value(v), id(npos) {};
             TypesTrieNode(const TypesTrieNode&) = delete;
             TypesTrieNode(TypesTrieNode&&) noexcept = default;
         };
         struct TypePoint
         {
-            unsigned type,begin,end;
-            TypePoint(unsigned b,unsigned e,unsigned t): type(t), begin(b), end(e) {};
+            unsigned type;
+            std::size_t begin,end;
+            TypePoint(std::size_t b,std::size_t e,unsigned t): type(t), begin(b), end(e) {};
             TypePoint(): type(0), begin(0), end(0) {};
         };
+        //sequence of types with repetition, matched like a path
+        struct TypePattern
+        {
+            enum Kinds
+            {
+                Type,
+                Sequence,
+                Either,
+                Repeat
+            };
+            static const unsigned many = static_cast<unsigned>(-1);
+
+            unsigned kind,type,min,max;
+            std::vector<TypePattern> items;
+
+            static TypePattern of(unsigned t);
+            static TypePattern path(const std::vector<unsigned>& types);
+            static TypePattern sequence(const std::vector<TypePattern>& items);
+            static TypePattern either(const std::vector<TypePattern>& items);
+            static TypePattern repeat(const TypePattern& p,unsigned min,unsigned max = many);
+            //numbers are types, each may be followed by *, +, ?, {m}, {m,} or {m,n},
+            //grouped with parentheses and alternatives separated by |, for example "2 (1 6)* 3"
+            static TypePattern parse(const std::string& text);
+
+            TypePattern(): kind(Type), type(0), min(1), max(1) {};
+        };
     private:
         class TypesTrie
         {
         private:
             std::set<TypesTrieNode*> nodes;
             TypesTrieNode root;
+            unsigned count;
         public:
             TypesTrieNode* add(const std::vector<unsigned>& key,int value);
             TypesTrieNode* append(TypesTrieNode* target,const std::vector<unsigned>& key,int value);
             void connect(const std::vector<unsigned>& key,TypesTrieNode* target);
             void connect(TypesTrieNode* start,const std::vector<unsigned>& key,TypesTrieNode* target);
+            TypesTrieNode* create();
 
             const TypesTrieNode* getRoot() const;
             TypesTrieNode* getRoot();
+            unsigned size() const;
 
-            TypesTrie() = default;
+            TypesTrie(): count(1)
+            {
+                root.id = 0;
+            };
             TypesTrie(const TypesTrie&) = delete;
             TypesTrie(TypesTrie&&) noexcept;
 
             ~TypesTrie();
         };
+        struct Nfa;
 
         TypesTrie type_points;
+        std::vector<std::pair<TypePattern,int>> patterns;
+        std::unique_ptr<TypesTrie> automaton; //deterministic union of paths and patterns
+        bool compiled;
+        Fingerprint config; //of paths and patterns, in order they were added
 
-        void savePoints(const std::vector<TypePoint>& in,std::vector<TypePoint>& out) const;
+        //walks shorter than this are not memoized, they are cheap enough to repeat
+        static const std::size_t memo_after = 8;
+
+        void build(TypesTrie& out) const;
     public:
+        //buffers of apply, may be reused between calls
+        struct Scratch
+        {
+            std::unordered_set<std::uint64_t> failed; //position and node no path can be completed from
+            std::vector<std::uint64_t> visited;
+        };
+
         TypesTrieNode* addTypePath(const std::vector<unsigned>& path,int v);
         TypesTrieNode* appendTypePath(TypesTrieNode* target,const std::vector<unsigned>& path,int v);
         void connectTypePath(const std::vector<unsigned>& path,TypesTrieNode* target);
         void connectTypePath(TypesTrieNode* start,const std::vector<unsigned>& path,TypesTrieNode* target);
-
+        //path ending at the same point as pattern wins over it, earlier pattern over later one
+        void addTypePattern(const TypePattern& pattern,int v);
+
+        //builds automaton of paths and patterns, until then layers with patterns build one on every apply
+        //has to be called again after their paths change
+        void compile();
+        bool isCompiled() const;
+        //paths added by changing nodes returned for them directly are not seen
+        std::uint64_t fingerprint() const;
+        //false when a path goes on after passing a type of ends, types of paths ending right at one are added to ends
+        bool stopsAt(std::vector<bool>& ends) const;
+
+        //leftmost longest paths replace points they cover, in time linear in number of points
         std::vector<TypePoint> apply(const std::vector<TypePoint>& in) const;
+        void apply(const std::vector<TypePoint>& in,std::vector<TypePoint>& out,Scratch& scratch) const;
 
-        MergingLayer() = default;
+        //merges points pushed one by one, holding back only those a longer path may still cover
+        class Stream
+        {
+        private:
+            const MergingLayer* layer;
+            std::unique_ptr<TypesTrie> local; //automaton of layer that was not compiled
+            const TypesTrie* automaton;
+            std::vector<TypePoint> buffer;
+            std::size_t at,dropped; //points before buffer
+
+            //walk from at, resumed as points arrive
+            const TypesTrieNode* node;
+            std::size_t reached,best;
+            int value;
+            bool stopped;
+            Scratch memo;
+
+            void restart();
+        public:
+            void push(const TypePoint& p);
+            //false when empty or more input is needed to decide
+            bool pop(TypePoint& out,bool finished);
+
+            Stream(const MergingLayer& l);
+        };
+
+        MergingLayer(): compiled(true) {};
         MergingLayer(const MergingLayer&) = delete;
         MergingLayer(MergingLayer&&) noexcept = default;
     };
 
     class LayeredMergingRule: public Rule
     {
+    public:
+        //buffers of one merging pass, kept by TokenizeContext between calls
+        struct Scratch
+        {
+            std::vector<MergingLayer::TypePoint> types,next;
+            MergingLayer::Scratch layer;
+            std::vector<std::unique_ptr<Token>> merged; //tokens of merged points, in order
+        };
     private:
-        std::function<std::unique_ptr<Token>(unsigned,unsigned,unsigned,const std::vector<TokenEntity>&)> merger;
-        std::unique_ptr<Token>merge(unsigned begin,unsigned end,unsigned type,const std::vector<TokenEntity>& source) const;
+        std::function<std::unique_ptr<Token>(std::size_t,std::size_t,unsigned,const std::vector<TokenEntity>&)> merger;
+        std::vector<bool> barriers; //by type
+        unsigned threads;
+        bool split; //barriers were checked against layers by compile
+
+        //lists shorter than this are merged on one thread
+        static const std::size_t split_after = 1 << 14;
+
+        std::unique_ptr<Token>merge(std::size_t begin,std::size_t end,unsigned type,const std::vector<TokenEntity>& source) const;
+        void reduce(std::vector<TokenEntity>& source,Scratch& scratch) const;
+        void reduceList(std::vector<TokenEntity>& source,Scratch& scratch) const;
+        //points of [from,to) through all layers and tokens of merged ones, source is left as it was
+        void mergeRange(const std::vector<TokenEntity>& source,std::size_t from,std::size_t to,Scratch& scratch) const;
+        //moves results of mergeRange into source from at on, returns where next range goes
+        static std::size_t place(std::vector<TokenEntity>& source,std::size_t at,Scratch& scratch);
+        //ends of parts for threads, cut right after barriers
+        void cut(const std::vector<TokenEntity>& source,std::vector<std::size_t>& ends) const;
     public:
         std::vector<MergingLayer> layers;
         bool deep;
-        void setTokenMerger(const std::function<std::unique_ptr<Token>(unsigned,unsigned,unsigned,const std::vector<TokenEntity>&)>& f);
-
+        //merger gets source with only entities of [begin,end) guaranteed to be unmerged,
+        //it is called from several threads at once when rule has more than one
+        void setTokenMerger(const std::function<std::unique_ptr<Token>(std::size_t,std::size_t,unsigned,const std::vector<TokenEntity>&)>& f);
+
+        bool hasTokenMerger() const;
+        //no path of any layer goes on past a token of barrier type, which lets long lists be split after them,
+        //checked by compile
+        void addBarrier(unsigned type);
+        bool isBarrier(unsigned type) const;
+        //lists with barriers are merged on up to n threads once rule is compiled, 0 for one per core
+        void setThreads(unsigned n);
+        unsigned getThreads() const;
+
+        using Rule::apply;
         virtual void apply(std::vector<TokenEntity>& source) const override;
-        LayeredMergingRule(): deep(false) {};
+        virtual void apply(std::vector<TokenEntity>& source,TokenizeContext& context) const override;
+        //compiles every layer, throws when a path goes on past a barrier
+        virtual void compile() override;
+        virtual std::uint64_t fingerprint() const override;
+        //lexes with given rule and merges its output as it is produced, without intermediate vector
+        void applyFused(const LexicalRule& lexer,std::vector<TokenEntity>& source,Diagnostics* diagnostics = nullptr,SymbolTable* symbols = nullptr) const;
+
+        //merges entities of one sequence as they arrive
+        class Stream
+        {
+        private:
+            const LayeredMergingRule* rule;
+            std::vector<MergingLayer::Stream> layers;
+            std::vector<TokenEntity> window;
+            std::size_t base,count;
+
+            void emit(const MergingLayer::TypePoint& p,std::vector<TokenEntity>& out);
+            void drain(std::vector<TokenEntity>& out,bool finished);
+        public:
+            void push(TokenEntity&& entity,std::vector<TokenEntity>& out);
+            void finish(std::vector<TokenEntity>& out);
+
+            Stream(const LayeredMergingRule& r);
+        };
+
+        LayeredMergingRule(): threads(1), split(false), deep(false) {};
     };
 }
 
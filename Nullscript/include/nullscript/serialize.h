@@ -0,0 +1,138 @@
+#ifndef SERIALIZE_H
+#define SERIALIZE_H
+
+#include <nullscript/tokens.h>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+
+namespace NULLSCR
+{
+    /*
+        binary token tree layout:
+            header: "NSTB" version(1 byte)
+            record: kind type pos payload, all numbers are LEB128 varints, pos is zigzag delta from previous sibling (parent for first child)
+            payload: string and custom kinds store length + bytes, scopes store ScopeToken::type, children byte length + children
+            symbols are stored as strings, their table is not part of the layout
+    */
+    namespace TokenKinds
+    {
+        enum KINDS
+        {
+            String = 0,
+            Scope = 1,
+            Custom = 2 //first id available for registered token classes
+        };
+    }
+
+    class TokenReader;
+
+    class TokenView
+    {
+        friend class TokenReader;
+    private:
+        const char* data_;
+        std::size_t size_;
+        std::uint64_t pos_;
+        unsigned kind_,type_,scopeType_;
+    public:
+        unsigned getKind() const;
+        unsigned getType() const;
+        std::uint64_t getPos() const;
+
+        bool isString() const;
+        bool isScope() const;
+
+        //string or custom payload, child records for scopes
+        const char* data() const;
+        std::size_t size() const;
+        std::string str() const;
+
+        unsigned getScopeType() const;
+        TokenReader children() const;
+
+        TokenView(): data_(nullptr), size_(0), pos_(0), kind_(0), type_(0), scopeType_(0) {};
+    };
+
+    class TokenReader
+    {
+    private:
+        const char *cur_,*end_;
+        std::uint64_t last_;
+        bool good_;
+
+        TokenReader(const char* begin,const char* end,std::uint64_t base): cur_(begin), end_(end), last_(base), good_(true) {};
+        friend class TokenView;
+    public:
+        //read next sibling, children of scopes are skipped over
+        bool next(TokenView& out);
+        bool good() const;
+        bool atEnd() const;
+
+        TokenReader(const char* data,std::size_t size);
+        TokenReader(const std::string& data): TokenReader(data.data(),data.size()) {};
+    };
+
+    class TokenCodec
+    {
+    public:
+        typedef std::function<void(const Token&,std::string&)> Encoder;
+        typedef std::function<std::unique_ptr<Token>(const char*,std::size_t)> Decoder;
+    private:
+        struct Hooks
+        {
+            unsigned kind;
+            Encoder encoder;
+            Decoder decoder;
+        };
+        std::unordered_map<std::type_index,Hooks> by_type;
+        std::unordered_map<unsigned,const Hooks*> by_kind;
+
+        void encode(const std::vector<TokenEntity>& tokens,std::uint64_t base,std::string& out) const;
+        bool decode(TokenReader reader,std::vector<TokenEntity>& out) const;
+    public:
+        static const unsigned version = 1;
+
+        static void writeVarint(std::uint64_t v,std::string& out);
+        static void writeString(const char* data,std::size_t size,std::string& out);
+        static void writeString(const std::string& s,std::string& out);
+        static bool readVarint(const char*& cur,const char* end,std::uint64_t& v);
+        static bool readString(const char*& cur,const char* end,std::string& s);
+
+        bool registerToken(std::type_index type,unsigned kind,const Encoder& encoder,const Decoder& decoder);
+        template<typename T> bool registerToken(unsigned kind,const Encoder& encoder,const Decoder& decoder)
+        {
+            return registerToken(typeid(T),kind,encoder,decoder);
+        }
+
+        void encode(const std::vector<TokenEntity>& tokens,std::string& out) const;
+        bool decode(const char* data,std::size_t size,std::vector<TokenEntity>& out) const;
+        bool decode(const std::string& data,std::vector<TokenEntity>& out) const;
+        std::unique_ptr<Token> decode(const TokenView& view) const;
+    };
+
+    class MappedFile
+    {
+    private:
+        const char* data_;
+        std::size_t size_;
+        std::string buffer_; //used where mapping is not available
+    public:
+        bool open(const std::string& path);
+        void close();
+        bool isOpen() const;
+
+        const char* data() const;
+        std::size_t size() const;
+
+        MappedFile(): data_(nullptr), size_(0) {};
+        MappedFile(const std::string& path): data_(nullptr), size_(0)
+        {
+            open(path);
+        }
+        MappedFile(const MappedFile&) = delete;
+        ~MappedFile();
+    };
+}
+
+#endif // SERIALIZE_H
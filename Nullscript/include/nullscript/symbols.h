@@ -0,0 +1,53 @@
+#ifndef SYMBOLS_H
+#define SYMBOLS_H
+
+#include <nullscript/tokens.h>
+#include <unordered_map>
+
+namespace NULLSCR
+{
+    //every distinct string stored once, ids given in order of first appearance starting at 0
+    //names stay in place until clear, so SymbolTokens may point at them
+    //not safe to share between threads that intern
+    class SymbolTable
+    {
+    private:
+        struct Key
+        {
+            const char* data;
+            std::size_t size;
+        };
+        struct KeyHash
+        {
+            std::size_t operator () (const Key& key) const;
+        };
+        struct KeyEqual
+        {
+            bool operator () (const Key& a,const Key& b) const;
+        };
+
+        std::deque<std::string> names;
+        std::unordered_map<Key,unsigned,KeyHash,KeyEqual> ids; //keys point into names
+        std::size_t bytes;
+    public:
+        static const unsigned npos = static_cast<unsigned>(-1);
+
+        unsigned intern(const char* data,std::size_t size);
+        unsigned intern(const std::string& name);
+        //npos for names never interned
+        unsigned find(const char* data,std::size_t size) const;
+        unsigned find(const std::string& name) const;
+
+        const std::string& get(unsigned id) const;
+        std::size_t size() const;
+        //bytes of names, without overhead of containers
+        std::size_t getBytes() const;
+        //invalidates SymbolTokens made with table
+        void clear();
+
+        SymbolTable(): bytes(0) {};
+        SymbolTable(const SymbolTable&) = delete;
+    };
+}
+
+#endif // SYMBOLS_H
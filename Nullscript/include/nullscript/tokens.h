@@ -28,11 +28,85 @@ namespace NULLSCR
         }
         std::string str;
 
-        StringToken(unsigned pos,const std::string& s): str(s) { setPos(pos); };
+        StringToken(Position pos,const std::string& s): str(s) { setPos(pos); };
         StringToken(const StringToken&) = default;
         StringToken(StringToken&&) noexcept = default;
     };
 
+    //name stored once in a SymbolTable, tokens of same table with equal names have equal ids
+    //table belongs to caller and is not kept alive by tokens, copies and clones point into same table
+    class SymbolToken: public TokenBase<SymbolToken>
+    {
+    public:
+        virtual char const* getName() const
+        {
+            return "symbol";
+        }
+        unsigned id;
+        const std::string* str; //owned by table, valid until it is cleared or freed
+
+        SymbolToken(Position pos,unsigned i,const std::string& s): id(i), str(&s) { setPos(pos); };
+        SymbolToken(const SymbolToken&) = default;
+    };
+
+    //copy-on-write list of child tokens, copies share storage until one of them is edited
+    //editing a shared list copies only this level, nested scopes stay shared
+    //all access but edit is read only, so lists are never copied unless asked to
+    //edit only lists of trees no other thread reads, tokens of shared trees like cached results are cloned first
+    class TokenList
+    {
+    private:
+        std::shared_ptr<std::vector<TokenEntity>> data_;
+    public:
+        typedef std::vector<TokenEntity>::const_iterator const_iterator;
+
+        const std::vector<TokenEntity>& get() const;
+        std::vector<TokenEntity>& edit();
+        bool isShared() const;
+
+        operator const std::vector<TokenEntity>& () const
+        {
+            return get();
+        }
+
+        const_iterator begin() const
+        {
+            return get().begin();
+        }
+        const_iterator end() const
+        {
+            return get().end();
+        }
+
+        std::size_t size() const
+        {
+            return get().size();
+        }
+        bool empty() const
+        {
+            return get().empty();
+        }
+        const TokenEntity& operator [] (std::size_t i) const
+        {
+            return get()[i];
+        }
+        const TokenEntity& back() const
+        {
+            return get().back();
+        }
+
+        void clear()
+        {
+            data_.reset();
+        }
+
+        TokenList() = default;
+        TokenList(const TokenList&) = default;
+        TokenList(TokenList&&) noexcept = default;
+        TokenList& operator = (const TokenList&) = default;
+        TokenList& operator = (TokenList&&) noexcept = default;
+    };
+
     class ScopeToken: public TokenBase<ScopeToken>
     {
     public:
@@ -41,14 +115,16 @@ namespace NULLSCR
             return "scope";
         }
         unsigned type;
-        std::vector<TokenEntity> tokens;
+        TokenList tokens;
 
-        ScopeToken(unsigned pos):type(0) { setPos(pos); };
-        ScopeToken(unsigned pos,unsigned t):type(t) { setPos(pos); };
-        ScopeToken(const ScopeToken&);
+        ScopeToken(Position pos):type(0) { setPos(pos); };
+        ScopeToken(Position pos,unsigned t):type(t) { setPos(pos); };
+        ScopeToken(const ScopeToken&) = default;
         ScopeToken(ScopeToken&&) noexcept = default;
+        ~ScopeToken();
     };
 
+    //text dump of TokenWriter, which is better used directly for large trees
     void printTokens(const std::vector<TokenEntity>& tokens,std::ostream& out,bool recursive = false,unsigned off = 0);
 }
 
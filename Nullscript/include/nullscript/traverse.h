@@ -0,0 +1,75 @@
+#ifndef TRAVERSE_H
+#define TRAVERSE_H
+
+#include <nullscript/tokens.h>
+
+namespace NULLSCR
+{
+    /*
+        depth first walks over token trees, with a stack on the heap instead of recursion,
+        so depth of nesting is limited only by memory:
+            visit       enter(entity,depth) for every entity, it returns whether to go into children of scopes,
+                        leave(entity,depth) after children of entities enter returned true for, depth is 0 for entities of given list
+            postOrder   f(list) for lists of scope children and then for given list, inner lists first,
+                        f may change the list it gets, lists are made unique before they are handed out
+    */
+    template<class Enter,class Leave> void visit(const std::vector<TokenEntity>& tokens,const Enter& enter,const Leave& leave)
+    {
+        std::vector<std::pair<const std::vector<TokenEntity>*,std::size_t>> stack;
+        stack.emplace_back(&tokens,0);
+        while (!stack.empty())
+        {
+            if (stack.back().second == stack.back().first -> size())
+            {
+                stack.pop_back();
+                if (!stack.empty())
+                    leave((*stack.back().first)[stack.back().second - 1],stack.size() - 1);
+                continue;
+            }
+            const TokenEntity& entity = (*stack.back().first)[stack.back().second++];
+            if (!enter(entity,stack.size() - 1))
+                continue;
+            ScopeToken* sc = entity.token -> as<ScopeToken>();
+            if (sc != nullptr)
+                stack.emplace_back(&sc -> tokens.get(),0);
+            else
+                leave(entity,stack.size() - 1);
+        }
+    }
+
+    template<class F> void postOrder(std::vector<TokenEntity>& tokens,const F& f)
+    {
+        std::vector<std::pair<std::vector<TokenEntity>*,std::size_t>> stack;
+        stack.emplace_back(&tokens,0);
+        while (!stack.empty())
+        {
+            std::vector<TokenEntity>& list = *stack.back().first;
+            if (stack.back().second == list.size())
+            {
+                stack.pop_back();
+                f(list);
+                continue;
+            }
+            ScopeToken* sc = list[stack.back().second++].token -> as<ScopeToken>();
+            if (sc != nullptr)
+                stack.emplace_back(&sc -> tokens.edit(),0);
+        }
+    }
+
+    //hooks of visit as virtual functions, for visitors kept around as objects
+    class TokenVisitor
+    {
+    public:
+        virtual bool enter(const TokenEntity&,std::size_t)
+        {
+            return true;
+        }
+        virtual void leave(const TokenEntity&,std::size_t) {};
+
+        void visit(const std::vector<TokenEntity>& tokens);
+
+        virtual ~TokenVisitor() = default;
+    };
+}
+
+#endif // TRAVERSE_H
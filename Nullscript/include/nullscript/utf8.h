@@ -0,0 +1,19 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <nullscript/nullscript.h>
+
+namespace NULLSCR
+{
+    namespace Utf8
+    {
+        //length of leading run of bytes below 0x80
+        std::size_t asciiPrefix(const char* data,std::size_t size);
+        //offset of first byte not part of a well formed sequence, size when whole input is valid
+        //overlong forms, surrogates and code points past U+10FFFF are rejected
+        Position validate(const char* data,std::size_t size);
+        Position validate(const std::string& source);
+    }
+}
+
+#endif // UTF8_H
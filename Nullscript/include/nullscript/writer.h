@@ -0,0 +1,60 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <nullscript/tokens.h>
+#include <cstdint>
+
+namespace NULLSCR
+{
+    /*
+        dumps token trees through a buffer of fixed size, flushed to a file descriptor or a stream when full
+            Text    (name:type) per line followed by text of strings and symbols, children of scopes indented and closed by end
+            Json    one array per write, tokens as {"name","type","pos"} with "str" for strings and symbols, "symbol" for their id,
+                    "scope" and "tokens" for scopes, strings are escaped byte by byte
+    */
+    class TokenWriter
+    {
+    public:
+        enum Formats
+        {
+            Text,
+            Json
+        };
+    private:
+        std::unique_ptr<char[]> buffer;
+        std::size_t capacity,used;
+        int fd;
+        std::ostream* stream;
+        unsigned format,indent;
+        bool recursive,failed;
+
+        void send(const char* data,std::size_t size);
+        void put(const char* data,std::size_t size);
+        void put(char c);
+        void put(const char* s);
+        void putNumber(std::uint64_t v);
+        void putSpaces(std::size_t n);
+        void putEscaped(const char* data,std::size_t size);
+        void putName(const Token& token);
+
+        void writeText(const std::vector<TokenEntity>& tokens);
+        void writeJson(const std::vector<TokenEntity>& tokens);
+    public:
+        //children of scopes are written only when recursive
+        void setRecursive(bool r);
+        //spaces before every line of text, two more for each level of nesting
+        void setIndent(unsigned i);
+
+        void write(const std::vector<TokenEntity>& tokens);
+        bool flush();
+        //false once writing to descriptor or stream failed
+        bool good() const;
+
+        TokenWriter(int descriptor,unsigned f = Text,std::size_t size = 1 << 16);
+        TokenWriter(std::ostream& out,unsigned f = Text,std::size_t size = 1 << 16);
+        TokenWriter(const TokenWriter&) = delete;
+        ~TokenWriter();
+    };
+}
+
+#endif // WRITER_H
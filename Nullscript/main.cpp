@@ -3,8 +3,35 @@
 #include <nullscript/nullscript.h>
 #include <nullscript/rules.h>
 #include <nullscript/tokens.h>
+#include <nullscript/context.h>
+#include <nullscript/serialize.h>
+#include <nullscript/traverse.h>
+#include <nullscript/writer.h>
+#include <nullscript/symbols.h>
+#include <nullscript/generator.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
 #include <functional>
+#include <iterator>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
 
 using namespace std;
 using namespace NULLSCR;
@@ -64,7 +91,7 @@ void setupLex(Stage& st)
     LexicalRule *rl = new LexicalRule();
     st.rules.push_back(std::unique_ptr<Rule>(rl));
 
-    rl->addParsePoint(std::regex("\\s"),Ids::None,LexicalRule::States::forget,false);
+    rl->addParsePattern("\\s",Ids::None,LexicalRule::States::forget,false);
     rl->addParsePoint("#",Ids::None,LexicalRule::Modes::String,LexicalRule::States::push,false);
     rl->addParsePoint("\n",Ids::None,LexicalRule::Modes::String,LexicalRule::States::silentpop,false);
 
@@ -76,6 +103,9 @@ void setupLex(Stage& st)
     rl->addParsePoint("uniform",Ids::Uniform,LexicalRule::Modes::String,LexicalRule::States::insert,false);
     for (auto i:types)
         rl->addParsePoint(i,Ids::Type,LexicalRule::Modes::String,LexicalRule::States::insert,false);
+    //only when tokenized with a symbol table
+    rl->setInterned(Ids::None);
+    rl->setInterned(Ids::Type);
 
     rl->setTokenCreator([](const string& source,unsigned type){
                             switch (type)
@@ -90,13 +120,22 @@ void setupLex(Stage& st)
                         });
 }
 
-void setupMrg(Stage& st)
+const string& text(const TokenEntity& entity)
+{
+    if (entity.token->getType() == typeid(SymbolToken))
+        return *entity.token->forceAs<SymbolToken>().str;
+    return entity.token->forceAs<StringToken>().str;
+}
+
+void setupMrg(Stage& st,unsigned threads)
 {
     LayeredMergingRule *mrg = new LayeredMergingRule();
     st.rules.push_back(std::unique_ptr<Rule>(mrg));
     mrg->deep = true;
     mrg->layers.push_back(MergingLayer());
     mrg->layers[0].addTypePath({Ids::Type,Ids::None,Ids::Semicolon},Ids::Variable);
+    mrg->addBarrier(Ids::Semicolon);
+    mrg->setThreads(threads);
 
     mrg->setTokenMerger([](unsigned b,unsigned e,unsigned t,const std::vector<TokenEntity>& source)
                         {
@@ -104,40 +143,444 @@ void setupMrg(Stage& st)
                             {
                                 case Ids::Variable:
                                 {
-                                    return std::unique_ptr<Token>(new VariableToken(source[b].token->forceAs<StringToken>().str,
-                                                                                    source[b+1].token->forceAs<StringToken>().str));
+                                    return std::unique_ptr<Token>(new VariableToken(text(source[b]),text(source[b+1])));
                                 }
                             }
                             return std::unique_ptr<Token>(new StringToken(0,""));
                         });
 }
 
-void setup(Tokenizer& t)
+void setup(Tokenizer& t,unsigned threads = 1)
 {
     t.addStage("lex");
     t.addStage("mrg");
 
     setupLex(t.getStage("lex"));
-    setupMrg(t.getStage("mrg"));
+    setupMrg(t.getStage("mrg"),threads);
 }
 
-int main()
+//tokenizes files in parallel and reports throughput, without paths stdin is tokenized and printed
+struct Options
 {
-    Tokenizer t;
-    setup(t);
+    unsigned threads,repeat,merging;
+    unsigned checkpoints; //kilobytes between lexer checkpoints, 0 for none
+    int dump; //-1 for none, TokenWriter format or Binary
+    std::string output,generated;
+    std::vector<std::string> extensions;
+    bool quiet,fused,symbols;
+
+    static const int Binary = 16;
+
+    Options(): threads(std::max(1u,std::thread::hardware_concurrency())), repeat(1), merging(1), checkpoints(0), dump(-1), output("."), quiet(false), fused(false), symbols(false) {};
+};
+
+struct Job
+{
+    std::string path;
+    std::size_t bytes,tokens,errors;
+    double seconds;
+    std::string failure;
+
+    Job(const std::string& p): path(p), bytes(0), tokens(0), errors(0), seconds(0) {};
+};
+
+typedef std::chrono::steady_clock Clock;
+
+//seconds of cpu time used by calling thread, so that files are timed fairly when threads outnumber cores
+double threadTime()
+{
+#if !defined(_WIN32) && defined(CLOCK_THREAD_CPUTIME_ID)
+    timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts) == 0)
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+    return std::chrono::duration<double>(Clock::now().time_since_epoch()).count();
+}
+
+void usage()
+{
+    cerr << "usage: nullscript [options] [paths...]\n"
+            "  -j N        worker threads, default is number of cores\n"
+            "  -r N        tokenize every file N times, times are reported per repetition\n"
+            "  -m N        merge long statement lists on N threads, 0 for one per core\n"
+            "  -d FORMAT   dump tokens of every file as text, json or binary\n"
+            "  -o DIR      directory for dumps, default is current one\n"
+            "  -c KB       store lexer checkpoints every KB kilobytes of every file in DIR, for tokenizing ranges\n"
+            "  -e EXT      only take files ending with EXT from directories, may be repeated\n"
+            "  -f          fuse lexing and merging\n"
+            "  -s          store names once per thread, in a symbol table\n"
+            "  -g NAME     write lexer specialized for the grammar as NAME.cpp and NAME.h and exit\n"
+            "  -q          print only totals\n"
+            "directories are searched recursively, without paths stdin is tokenized and printed\n";
+}
+
+bool hasExtension(const std::string& path,const Options& options)
+{
+    if (options.extensions.empty())
+        return true;
+    for (const auto& i: options.extensions)
+    {
+        if (path.size() >= i.size() && path.compare(path.size() - i.size(),i.size(),i) == 0)
+            return true;
+    }
+    return false;
+}
 
-    string a;
-    string l;
-    getline(cin,l);
-    a = l;
-    while (!cin.eof() && l.length() > 0)
+//files below path in sorted order, path itself when it is not a directory
+void collect(const std::string& path,const Options& options,std::vector<Job>& jobs,bool top)
+{
+#ifndef _WIN32
+    struct stat st;
+    if (stat(path.c_str(),&st) == 0 && S_ISDIR(st.st_mode))
+    {
+        DIR* dir = opendir(path.c_str());
+        if (dir == nullptr)
+        {
+            jobs.emplace_back(path);
+            jobs.back().failure = "cannot open directory";
+            return;
+        }
+        std::vector<std::string> names;
+        while (dirent* e = readdir(dir))
+        {
+            if (e -> d_name[0] != '.')
+                names.push_back(e -> d_name);
+        }
+        closedir(dir);
+        std::sort(names.begin(),names.end());
+        for (const auto& i: names)
+            collect(path + "/" + i,options,jobs,false);
+        return;
+    }
+#endif
+    if (top || hasExtension(path,options))
+        jobs.emplace_back(path);
+}
+
+std::size_t countTokens(const std::vector<TokenEntity>& tokens)
+{
+    std::size_t ret = 0;
+    visit(tokens,[&ret](const TokenEntity&,std::size_t)
+    {
+        ++ret;
+        return true;
+    },[](const TokenEntity&,std::size_t) {});
+    return ret;
+}
+
+std::string outputName(const std::string& path,const Options& options)
+{
+    std::string name = path;
+    while (name.compare(0,2,"./") == 0 || name.compare(0,1,"/") == 0)
+        name.erase(0,name[0] == '/' ? 1 : 2);
+    std::replace(name.begin(),name.end(),'/','_');
+    return options.output + "/" + name;
+}
+
+std::string dumpPath(const std::string& path,const Options& options)
+{
+    std::string name = outputName(path,options);
+    if (options.dump == TokenWriter::Json)
+        return name + ".json";
+    if (options.dump == Options::Binary)
+        return name + ".nstb";
+    return name + ".txt";
+}
+
+//loops over short writes, false on error
+bool writeAll(int fd,const std::string& data)
+{
+    const char* at = data.data();
+    std::size_t size = data.size();
+    while (size)
     {
-        getline(cin,l);
-        a +='\n' + l;
+        long n = write(fd,at,size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        at += n;
+        size -= n;
     }
+    return true;
+}
 
+bool dump(const std::vector<TokenEntity>& tokens,const std::string& path,const Options& options,const TokenCodec& codec,std::string& encoded)
+{
+    //encoding throws on unregistered tokens, file is opened after it so that no empty dump is left behind
+    if (options.dump == Options::Binary)
+    {
+        encoded.clear();
+        codec.encode(tokens,encoded);
+    }
+    int fd = open(path.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0644);
+    if (fd < 0)
+        return false;
+    bool ok;
+    if (options.dump == Options::Binary)
+    {
+        ok = writeAll(fd,encoded);
+    }
+    else
+    {
+        TokenWriter writer(fd,options.dump);
+        writer.write(tokens);
+        ok = writer.flush();
+    }
+    return close(fd) == 0 && ok;
+}
+
+//checkpoints of lex stage, from which tokens of a range can be had without lexing whole file
+bool writeCheckpoints(const Tokenizer& t,const std::string& source,const std::string& path,const Options& options,std::string& encoded)
+{
+    LexerCheckpoints index;
+    Diagnostics diagnostics(64);
+    t.index(source,index,options.checkpoints * 1024,&diagnostics);
+    encoded.clear();
+    index.encode(encoded);
+    int fd = open((outputName(path,options) + ".nscp").c_str(),O_WRONLY | O_CREAT | O_TRUNC,0644);
+    if (fd < 0)
+        return false;
+    bool ok = writeAll(fd,encoded);
+    return close(fd) == 0 && ok;
+}
+
+//whole file into data, which keeps its capacity between files
+bool readFile(const std::string& path,std::string& data)
+{
+    int fd = open(path.c_str(),O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd,&st) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    data.resize(st.st_size);
+    std::size_t at = 0;
+    while (at < data.size())
+    {
+        long n = read(fd,&data[at],data.size() - at);
+        if (n <= 0)
+            break;
+        at += n;
+    }
+    data.resize(at);
+    return close(fd) == 0;
+}
+
+void work(const Tokenizer& t,const Options& options,std::vector<Job>& jobs,const std::vector<std::size_t>& order,std::atomic<std::size_t>& next)
+{
+    Diagnostics diagnostics(64);
+    TokenizeContext context(&diagnostics);
+    SymbolTable symbols;
+    if (options.symbols)
+        context.setSymbols(&symbols);
+    TokenCodec codec;
+    codec.registerToken<VariableToken>(TokenKinds::Custom,[](const Token& token,std::string& out)
+    {
+        const VariableToken& v = static_cast<const VariableToken&>(token);
+        TokenCodec::writeString(v.type,out);
+        TokenCodec::writeString(v.name,out);
+    },[](const char* data,std::size_t size)
+    {
+        const char* end = data + size;
+        std::string type,name;
+        if (!TokenCodec::readString(data,end,type) || !TokenCodec::readString(data,end,name))
+            return std::unique_ptr<Token>();
+        return std::unique_ptr<Token>(new VariableToken(type,name));
+    });
+    std::string encoded,source;
+    for (std::size_t i = next++; i < order.size(); i = next++)
+    {
+        Job& job = jobs[order[i]];
+        if (!job.failure.empty())
+            continue;
+        if (!readFile(job.path,source))
+        {
+            job.failure = "cannot open file";
+            continue;
+        }
+        try
+        {
+            job.bytes = source.size();
+            double begin = threadTime();
+            for (unsigned r=0; r<options.repeat; ++r)
+            {
+                diagnostics.clear();
+                t.tokenize(source,context);
+            }
+            job.seconds = (threadTime() - begin) / options.repeat;
+            job.tokens = countTokens(context.getTokens());
+            job.errors = diagnostics.size() + diagnostics.getDropped();
+            if (options.dump != -1 && !dump(context.getTokens(),dumpPath(job.path,options),options,codec,encoded))
+                job.failure = "cannot write dump";
+            if (options.checkpoints && !writeCheckpoints(t,source,job.path,options,encoded))
+                job.failure = "cannot write checkpoints";
+        }
+        catch (std::exception& e)
+        {
+            job.failure = e.what();
+        }
+    }
+}
+
+double peakMemory()
+{
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF,&usage) == 0)
+        return usage.ru_maxrss / 1024.0; //kilobytes on linux
+#endif
+    return 0;
+}
+
+int printStdin(Tokenizer& t)
+{
+    string a((istreambuf_iterator<char>(cin)),istreambuf_iterator<char>());
     auto v = t.tokenize(a);
-    printTokens(v,cout,true,0);
+    TokenWriter writer(1);
+    writer.write(v);
+    return writer.flush() ? 0 : 1;
+}
 
+//source of a lexer specialized for lex stage, to be compiled into a program using GeneratedLexer
+int generate(Tokenizer& t,const Options& options)
+{
+    const LexicalRule& rule = dynamic_cast<const LexicalRule&>(*t.getStage("lex").rules[0]);
+    std::string path = options.output + "/" + options.generated;
+    try
+    {
+        LexerGenerator generator(rule,options.generated);
+        std::ofstream source(path + ".cpp"),header(path + ".h");
+        generator.writeSource(source);
+        generator.writeHeader(header);
+        if (!source || !header)
+        {
+            cerr << "cannot write " << path << "\n";
+            return 1;
+        }
+    }
+    catch (std::logic_error& e)
+    {
+        cerr << e.what() << "\n";
+        return 1;
+    }
     return 0;
 }
+
+int main(int argc,char** argv)
+{
+    Options options;
+    std::vector<std::string> paths;
+    for (int i=1; i<argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool value = i + 1 < argc;
+        if (arg == "-j" && value)
+            options.threads = std::max(1,atoi(argv[++i]));
+        else if (arg == "-r" && value)
+            options.repeat = std::max(1,atoi(argv[++i]));
+        else if (arg == "-m" && value)
+            options.merging = std::max(0,atoi(argv[++i]));
+        else if (arg == "-c" && value)
+            options.checkpoints = std::max(0,atoi(argv[++i]));
+        else if (arg == "-o" && value)
+            options.output = argv[++i];
+        else if (arg == "-g" && value)
+            options.generated = argv[++i];
+        else if (arg == "-e" && value)
+            options.extensions.push_back(argv[++i]);
+        else if (arg == "-d" && value)
+        {
+            std::string f = argv[++i];
+            if (f == "text")
+                options.dump = TokenWriter::Text;
+            else if (f == "json")
+                options.dump = TokenWriter::Json;
+            else if (f == "binary")
+                options.dump = Options::Binary;
+            else
+            {
+                usage();
+                return 2;
+            }
+        }
+        else if (arg == "-f")
+            options.fused = true;
+        else if (arg == "-s")
+            options.symbols = true;
+        else if (arg == "-q")
+            options.quiet = true;
+        else if (arg.size() > 1 && arg[0] == '-')
+        {
+            usage();
+            return 2;
+        }
+        else
+            paths.push_back(arg);
+    }
+
+    Tokenizer t;
+    setup(t,options.merging);
+    t.setFused(options.fused);
+    t.compile();
+
+    if (options.generated.size())
+        return generate(t,options);
+    if (paths.empty())
+        return printStdin(t);
+
+    std::vector<Job> jobs;
+    for (const auto& i: paths)
+        collect(i,options,jobs,true);
+
+    //biggest files first, so that no thread is left with a big one at the end
+    std::vector<std::size_t> order;
+    std::vector<std::size_t> sizes;
+    for (std::size_t i=0; i<jobs.size(); ++i)
+    {
+        struct stat st;
+        order.push_back(i);
+        sizes.push_back(stat(jobs[i].path.c_str(),&st) == 0 ? st.st_size : 0);
+    }
+    std::stable_sort(order.begin(),order.end(),[&sizes](std::size_t a,std::size_t b)
+    {
+        return sizes[a] > sizes[b];
+    });
+
+    Clock::time_point begin = Clock::now();
+    std::atomic<std::size_t> next(0);
+    std::vector<std::thread> workers;
+    unsigned count = std::min<std::size_t>(options.threads,std::max<std::size_t>(jobs.size(),1));
+    for (unsigned i=1; i<count; ++i)
+        workers.emplace_back(work,std::cref(t),std::cref(options),std::ref(jobs),std::cref(order),std::ref(next));
+    work(t,options,jobs,order,next);
+    for (auto& i: workers)
+        i.join();
+    double wall = std::chrono::duration<double>(Clock::now() - begin).count();
+
+    std::size_t bytes = 0,tokens = 0,errors = 0,failed = 0;
+    double busy = 0;
+    for (const auto& i: jobs)
+    {
+        if (!options.quiet)
+        {
+            if (i.failure.empty())
+                printf("%-48s %12zu B %10zu tokens %10.3f ms %6zu errors\n",i.path.c_str(),i.bytes,i.tokens,i.seconds * 1000,i.errors);
+            else
+                printf("%-48s failed: %s\n",i.path.c_str(),i.failure.c_str());
+        }
+        bytes += i.bytes;
+        tokens += i.tokens;
+        errors += i.errors;
+        busy += i.seconds;
+        failed += !i.failure.empty();
+    }
+    printf("files %zu, failed %zu, bytes %zu, tokens %zu, errors %zu\n",jobs.size(),failed,bytes,tokens,errors);
+    //bytes, tokens and times of files are those of one repetition, wall covers all of them
+    printf("wall %.3f ms, tokenizing %.3f ms per repetition on %u threads, %.2f MB/s per thread, peak rss %.1f MB\n",
+           wall * 1000,busy * 1000,count,busy > 0 ? bytes / busy / 1e6 : 0.0,peakMemory());
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,288 @@
+#include "nullscript/cache.h"
+#include "nullscript/tokens.h"
+#include "nullscript/traverse.h"
+#include "nullscript/serialize.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+namespace NULLSCR
+{
+    std::uint64_t TokenizeCache::hash(const char* data,std::size_t size,std::uint64_t seed)
+    {
+        //murmur64a style mix, 8 bytes per round
+        const std::uint64_t m = 0xC6A4A7935BD1E995ULL;
+        const int r = 47;
+        std::uint64_t h = seed ^ (size * m);
+
+        const char* end = data + (size & ~static_cast<std::size_t>(7));
+        for (; data != end; data += 8)
+        {
+            std::uint64_t k;
+            std::memcpy(&k,data,8);
+            k *= m;
+            k ^= k >> r;
+            k *= m;
+            h ^= k;
+            h *= m;
+        }
+        std::uint64_t t = 0;
+        switch (size & 7)
+        {
+        case 7:
+            t ^= static_cast<std::uint64_t>(static_cast<unsigned char>(data[6])) << 48;
+            //fall through
+        case 6:
+            t ^= static_cast<std::uint64_t>(static_cast<unsigned char>(data[5])) << 40;
+            //fall through
+        case 5:
+            t ^= static_cast<std::uint64_t>(static_cast<unsigned char>(data[4])) << 32;
+            //fall through
+        case 4:
+            t ^= static_cast<std::uint64_t>(static_cast<unsigned char>(data[3])) << 24;
+            //fall through
+        case 3:
+            t ^= static_cast<std::uint64_t>(static_cast<unsigned char>(data[2])) << 16;
+            //fall through
+        case 2:
+            t ^= static_cast<std::uint64_t>(static_cast<unsigned char>(data[1])) << 8;
+            //fall through
+        case 1:
+            t ^= static_cast<std::uint64_t>(static_cast<unsigned char>(data[0]));
+            h ^= t;
+            h *= m;
+        }
+        h ^= h >> r;
+        h *= m;
+        h ^= h >> r;
+        return h;
+    }
+
+    std::uint64_t TokenizeCache::hash(const std::string& data,std::uint64_t seed)
+    {
+        return hash(data.data(),data.size(),seed);
+    }
+
+    std::size_t TokenizeCache::estimateSize(const std::vector<TokenEntity>& tokens)
+    {
+        std::size_t ret = tokens.capacity() * sizeof(TokenEntity);
+        visit(tokens,[&ret](const TokenEntity& i,std::size_t)
+        {
+            if (i.token -> getType() == typeid(StringToken))
+            {
+                ret += sizeof(StringToken) + i.token -> forceAs<StringToken>().str.capacity();
+            }
+            else if (i.token -> getType() == typeid(SymbolToken)) //names belong to table
+            {
+                ret += sizeof(SymbolToken);
+            }
+            else if (i.token -> getType() == typeid(ScopeToken))
+            {
+                ret += sizeof(ScopeToken) + i.token -> forceAs<ScopeToken>().tokens.get().capacity() * sizeof(TokenEntity);
+                return true;
+            }
+            else
+            {
+                ret += sizeof(StringToken);
+            }
+            return false;
+        },[](const TokenEntity&,std::size_t) {});
+        return ret;
+    }
+
+    std::string TokenizeCache::entryPath(const Key& key,const Persistence& persistence) const
+    {
+        char name[64];
+        std::snprintf(name,sizeof(name),"%016llx-%016llx-%llx.nsc",
+                      static_cast<unsigned long long>(key.fingerprint),
+                      static_cast<unsigned long long>(key.hash),
+                      static_cast<unsigned long long>(key.size));
+        return persistence.directory + "/" + name;
+    }
+
+    TokenizeCache::Result TokenizeCache::load(const Key& key,const std::string& source,const Persistence& persistence)
+    {
+        std::ifstream in(entryPath(key,persistence),std::ios::binary);
+        if (!in)
+            return Result();
+        std::ostringstream buffer;
+        buffer << in.rdbuf();
+        const std::string& data = buffer.str();
+
+        //entry of another source with same hash and size is a miss
+        const char* cur = data.data();
+        const char* end = cur + data.size();
+        std::uint64_t size;
+        if (!TokenCodec::readVarint(cur,end,size) || size != source.size() || size > static_cast<std::uint64_t>(end - cur))
+            return Result();
+        if (source.compare(0,source.size(),cur,source.size()) != 0)
+            return Result();
+        cur += size;
+
+        std::unique_ptr<std::vector<TokenEntity>> tokens(new std::vector<TokenEntity>());
+        if (!persistence.decoder(std::string(cur,end),*tokens))
+            return Result();
+        return Result(tokens.release());
+    }
+
+    void TokenizeCache::store(const Key& key,const std::string& source,const std::vector<TokenEntity>& tokens,const Persistence& persistence)
+    {
+        std::string data;
+        TokenCodec::writeString(source,data);
+        std::string encoded;
+        persistence.encoder(tokens,encoded);
+        data += encoded;
+
+        //write aside and rename, so readers never see a partial entry
+        std::string path = entryPath(key,persistence);
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream out(tmp,std::ios::binary | std::ios::trunc);
+            if (!out)
+                return;
+            out.write(data.data(),data.size());
+            if (!out)
+                return;
+        }
+        if (std::rename(tmp.c_str(),path.c_str()) != 0)
+        {
+            std::remove(tmp.c_str());
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++stats_.disk_writes;
+    }
+
+    void TokenizeCache::insert(const Key& key,const std::string& source,const Result& result)
+    {
+        std::size_t bytes = sizeof(Entry) + source.size() + estimateSize(*result);
+        if (bytes > budget_)
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (key.fingerprint != fingerprint_ || index_.find(key) != index_.end()) //tokenizer changed or filled by another thread meanwhile
+            return;
+        Entry e;
+        e.key = key;
+        e.source = source;
+        e.result = result;
+        e.bytes = bytes;
+        lru_.push_front(std::move(e));
+        index_[key] = lru_.begin();
+        ++stats_.entries;
+        stats_.bytes += bytes;
+        evict();
+    }
+
+    void TokenizeCache::evict()
+    {
+        while (stats_.bytes > budget_ && !lru_.empty())
+        {
+            const Entry& e = lru_.back();
+            stats_.bytes -= e.bytes;
+            --stats_.entries;
+            ++stats_.evictions;
+            index_.erase(e.key);
+            lru_.pop_back();
+        }
+    }
+
+    void TokenizeCache::drop()
+    {
+        lru_.clear();
+        index_.clear();
+        stats_.entries = 0;
+        stats_.bytes = 0;
+    }
+
+    TokenizeCache::Result TokenizeCache::tokenize(const std::string& source)
+    {
+        Key key;
+        key.fingerprint = getFingerprint();
+        key.hash = hash(source,key.fingerprint);
+        key.size = source.size();
+        Persistence persistence;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (key.fingerprint != fingerprint_)
+            {
+                drop();
+                fingerprint_ = key.fingerprint;
+            }
+            auto it = index_.find(key);
+            if (it != index_.end() && it -> second -> source == source)
+            {
+                ++stats_.hits;
+                lru_.splice(lru_.begin(),lru_,it -> second);
+                return it -> second -> result;
+            }
+            persistence = persistence_;
+        }
+        bool persistent = !persistence.directory.empty();
+
+        Result ret;
+        if (persistent)
+        {
+            ret = load(key,source,persistence);
+            if (ret)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    ++stats_.disk_hits;
+                }
+                insert(key,source,ret);
+                return ret;
+            }
+        }
+
+        ret.reset(new std::vector<TokenEntity>(tokenizer_.tokenize(source)));
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++stats_.misses;
+        }
+        if (persistent)
+            store(key,source,*ret,persistence);
+        insert(key,source,ret);
+        return ret;
+    }
+
+    void TokenizeCache::setPersistence(const std::string& directory,const Encoder& encoder,const Decoder& decoder)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (encoder && decoder)
+        {
+            persistence_.directory = directory;
+            persistence_.encoder = encoder;
+            persistence_.decoder = decoder;
+        }
+        else
+        {
+            persistence_ = Persistence();
+        }
+    }
+
+    void TokenizeCache::setBudget(std::size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        budget_ = bytes;
+        evict();
+    }
+
+    void TokenizeCache::clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        drop();
+    }
+
+    TokenizeCache::Stats TokenizeCache::getStats() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+    std::uint64_t TokenizeCache::getFingerprint() const
+    {
+        return Fingerprint(seed_).add(tokenizer_.fingerprint()).get();
+    }
+}
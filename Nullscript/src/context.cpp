@@ -0,0 +1,64 @@
+#include "nullscript/context.h"
+
+namespace NULLSCR
+{
+    std::vector<TokenEntity>& TokenizeContext::getTokens()
+    {
+        return tokens;
+    }
+
+    LexicalRule::Scratch& TokenizeContext::getLexer(unsigned level)
+    {
+        while (lexers.size() <= level)
+            lexers.emplace_back();
+        return lexers[level];
+    }
+
+    LexicalChain::Scratch& TokenizeContext::getChain()
+    {
+        return chain;
+    }
+
+    LayeredMergingRule::Scratch& TokenizeContext::getMerger()
+    {
+        return merger;
+    }
+
+    void TokenizeContext::setDiagnostics(Diagnostics* d)
+    {
+        diagnostics = d;
+    }
+
+    Diagnostics* TokenizeContext::getDiagnostics() const
+    {
+        return diagnostics;
+    }
+
+    void TokenizeContext::setLineIndex(LineIndex* l)
+    {
+        lines = l;
+    }
+
+    LineIndex* TokenizeContext::getLineIndex() const
+    {
+        return lines;
+    }
+
+    void TokenizeContext::setSymbols(SymbolTable* s)
+    {
+        symbols = s;
+    }
+
+    SymbolTable* TokenizeContext::getSymbols() const
+    {
+        return symbols;
+    }
+
+    void TokenizeContext::release()
+    {
+        std::vector<TokenEntity>().swap(tokens);
+        lexers.clear();
+        chain = LexicalChain::Scratch();
+        merger = LayeredMergingRule::Scratch();
+    }
+}
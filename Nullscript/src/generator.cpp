@@ -0,0 +1,886 @@
+#include "nullscript/generator.h"
+#include "nullscript/context.h"
+#include <cstring>
+#include <cctype>
+#include <sstream>
+
+namespace NULLSCR
+{
+    //scanner and machine of generated lexers, same steps as LexicalRule::Scanner and LexicalRule::Machine
+    //over tables and functions written before it
+    static const char core[] = R"code(
+struct Point
+{
+    Position pos;
+    unsigned state,id;
+    Position size;
+    bool scoped;
+    Point(Position p,unsigned st,unsigned i,Position siz,bool sc): pos(p), state(st), id(i), size(siz), scoped(sc) {};
+};
+
+static bool bounded(unsigned k,const char* d,std::size_t n,Position start,Position end)
+{
+    if (start >= 1 && classes[k][static_cast<unsigned char>(d[start - 1])])
+        return false;
+    return end >= n || !classes[k][static_cast<unsigned char>(d[end])];
+}
+
+static Position findWord(const char* d,std::size_t n,const char* word,std::size_t size,unsigned k,Position from,Position to)
+{
+    while (from < to)
+    {
+        const void* p = std::memchr(d + from,word[0],to - from);
+        if (p == nullptr)
+            break;
+        from = static_cast<const char*>(p) - d;
+        if (n - from >= size && std::memcmp(d + from,word,size) == 0 && bounded(k,d,n,from,from + size))
+            return from;
+        ++from;
+    }
+    return to;
+}
+
+static void walk(const char* d,std::size_t n,Position start,std::vector<Point>& out);
+static Position terminate(unsigned id,const char* d,std::size_t n,Position offset);
+
+class Scanner
+{
+private:
+    const char* d;
+    std::size_t n;
+    std::vector<std::pair<Position,Position>> heads; //current match of every pattern, npos when there are no more
+    std::vector<Point> pending,words;
+    std::size_t pending_at;
+    Position scan;
+
+    void find(std::size_t r,Position from)
+    {
+        if (!search(r,d,n,from,heads[r].first,heads[r].second))
+            heads[r].first = npos;
+    }
+public:
+    bool next(Point& out,Position offset)
+    {
+        for (; pending_at < pending.size(); ++pending_at)
+        {
+            if (pending[pending_at].pos >= offset)
+            {
+                out = pending[pending_at++];
+                return true;
+            }
+        }
+        pending.clear();
+        pending_at = 0;
+
+        Position first = npos;
+        for (std::size_t r=0; r<pattern_count; ++r)
+        {
+            while (heads[r].first != npos && heads[r].first < offset)
+                find(r,heads[r].first + heads[r].second);
+            if (heads[r].first < first)
+                first = heads[r].first;
+        }
+
+        Position start = std::max(scan,offset);
+        for (; start < n && start <= first; ++start)
+        {
+            walk(d,n,start,words);
+            if (words.size())
+            {
+                first = start++;
+                break;
+            }
+        }
+        scan = start;
+
+        if (first == npos)
+            return false;
+
+        for (std::size_t r=0; r<pattern_count; ++r)
+        {
+            if (heads[r].first == first)
+            {
+                pending.emplace_back(first,pattern_states[r],pattern_ids[r],heads[r].second,pattern_scoped[r]);
+                find(r,first + heads[r].second);
+            }
+        }
+        pending.insert(pending.end(),words.begin(),words.end());
+        words.clear();
+        if (pending.size() > 1)
+        {
+            std::stable_sort(pending.begin(),pending.end(),[](const Point& a,const Point& b)
+            {
+                return a.size > b.size;
+            });
+        }
+        out = pending[pending_at++];
+        return true;
+    }
+
+    void skip(unsigned id,Position offset)
+    {
+        if (offset >= n)
+            return;
+        Position target = terminate(id,d,n,offset);
+        if (target == npos || target == n || target <= std::max(scan,offset))
+            return;
+        pending.clear();
+        pending_at = 0;
+        scan = target;
+        for (std::size_t r=0; r<pattern_count; ++r)
+        {
+            if (heads[r].first != npos && heads[r].first >= target)
+                continue;
+            find(r,target);
+        }
+    }
+
+    Scanner(const std::string& s): d(s.data()), n(s.size()), heads(pattern_count), pending_at(0), scan(0)
+    {
+        for (std::size_t r=0; r<pattern_count; ++r)
+            find(r,0);
+    }
+};
+
+class Machine
+{
+private:
+    const LexicalRule& rule;
+    const std::string& source;
+    Position base;
+    Scanner& points;
+    Diagnostics* diagnostics;
+    SymbolTable* symbols;
+
+    std::vector<unsigned> scopes;
+    std::vector<Position> opens;
+    Position block_start,block_end;
+    unsigned block_id;
+    bool blocked,done;
+    Position offset,lastOffset;
+
+    std::vector<TokenEntity>& top;
+    std::vector<std::vector<TokenEntity>*> stack;
+
+    std::vector<TokenEntity>& current()
+    {
+        return stack.size() ? *stack.back() : top;
+    }
+
+    std::unique_ptr<Token> create(Position from,Position size,unsigned id,Position pos,bool intern)
+    {
+        if (intern && symbols != nullptr && rule.isInterned(id))
+        {
+            unsigned sym = symbols -> intern(source.data() + from,size);
+            return std::unique_ptr<Token>(new SymbolToken(pos,sym,symbols -> get(sym)));
+        }
+        std::unique_ptr<Token> ret(rule.getTokenCreator()(source.substr(from,size),id));
+        if (ret)
+            ret -> setPos(pos);
+        return ret;
+    }
+
+    void insert(std::unique_ptr<Token>&& token,unsigned id)
+    {
+        current().emplace_back(std::move(token),id);
+    }
+
+    void mismatch(const Point& point)
+    {
+        if (diagnostics == nullptr)
+            throw TokenizerException(point.pos + base,"Scope boundaries type mismatch");
+
+        unsigned match = scopes.size();
+        while (match > 0 && scopes[match - 1] != point.id)
+            --match;
+        if (match == 0)
+        {
+            diagnostics -> report(point.pos + base,Diagnostics::Codes::ScopeMismatch,"Scope end without matching start");
+            return;
+        }
+        while (scopes.size() >= match)
+        {
+            if (scopes.size() > match)
+                diagnostics -> report(opens.back(),Diagnostics::Codes::UnclosedScope,"Scope closed by end of outer scope");
+            scopes.pop_back();
+            opens.pop_back();
+            stack.pop_back();
+        }
+    }
+public:
+    bool step()
+    {
+        if (done)
+            return false;
+
+        Point point(0,0,0,0,false);
+        do
+        {
+            if (!points.next(point,offset))
+            {
+                if (diagnostics != nullptr)
+                {
+                    for (auto i: opens)
+                        diagnostics -> report(i,Diagnostics::Codes::UnclosedScope,"Scope not closed before end of source");
+                    if (blocked)
+                        diagnostics -> report(block_start + base,Diagnostics::Codes::UnclosedBlock,"Block not closed before end of source");
+                }
+                if (offset != source.size())
+                {
+                    if (symbols != nullptr && rule.isInterned(0))
+                        top.emplace_back(create(offset,source.size() - offset,0,offset + base,true),0);
+                    else
+                        top.emplace_back(std::unique_ptr<Token>(new StringToken(offset + base,source.substr(offset,source.size() - offset))),0);
+                }
+                done = true;
+                return true;
+            }
+        }
+        while (point.pos < offset);
+
+        bool advance = true,rush = true,opened = false;
+        if (blocked)
+        {
+            advance = false;
+            rush = false;
+            if (point.state == LexicalRule::States::pop || point.state == LexicalRule::States::silentpop || point.state == LexicalRule::States::toggle)
+            {
+                if (point.id == block_id)
+                {
+                    block_end = point.pos;
+                    if (point.state != LexicalRule::States::silentpop)
+                    {
+                        std::unique_ptr<Token> tmpu = create(block_start,block_end - block_start + point.size,point.id,point.pos + base,true);
+                        if (tmpu)
+                            insert(std::move(tmpu),point.id);
+                    }
+                    blocked = false;
+                    advance = true;
+                    rush = true;
+                }
+            }
+        }
+        else
+        {
+            if (lastOffset != point.pos && point.state != LexicalRule::States::ignore)
+            {
+                std::unique_ptr<Token> tmpu = create(lastOffset,point.pos - lastOffset,0,lastOffset + base,true);
+                if (tmpu)
+                    insert(std::move(tmpu),0);
+            }
+            switch (point.state)
+            {
+            case LexicalRule::States::push:
+                {
+                    if (point.scoped)
+                    {
+                        std::unique_ptr<Token> tmpu = create(point.pos,scopes.size() ? point.size : 0,point.id,point.pos + base,false);
+                        ScopeToken* sc = tmpu ? dynamic_cast<ScopeToken*>(tmpu.get()) : nullptr;
+                        if (sc != nullptr)
+                        {
+                            scopes.push_back(point.id);
+                            opens.push_back(point.pos + base);
+                            std::vector<TokenEntity>* children = &sc -> tokens.edit();
+                            current().emplace_back(std::move(tmpu),point.id);
+                            stack.push_back(children);
+                        }
+                    }
+                    else
+                    {
+                        block_start = point.pos;
+                        block_end = 0;
+                        block_id = point.id;
+                        blocked = true;
+                        opened = true;
+                    }
+                    break;
+                }
+            case LexicalRule::States::pop:
+                {
+                    if (scopes.size() && scopes.back() == point.id)
+                    {
+                        scopes.pop_back();
+                        opens.pop_back();
+                        stack.pop_back();
+                    }
+                    else
+                    {
+                        mismatch(point);
+                    }
+                    break;
+                }
+            case LexicalRule::States::toggle:
+                {
+                    block_start = point.pos;
+                    block_end = 0;
+                    block_id = point.id;
+                    blocked = true;
+                    opened = true;
+                    break;
+                }
+            case LexicalRule::States::insert:
+                {
+                    std::unique_ptr<Token> tmpu = create(point.pos,point.size,point.id,point.pos + base,true);
+                    if (tmpu)
+                        insert(std::move(tmpu),point.id);
+                    break;
+                }
+            case LexicalRule::States::ignore:
+                {
+                    advance = false;
+                    break;
+                }
+            default:
+                break;
+            }
+        }
+        if (rush)
+            offset = point.pos + point.size;
+        else
+            offset = point.pos;
+        if (advance)
+            lastOffset = offset;
+        if (opened && skipping)
+            points.skip(block_id,offset);
+        return true;
+    }
+
+    Machine(const LexicalRule& r,const std::string& s,Position b,Scanner& p,Diagnostics* d,SymbolTable* sy,std::vector<TokenEntity>& t):
+        rule(r), source(s), base(b), points(p), diagnostics(d), symbols(sy), block_start(0), block_end(0), block_id(0),
+        blocked(false), done(false), offset(0), lastOffset(0), top(t)
+    {
+        if (utf8)
+        {
+            Position bad = Utf8::validate(source);
+            if (bad != source.size())
+            {
+                if (diagnostics == nullptr)
+                    throw TokenizerException(bad + base,"Invalid UTF-8 sequence");
+                diagnostics -> report(bad + base,Diagnostics::Codes::InvalidEncoding,"Invalid UTF-8 sequence");
+            }
+        }
+    }
+};
+)code";
+
+    //same loop over source as LexicalRule::lex, with function name put in between
+    static const char driver_head[] = R"code(
+void )code";
+
+    static const char driver_tail[] = R"code((const LexicalRule& rule,std::vector<TokenEntity>& source,Diagnostics* diagnostics,SymbolTable* symbols)
+{
+    if (!rule.hasTokenCreator())
+        return;
+    std::vector<TokenEntity> ret;
+    std::vector<std::pair<std::size_t,std::size_t>> moved;
+    ret.reserve(source.size());
+    try
+    {
+        for (std::size_t i=0; i < source.size(); ++i)
+        {
+            if (source[i].token -> getType() == typeid(StringToken) && source[i].type == 0 && source[i].token -> forceAs<StringToken>().str.size())
+            {
+                const StringToken& src = source[i].token -> forceAs<StringToken>();
+                Scanner points(src.str);
+                Machine machine(rule,src.str,src.getPos(),points,diagnostics,symbols,ret);
+                while (machine.step());
+            }
+            else
+            {
+                moved.emplace_back(i,ret.size());
+                ret.emplace_back(std::move(source[i]));
+            }
+        }
+    }
+    catch (...)
+    {
+        for (const auto& m: moved)
+            source[m.first] = std::move(ret[m.second]);
+        throw;
+    }
+    source.swap(ret);
+}
+)code";
+
+    static void writeByte(std::ostream& out,unsigned char c)
+    {
+        static const char hex[] = "0123456789abcdef";
+        out << "0x" << hex[c >> 4] << hex[c & 15];
+    }
+
+    static void writeTable(std::ostream& out,const bool* table)
+    {
+        out << "{";
+        for (unsigned c=0; c<256; ++c)
+            out << (c ? "," : "") << (table[c] ? 1 : 0);
+        out << "}";
+    }
+
+    static void writeIndent(std::ostream& out,unsigned indent)
+    {
+        for (unsigned i=0; i<indent; ++i)
+            out << "    ";
+    }
+
+    static std::logic_error unsupported(const std::string& pattern,const char* why)
+    {
+        return std::logic_error(std::string("LexerGenerator exception: regex \"") + pattern + "\" " + why);
+    }
+
+    std::vector<LexerGenerator::Atom> LexerGenerator::parse(const std::string& pattern)
+    {
+        std::vector<Atom> ret;
+        std::size_t i = 0;
+        while (i < pattern.size())
+        {
+            std::size_t begin = i;
+            char c = pattern[i];
+            if (c == '\\')
+            {
+                if (i + 1 == pattern.size())
+                    throw unsupported(pattern,"ends with an escape");
+                char e = pattern[i + 1];
+                if (std::isalnum(static_cast<unsigned char>(e)) && std::strchr("sSdDwWtnrfv",e) == nullptr)
+                    throw unsupported(pattern,"has an escape that is not a character class");
+                i += 2;
+            }
+            else if (c == '[')
+            {
+                ++i;
+                if (i < pattern.size() && pattern[i] == '^')
+                    ++i;
+                while (i < pattern.size() && pattern[i] != ']')
+                    i += pattern[i] == '\\' ? 2 : 1;
+                if (i >= pattern.size())
+                    throw unsupported(pattern,"has an unclosed class");
+                ++i;
+            }
+            else if (c == '\0' || std::strchr("^$*+?(){}|]",c) != nullptr)
+            {
+                throw unsupported(pattern,"has groups, alternatives, anchors or counted repetition");
+            }
+            else
+            {
+                ++i;
+            }
+
+            Atom atom;
+            atom.min = atom.max = 1;
+            try
+            {
+                std::regex single(pattern.substr(begin,i - begin));
+                for (unsigned k=0; k<256; ++k)
+                    atom.table[k] = std::regex_match(std::string(1,static_cast<char>(k)),single);
+            }
+            catch (std::regex_error&)
+            {
+                throw unsupported(pattern,"has a class that does not stand on its own");
+            }
+
+            if (i < pattern.size() && (pattern[i] == '*' || pattern[i] == '+' || pattern[i] == '?'))
+            {
+                char q = pattern[i++];
+                atom.min = q == '+' ? 1 : 0;
+                atom.max = q == '?' ? 1 : 0;
+            }
+            if (i < pattern.size() && std::strchr("*+?{",pattern[i]) != nullptr && pattern[i] != '\0')
+                throw unsupported(pattern,"has lazy or counted repetition");
+            ret.push_back(atom);
+        }
+
+        //greedy repetition without backtracking is what ECMAScript matching does only when a repeated class
+        //shares nothing with classes after it, up to and including first one that has to match
+        bool empty = true;
+        for (std::size_t a=0; a<ret.size(); ++a)
+        {
+            if (ret[a].min)
+                empty = false;
+            if (ret[a].min == ret[a].max)
+                continue;
+            for (std::size_t b=a+1; b<ret.size(); ++b)
+            {
+                for (unsigned k=0; k<256; ++k)
+                {
+                    if (ret[a].table[k] && ret[b].table[k])
+                        throw unsupported(pattern,"needs backtracking");
+                }
+                if (ret[b].min)
+                    break;
+            }
+        }
+        if (empty)
+            throw unsupported(pattern,"may match empty");
+        return ret;
+    }
+
+    void LexerGenerator::addClass(const LexicalRule::CharClass* boundary)
+    {
+        if (classOf(boundary) == classes.size())
+            classes.push_back(boundary);
+    }
+
+    unsigned LexerGenerator::classOf(const LexicalRule::CharClass* boundary) const
+    {
+        for (unsigned i=0; i<classes.size(); ++i)
+        {
+            bool same = true;
+            for (unsigned c=0; c<256 && same; ++c)
+            {
+                bool a = classes[i] != nullptr && classes[i] -> contains(static_cast<char>(c));
+                same = a == boundary -> contains(static_cast<char>(c));
+            }
+            if (same)
+                return i;
+        }
+        return classes.size();
+    }
+
+    void LexerGenerator::addClasses(const LexicalRule::WordsTrieNode& node)
+    {
+        if (node.value)
+        {
+            for (const auto& v: *node.value)
+                addClass(v.boundary);
+        }
+        for (const auto& i: node.nodes)
+        {
+            if (i)
+                addClasses(*i);
+        }
+    }
+
+    LexerGenerator::LexerGenerator(const LexicalRule& r,const std::string& function): rule(r), name(function), classes(1,nullptr)
+    {
+        bool identifier = !name.empty() && !std::isdigit(static_cast<unsigned char>(name[0]));
+        for (auto c: name)
+            identifier = identifier && (std::isalnum(static_cast<unsigned char>(c)) || c == '_');
+        if (!identifier)
+            throw std::logic_error("LexerGenerator exception: function name is not an identifier");
+        if (rule.longest)
+            throw std::logic_error("LexerGenerator exception: longest match is not supported");
+        for (const auto& i: rule.entry_points)
+        {
+            if (i.pattern.empty())
+                throw std::logic_error("LexerGenerator exception: regex without source, it has to be added with addParsePattern");
+            patterns.push_back(parse(i.pattern));
+        }
+        addClasses(rule.keyword_points.getRoot());
+        for (const auto& t: rule.terminators)
+        {
+            for (const auto& w: t.second.words)
+                addClass(w.second.boundary);
+        }
+    }
+
+    void LexerGenerator::writeClasses(std::ostream& out) const
+    {
+        bool none[256] = {};
+        out << "//bytes that continue words of keywords, first class is for keywords without boundaries\n";
+        out << "static const bool classes[" << classes.size() << "][256] = {\n";
+        for (unsigned i=0; i<classes.size(); ++i)
+        {
+            bool table[256];
+            for (unsigned c=0; c<256; ++c)
+                table[c] = classes[i] != nullptr && classes[i] -> contains(static_cast<char>(c));
+            out << "    ";
+            writeTable(out,i ? table : none);
+            out << (i + 1 < classes.size() ? ",\n" : "\n");
+        }
+        out << "};\n";
+    }
+
+    void LexerGenerator::writePatterns(std::ostream& out) const
+    {
+        std::size_t count = patterns.size();
+        out << "\nstatic const std::size_t pattern_count = " << count << ";\n";
+        std::ostringstream states,ids,scoped;
+        for (std::size_t r=0; r<count; ++r)
+        {
+            const char* sep = r ? "," : "";
+            states << sep << rule.entry_points[r].state;
+            ids << sep << rule.entry_points[r].id;
+            scoped << sep << (rule.entry_points[r].scoped ? "true" : "false");
+        }
+        if (count == 0)
+        {
+            states << 0;
+            ids << 0;
+            scoped << "false";
+        }
+        out << "static const unsigned pattern_states[] = {" << states.str() << "};\n";
+        out << "static const unsigned pattern_ids[] = {" << ids.str() << "};\n";
+        out << "static const bool pattern_scoped[] = {" << scoped.str() << "};\n";
+
+        //tables of classes that match more than a single byte
+        std::vector<const Atom*> tables;
+        for (const auto& p: patterns)
+        {
+            for (const auto& a: p)
+            {
+                if (std::count(a.table,a.table + 256,true) != 1)
+                    tables.push_back(&a);
+            }
+        }
+        if (tables.size())
+        {
+            out << "static const bool atoms[" << tables.size() << "][256] = {\n";
+            for (std::size_t t=0; t<tables.size(); ++t)
+            {
+                out << "    ";
+                writeTable(out,tables[t] -> table);
+                out << (t + 1 < tables.size() ? ",\n" : "\n");
+            }
+            out << "};\n";
+        }
+
+        std::size_t table = 0;
+        for (std::size_t r=0; r<count; ++r)
+        {
+            out << "\n//";
+            for (auto c: rule.entry_points[r].pattern)
+            {
+                if (static_cast<unsigned char>(c) < 0x20 || c == 0x7f)
+                    writeByte(out,c);
+                else
+                    out << c;
+            }
+            out << "\n";
+            out << "static bool match" << r << "(const char* d,std::size_t n,Position s,Position& len)\n{\n";
+            out << "    Position i = s;\n";
+            for (const auto& a: patterns[r])
+            {
+                std::ostringstream test;
+                if (std::count(a.table,a.table + 256,true) == 1)
+                {
+                    test << "static_cast<unsigned char>(d[i]) == ";
+                    writeByte(test,std::find(a.table,a.table + 256,true) - a.table);
+                }
+                else
+                {
+                    test << "atoms[" << table++ << "][static_cast<unsigned char>(d[i])]";
+                }
+                if (a.min)
+                    out << "    if (i == n || !(" << test.str() << "))\n        return false;\n    ++i;\n";
+                if (a.max == 0)
+                    out << "    while (i < n && " << test.str() << ")\n        ++i;\n";
+                else if (a.min == 0)
+                    out << "    if (i < n && " << test.str() << ")\n        ++i;\n";
+            }
+            out << "    len = i - s;\n    return true;\n}\n";
+        }
+
+        out << "\n//leftmost match of pattern r at or after from\n";
+        out << "static bool search(std::size_t r,const char* d,std::size_t n,Position from,Position& at,Position& len)\n{\n";
+        if (count)
+        {
+            out << "    switch (r)\n    {\n";
+            for (std::size_t r=0; r<count; ++r)
+            {
+                out << "    case " << r << ":\n";
+                out << "        for (at = from; at < n; ++at)\n        {\n";
+                out << "            if (match" << r << "(d,n,at,len))\n                return true;\n        }\n";
+                out << "        return false;\n";
+            }
+            out << "    }\n";
+        }
+        out << "    return false;\n}\n";
+    }
+
+    void LexerGenerator::writeNode(std::ostream& out,const LexicalRule::WordsTrieNode& node,bool root,unsigned indent) const
+    {
+        if (!root && node.value)
+        {
+            for (const auto& v: *node.value)
+            {
+                unsigned k = classOf(v.boundary);
+                if (k)
+                {
+                    writeIndent(out,indent);
+                    out << "if (bounded(" << k << ",d,n,start,i))\n";
+                }
+                writeIndent(out,indent + (k ? 1 : 0));
+                out << "out.emplace_back(start," << v.state << "," << v.id << "," << v.size << "," << (v.scoped ? "true" : "false") << ");\n";
+            }
+        }
+
+        std::vector<unsigned> next;
+        for (unsigned c=0; c<256; ++c)
+        {
+            if (node.nodes[c])
+                next.push_back(c);
+        }
+        if (next.empty())
+        {
+            writeIndent(out,indent);
+            out << "return;\n";
+            return;
+        }
+        if (next.size() == 1)
+        {
+            //bytes up to next keyword end or branch, compared together
+            std::string run(1,static_cast<char>(next[0]));
+            const LexicalRule::WordsTrieNode* end = node.nodes[next[0]].get();
+            while (!end -> value)
+            {
+                unsigned only = 256;
+                for (unsigned c=0; c<256; ++c)
+                {
+                    if (end -> nodes[c])
+                        only = only == 256 ? c : 257;
+                }
+                if (only >= 256)
+                    break;
+                run.push_back(static_cast<char>(only));
+                end = end -> nodes[only].get();
+            }
+            writeIndent(out,indent);
+            if (run.size() == 1)
+            {
+                out << "if (i == n || static_cast<unsigned char>(d[i]) != ";
+                writeByte(out,run[0]);
+                out << ")\n";
+                writeIndent(out,indent + 1);
+                out << "return;\n";
+                writeIndent(out,indent);
+                out << "++i;\n";
+            }
+            else
+            {
+                out << "if (n - i < " << run.size() << " || std::memcmp(d + i,\"";
+                for (auto c: run)
+                {
+                    static const char hex[] = "0123456789abcdef";
+                    out << "\\x" << hex[static_cast<unsigned char>(c) >> 4] << hex[c & 15];
+                }
+                out << "\"," << run.size() << ") != 0)\n";
+                writeIndent(out,indent + 1);
+                out << "return;\n";
+                writeIndent(out,indent);
+                out << "i += " << run.size() << ";\n";
+            }
+            writeNode(out,*end,false,indent);
+            return;
+        }
+
+        writeIndent(out,indent);
+        out << "if (i == n)\n";
+        writeIndent(out,indent + 1);
+        out << "return;\n";
+        writeIndent(out,indent);
+        out << "switch (static_cast<unsigned char>(d[i++]))\n";
+        writeIndent(out,indent);
+        out << "{\n";
+        for (auto c: next)
+        {
+            writeIndent(out,indent);
+            out << "case ";
+            writeByte(out,c);
+            out << ":\n";
+            writeIndent(out,indent + 1);
+            out << "{\n";
+            writeNode(out,*node.nodes[c],false,indent + 2);
+            writeIndent(out,indent + 1);
+            out << "}\n";
+        }
+        writeIndent(out,indent);
+        out << "}\n";
+        writeIndent(out,indent);
+        out << "return;\n";
+    }
+
+    void LexerGenerator::writeTerminators(std::ostream& out) const
+    {
+        out << "\nstatic Position terminate(unsigned id,const char* d,std::size_t n,Position offset)\n{\n";
+        out << "    Position target = n;\n";
+        out << "    switch (id)\n    {\n";
+        for (const auto& t: rule.terminators)
+        {
+            out << "    case " << t.first << ":\n";
+            if (!t.second.regex)
+            {
+                for (const auto& w: t.second.words)
+                {
+                    if (w.first.empty())
+                        continue;
+                    out << "        target = findWord(d,n,\"";
+                    for (auto c: w.first)
+                    {
+                        static const char hex[] = "0123456789abcdef";
+                        out << "\\x" << hex[static_cast<unsigned char>(c) >> 4] << hex[c & 15];
+                    }
+                    out << "\"," << w.first.size() << "," << classOf(w.second.boundary) << ",offset,target);\n";
+                }
+                out << "        return target;\n";
+            }
+            else
+            {
+                out << "        return npos;\n";
+            }
+        }
+        out << "    }\n";
+        out << "    (void)target;\n    (void)d;\n    (void)offset;\n";
+        out << "    return npos;\n}\n";
+    }
+
+    void LexerGenerator::writeHeader(std::ostream& out) const
+    {
+        out << "//generated by NULLSCR::LexerGenerator, do not edit\n";
+        out << "#ifndef GENERATED_" << name << "_H\n#define GENERATED_" << name << "_H\n\n";
+        out << "#include <nullscript/generator.h>\n\n";
+        out << "//same tokens as the LexicalRule it was generated from, which gives creator and interned ids\n";
+        out << "void " << name << "(const NULLSCR::LexicalRule& rule,std::vector<NULLSCR::TokenEntity>& source,"
+               "NULLSCR::Diagnostics* diagnostics = nullptr,NULLSCR::SymbolTable* symbols = nullptr);\n\n";
+        out << "#endif\n";
+    }
+
+    void LexerGenerator::writeSource(std::ostream& out) const
+    {
+        out << "//generated by NULLSCR::LexerGenerator, do not edit\n";
+        out << "#include <nullscript/generator.h>\n";
+        out << "#include <nullscript/symbols.h>\n";
+        out << "#include <nullscript/utf8.h>\n";
+        out << "#include <algorithm>\n#include <cstring>\n#include <limits>\n\n";
+        out << "using namespace NULLSCR;\n\n";
+        out << "static const Position npos = std::numeric_limits<Position>::max();\n";
+        out << "static const bool utf8 = " << (rule.utf8 ? "true" : "false") << ";\n";
+        out << "static const bool skipping = " << (rule.skipping ? "true" : "false") << ";\n\n";
+        writeClasses(out);
+        writePatterns(out);
+        out << core;
+
+        out << "\n//keywords starting at start, in order of a walk over their trie\n";
+        out << "static void walk(const char* d,std::size_t n,Position start,std::vector<Point>& out)\n{\n";
+        out << "    Position i = start;\n";
+        writeNode(out,rule.keyword_points.getRoot(),true,1);
+        out << "}\n";
+
+        writeTerminators(out);
+        out << driver_head << name << driver_tail;
+    }
+
+    GeneratedLexer::GeneratedLexer(std::unique_ptr<LexicalRule>&& r,Function f): rule(std::move(r)), function(f)
+    {
+        if (!rule || function == nullptr)
+            throw std::logic_error("GeneratedLexer exception: rule and function are required");
+    }
+
+    const LexicalRule& GeneratedLexer::getRule() const
+    {
+        return *rule;
+    }
+
+    void GeneratedLexer::apply(std::vector<TokenEntity>& source) const
+    {
+        function(*rule,source,nullptr,nullptr);
+    }
+
+    void GeneratedLexer::apply(std::vector<TokenEntity>& source,Diagnostics& diagnostics) const
+    {
+        function(*rule,source,&diagnostics,nullptr);
+    }
+
+    void GeneratedLexer::apply(std::vector<TokenEntity>& source,TokenizeContext& context) const
+    {
+        function(*rule,source,context.getDiagnostics(),context.getSymbols());
+    }
+}
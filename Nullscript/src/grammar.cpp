@@ -0,0 +1,142 @@
+#include "nullscript/grammar.h"
+#include <functional>
+#include <thread>
+
+namespace NULLSCR
+{
+    //all atomics are sequentially consistent: a reader pinning after a publish bumped the epoch also loads
+    //the new version, one that pinned before holds an older epoch and so keeps the replaced one alive
+
+    Grammar::Grammar(std::unique_ptr<Tokenizer> tokenizer,unsigned readers): current(nullptr), epoch(1), slots(new Slot[readers > 0 ? readers : 1]), slot_count(readers > 0 ? readers : 1)
+    {
+        if (!tokenizer)
+            throw std::logic_error("Grammar exception: no tokenizer");
+        for (unsigned i=0; i < slot_count; ++i)
+            slots[i].epoch.store(0);
+        tokenizer -> compile();
+        current.store(new Version(std::move(tokenizer),1));
+    }
+
+    Grammar::~Grammar()
+    {
+        delete current.load();
+        for (const auto& i: retired)
+            delete i.second;
+    }
+
+    unsigned Grammar::pin() const
+    {
+        //threads start looking at different slots, so they rarely contend for one
+        unsigned start = std::hash<std::thread::id>()(std::this_thread::get_id()) % slot_count;
+        while (true)
+        {
+            for (unsigned k=0; k < slot_count; ++k)
+            {
+                unsigned i = (start + k) % slot_count;
+                std::uint64_t expected = 0;
+                if (slots[i].epoch.load() == 0 && slots[i].epoch.compare_exchange_strong(expected,epoch.load()))
+                    return i;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    void Grammar::unpin(unsigned slot) const
+    {
+        slots[slot].epoch.store(0);
+    }
+
+    std::size_t Grammar::reclaim()
+    {
+        std::uint64_t oldest = 0;
+        for (unsigned i=0; i < slot_count; ++i)
+        {
+            std::uint64_t e = slots[i].epoch.load();
+            if (e != 0 && (oldest == 0 || e < oldest))
+                oldest = e;
+        }
+
+        std::size_t kept = 0;
+        for (const auto& i: retired)
+        {
+            if (oldest != 0 && oldest < i.first)
+                retired[kept++] = i;
+            else
+                delete i.second;
+        }
+        retired.resize(kept);
+        return kept;
+    }
+
+    std::uint64_t Grammar::publish(std::unique_ptr<Tokenizer> tokenizer)
+    {
+        if (!tokenizer)
+            throw std::logic_error("Grammar exception: no tokenizer");
+        tokenizer -> compile();
+
+        std::lock_guard<std::mutex> lock(writer);
+        std::uint64_t number = epoch.load() + 1;
+        const Version* old = current.exchange(new Version(std::move(tokenizer),number));
+        epoch.store(number);
+        retired.emplace_back(number,old);
+        reclaim();
+        return number;
+    }
+
+    std::size_t Grammar::collect()
+    {
+        std::lock_guard<std::mutex> lock(writer);
+        return reclaim();
+    }
+
+    std::uint64_t Grammar::getVersion() const
+    {
+        return current.load() -> number;
+    }
+
+    std::vector<TokenEntity> Grammar::tokenize(const std::string& source) const
+    {
+        Reader reader(*this);
+        return reader -> tokenize(source);
+    }
+
+    std::vector<TokenEntity> Grammar::tokenize(const std::string& source,Diagnostics& diagnostics) const
+    {
+        //stages of reported diagnostics belong to pinned version, which may be freed once reader is gone
+        std::size_t from = diagnostics.size();
+        Reader reader(*this);
+        try
+        {
+            std::vector<TokenEntity> ret = reader -> tokenize(source,diagnostics);
+            diagnostics.detach(from);
+            return ret;
+        }
+        catch (...)
+        {
+            diagnostics.detach(from);
+            throw;
+        }
+    }
+
+    Grammar::Reader::Reader(const Grammar& g): grammar(g), slot(g.pin()), version(g.current.load()) {}
+
+    Grammar::Reader::~Reader()
+    {
+        grammar.unpin(slot);
+    }
+
+    const Tokenizer& Grammar::Reader::get() const
+    {
+        return *(version -> tokenizer);
+    }
+
+    const Tokenizer* Grammar::Reader::operator -> () const
+    {
+        return version -> tokenizer.get();
+    }
+
+    std::uint64_t Grammar::Reader::getVersion() const
+    {
+        return version -> number;
+    }
+}
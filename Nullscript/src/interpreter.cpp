@@ -0,0 +1,406 @@
+#include "nullscript/interpreter.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+//labels as values give each instruction its handler address, other compilers use a switch
+#if defined(__GNUC__) && !defined(NULLSCR_NO_THREADED)
+#define NULLSCR_THREADED
+#endif
+
+namespace NULLSCR
+{
+    namespace Interpreter
+    {
+        static const std::size_t undefined = static_cast<std::size_t>(-1);
+
+        int Program::findFunction(const std::string& name) const
+        {
+            for (unsigned i=0; i<functions.size(); ++i)
+                if (functions[i].name == name)
+                    return i;
+            return -1;
+        }
+
+        Compiler::Function& Compiler::current()
+        {
+            if (open.empty())
+                throw std::logic_error("Compiler exception: no function is being compiled");
+            return open.back();
+        }
+
+        void Compiler::setHandler(unsigned type,const Compiler::Handler& h)
+        {
+            if (type >= handlers.size())
+                handlers.resize(type + 1);
+            handlers[type] = h;
+        }
+
+        bool Compiler::hasHandler(unsigned type) const
+        {
+            return type < handlers.size() && handlers[type];
+        }
+
+        unsigned Compiler::addNative(const std::string& name,const Native& f)
+        {
+            int i = findNative(name);
+            if (i != -1)
+            {
+                natives[i].second = f;
+                return i;
+            }
+            natives.emplace_back(name,f);
+            return natives.size() - 1;
+        }
+
+        int Compiler::findNative(const std::string& name) const
+        {
+            for (unsigned i=0; i<natives.size(); ++i)
+                if (natives[i].first == name)
+                    return i;
+            return -1;
+        }
+
+        unsigned Compiler::declare(const std::string& name,unsigned params)
+        {
+            auto it = function_names.find(name);
+            if (it != function_names.end())
+                return it -> second;
+            Program::Function f;
+            f.name = name;
+            f.entry = undefined;
+            f.params = params;
+            f.registers = 0;
+            program.functions.push_back(f);
+            function_names[name] = program.functions.size() - 1;
+            return program.functions.size() - 1;
+        }
+
+        int Compiler::findFunction(const std::string& name) const
+        {
+            auto it = function_names.find(name);
+            if (it == function_names.end())
+                return -1;
+            return it -> second;
+        }
+
+        unsigned Compiler::beginFunction(const std::string& name,const std::vector<std::string>& params)
+        {
+            unsigned index = declare(name,params.size());
+            if (program.functions[index].entry != undefined || program.functions[index].params != params.size())
+                throw std::logic_error("Compiler exception: function " + name + " redefined");
+            Function f;
+            f.index = index;
+            f.top = 0;
+            for (const auto& p: params)
+                f.locals[p] = f.top++;
+            f.registers = f.top;
+            open.push_back(std::move(f));
+            return index;
+        }
+
+        void Compiler::endFunction()
+        {
+            Function f = std::move(current());
+            open.pop_back();
+
+            //jump targets were relative to function start
+            std::size_t entry = program.code.size();
+            for (auto& i: f.code)
+            {
+                if (i.op == Ops::Jump || i.op == Ops::JumpIf || i.op == Ops::JumpIfNot)
+                {
+                    std::uint32_t w = i.wide() + entry;
+                    i.b = w & 0xFFFF;
+                    i.c = w >> 16;
+                }
+            }
+            program.code.insert(program.code.end(),f.code.begin(),f.code.end());
+            program.functions[f.index].entry = entry;
+            program.functions[f.index].registers = std::max(f.registers,1u); //result slot
+        }
+
+        unsigned Compiler::local(const std::string& name)
+        {
+            Function& f = current();
+            auto it = f.locals.find(name);
+            if (it != f.locals.end())
+                return it -> second;
+            unsigned r = temp();
+            f.locals[name] = r;
+            return r;
+        }
+
+        int Compiler::findLocal(const std::string& name) const
+        {
+            if (open.empty())
+                return -1;
+            auto it = open.back().locals.find(name);
+            if (it == open.back().locals.end())
+                return -1;
+            return it -> second;
+        }
+
+        unsigned Compiler::temp()
+        {
+            Function& f = current();
+            if (f.top >= 256)
+                throw std::logic_error("Compiler exception: too many registers");
+            unsigned r = f.top++;
+            f.registers = std::max(f.registers,f.top);
+            return r;
+        }
+
+        unsigned Compiler::getTop() const
+        {
+            return open.empty() ? 0 : open.back().top;
+        }
+
+        void Compiler::release(unsigned top)
+        {
+            Function& f = current();
+            //locals stay alive until end of function
+            for (const auto& i: f.locals)
+                top = std::max(top,i.second + 1);
+            f.top = std::min(f.top,top);
+        }
+
+        unsigned Compiler::constant(Value v)
+        {
+            std::uint64_t bits;
+            std::memcpy(&bits,&v,sizeof(bits));
+            auto it = constant_ids.find(bits);
+            if (it != constant_ids.end())
+                return it -> second;
+            program.constants.push_back(v);
+            constant_ids[bits] = program.constants.size() - 1;
+            return program.constants.size() - 1;
+        }
+
+        std::size_t Compiler::emit(unsigned op,unsigned a,unsigned b,unsigned c)
+        {
+            Function& f = current();
+            f.code.emplace_back(op,a,b,c);
+            return f.code.size() - 1;
+        }
+
+        std::size_t Compiler::emitWide(unsigned op,unsigned a,std::uint32_t w)
+        {
+            return emit(op,a,w & 0xFFFF,w >> 16);
+        }
+
+        std::size_t Compiler::here() const
+        {
+            return open.empty() ? 0 : open.back().code.size();
+        }
+
+        void Compiler::patch(std::size_t at,std::size_t target)
+        {
+            Instruction& i = current().code.at(at);
+            i.b = target & 0xFFFF;
+            i.c = static_cast<std::uint32_t>(target) >> 16;
+        }
+
+        void Compiler::compile(const TokenEntity& entity,unsigned target)
+        {
+            if (!hasHandler(entity.type))
+                throw std::logic_error("Compiler exception: no handler for type " + std::to_string(entity.type));
+            handlers[entity.type](*this,entity,target);
+        }
+
+        void Compiler::compile(const std::vector<TokenEntity>& tokens,unsigned target)
+        {
+            if (tokens.empty())
+                emitWide(Ops::Const,target,constant(0));
+            for (const auto& i: tokens)
+                compile(i,target);
+        }
+
+        Program Compiler::build(const std::vector<TokenEntity>& tokens)
+        {
+            program = Program();
+            function_names.clear();
+            constant_ids.clear();
+            open.clear();
+            for (const auto& i: natives)
+                program.natives.push_back(i.second);
+
+            beginFunction("",std::vector<std::string>());
+            unsigned r = temp();
+            compile(tokens,r);
+            emit(Ops::Return,r);
+            endFunction();
+
+            for (const auto& i: program.functions)
+                if (i.entry == undefined)
+                    throw std::logic_error("Compiler exception: function " + i.name + " declared but not defined");
+            return std::move(program);
+        }
+
+        VM::VM(const Program& p,std::size_t depth,std::size_t size): program(p), registers(size), frames(depth) {}
+
+        Value VM::call(unsigned function,const std::vector<Value>& args)
+        {
+            if (function >= program.functions.size())
+                throw std::logic_error("Interpreter exception: unknown function");
+            const Program::Function& f = program.functions[function];
+            if (args.size() != f.params)
+                throw std::logic_error("Interpreter exception: wrong number of arguments to " + f.name);
+            if (frames.empty() || f.registers > registers.size())
+                throw std::runtime_error("Interpreter exception: stack overflow");
+            std::copy(args.begin(),args.end(),registers.begin());
+            return execute(function);
+        }
+
+        Value VM::call(const std::string& name,const std::vector<Value>& args)
+        {
+            int i = program.findFunction(name);
+            if (i == -1)
+                throw std::logic_error("Interpreter exception: unknown function " + name);
+            return call(i,args);
+        }
+
+        Value VM::run()
+        {
+            return call(0);
+        }
+
+        Value VM::execute(unsigned function)
+        {
+            const Instruction* code = program.code.data();
+            const Value* constants = program.constants.data();
+            const Instruction* i;
+            Value* r = registers.data();
+            std::size_t pc = program.functions[function].entry;
+            std::size_t depth = 1;
+            frames[0].base = 0;
+            frames[0].function = function;
+
+#ifdef NULLSCR_THREADED
+            static const void* const labels[Ops::Count] = {
+                &&op_Move,&&op_Const,&&op_Add,&&op_Sub,&&op_Mul,&&op_Div,&&op_Mod,&&op_Neg,&&op_Not,
+                &&op_Eq,&&op_Ne,&&op_Lt,&&op_Le,&&op_Jump,&&op_JumpIf,&&op_JumpIfNot,&&op_Call,&&op_Native,&&op_Return
+            };
+            if (threaded.size() != program.code.size())
+            {
+                threaded.resize(program.code.size());
+                for (std::size_t k=0; k<threaded.size(); ++k)
+                    threaded[k] = program.code[k].op < Ops::Count ? labels[program.code[k].op] : &&op_Invalid;
+            }
+#define NEXT() goto *threaded[pc]
+#define OP(name) op_##name
+            NEXT();
+#else
+#define NEXT() goto dispatch
+#define OP(name) case Ops::name
+        dispatch:
+            switch (code[pc].op)
+            {
+#endif
+            OP(Move):
+                i = &code[pc++];
+                r[i -> a] = r[i -> b];
+                NEXT();
+            OP(Const):
+                i = &code[pc++];
+                r[i -> a] = constants[i -> wide()];
+                NEXT();
+            OP(Add):
+                i = &code[pc++];
+                r[i -> a] = r[i -> b] + r[i -> c];
+                NEXT();
+            OP(Sub):
+                i = &code[pc++];
+                r[i -> a] = r[i -> b] - r[i -> c];
+                NEXT();
+            OP(Mul):
+                i = &code[pc++];
+                r[i -> a] = r[i -> b] * r[i -> c];
+                NEXT();
+            OP(Div):
+                i = &code[pc++];
+                r[i -> a] = r[i -> b] / r[i -> c];
+                NEXT();
+            OP(Mod):
+                i = &code[pc++];
+                r[i -> a] = std::fmod(r[i -> b],r[i -> c]);
+                NEXT();
+            OP(Neg):
+                i = &code[pc++];
+                r[i -> a] = -r[i -> b];
+                NEXT();
+            OP(Not):
+                i = &code[pc++];
+                r[i -> a] = r[i -> b] == 0 ? 1 : 0;
+                NEXT();
+            OP(Eq):
+                i = &code[pc++];
+                r[i -> a] = r[i -> b] == r[i -> c] ? 1 : 0;
+                NEXT();
+            OP(Ne):
+                i = &code[pc++];
+                r[i -> a] = r[i -> b] != r[i -> c] ? 1 : 0;
+                NEXT();
+            OP(Lt):
+                i = &code[pc++];
+                r[i -> a] = r[i -> b] < r[i -> c] ? 1 : 0;
+                NEXT();
+            OP(Le):
+                i = &code[pc++];
+                r[i -> a] = r[i -> b] <= r[i -> c] ? 1 : 0;
+                NEXT();
+            OP(Jump):
+                pc = code[pc].wide();
+                NEXT();
+            OP(JumpIf):
+                i = &code[pc];
+                pc = r[i -> a] != 0 ? i -> wide() : pc + 1;
+                NEXT();
+            OP(JumpIfNot):
+                i = &code[pc];
+                pc = r[i -> a] == 0 ? i -> wide() : pc + 1;
+                NEXT();
+            OP(Call):
+                {
+                    i = &code[pc++];
+                    const Program::Function& f = program.functions[i -> c];
+                    std::size_t base = frames[depth - 1].base + i -> b;
+                    if (depth == frames.size() || base + f.registers > registers.size())
+                        throw std::runtime_error("Interpreter exception: stack overflow");
+                    frames[depth - 1].pc = pc;
+                    frames[depth].base = base;
+                    frames[depth].function = i -> c;
+                    ++depth;
+                    r = registers.data() + base;
+                    pc = f.entry;
+                    NEXT();
+                }
+            OP(Native):
+                i = &code[pc++];
+                r[i -> b] = program.natives[i -> c](r + i -> b,i -> a);
+                NEXT();
+            OP(Return):
+                i = &code[pc];
+                if (depth == 1)
+                    return r[i -> a];
+                //result goes to first register of callee window, which is where caller expects it
+                r[0] = r[i -> a];
+                --depth;
+                pc = frames[depth - 1].pc;
+                r = registers.data() + frames[depth - 1].base;
+                NEXT();
+#ifdef NULLSCR_THREADED
+            op_Invalid:
+#else
+            default:
+#endif
+                throw std::logic_error("Interpreter exception: invalid instruction");
+#ifndef NULLSCR_THREADED
+            }
+#endif
+#undef NEXT
+#undef OP
+        }
+    }
+}
@@ -0,0 +1,89 @@
+#include "nullscript/lines.h"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NULLSCR_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+namespace NULLSCR
+{
+#ifdef NULLSCR_SSE2
+    static unsigned lowestBit(unsigned mask)
+    {
+#ifdef _MSC_VER
+        unsigned long i;
+        _BitScanForward(&i,mask);
+        return static_cast<unsigned>(i);
+#else
+        return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+    }
+#endif
+
+    void LineIndex::build(const char* data,std::size_t size)
+    {
+        starts.clear();
+        starts.push_back(0);
+        size_ = size;
+
+        std::size_t i = 0;
+#ifdef NULLSCR_SSE2
+        //16 bytes per compare, each set bit of the mask is a newline
+        const __m128i nl = _mm_set1_epi8('\n');
+        for (; i + 16 <= size; i += 16)
+        {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk,nl)));
+            while (mask)
+            {
+                starts.push_back(i + lowestBit(mask) + 1);
+                mask &= mask - 1;
+            }
+        }
+#endif
+        while (i < size)
+        {
+            const void* p = std::memchr(data + i,'\n',size - i);
+            if (p == nullptr)
+                break;
+            i = static_cast<const char*>(p) - data + 1;
+            starts.push_back(i);
+        }
+    }
+
+    void LineIndex::build(const std::string& source)
+    {
+        build(source.data(),source.size());
+    }
+
+    LineIndex::Location LineIndex::locate(Position pos) const
+    {
+        auto it = std::upper_bound(starts.begin(),starts.end(),pos);
+        Location ret;
+        ret.line = it - starts.begin();
+        ret.column = pos - *(it - 1) + 1;
+        return ret;
+    }
+
+    Position LineIndex::getLineStart(std::size_t line) const
+    {
+        if (line == 0 || line > starts.size())
+            return TokenizerException::npos;
+        return starts[line - 1];
+    }
+
+    std::size_t LineIndex::getLines() const
+    {
+        return starts.size();
+    }
+
+    Position LineIndex::getSize() const
+    {
+        return size_;
+    }
+}
@@ -1,13 +1,16 @@
 #include "nullscript/nullscript.h"
 #include "nullscript/tokens.h"
+#include "nullscript/rules.h"
+#include "nullscript/lines.h"
+#include "nullscript/context.h"
 
 namespace NULLSCR
 {
-    unsigned Token::getPos() const noexcept
+    Position Token::getPos() const noexcept
     {
         return pos;
     }
-    void Token::setPos(unsigned p)
+    void Token::setPos(Position p)
     {
         pos = p;
     }
@@ -17,28 +20,251 @@ namespace NULLSCR
         return err_.c_str();
     }
 
-    TokenizerException::TokenizerException(unsigned pos,const std::string& error)
+    Position TokenizerException::getPos() const noexcept
+    {
+        return pos_;
+    }
+
+    TokenizerException::TokenizerException(Position pos,const std::string& error): pos_(pos)
     {
         err_ = error;
         err_ += " at: ";
         err_ += std::to_string(pos);
     }
 
-    void Stage::apply(std::vector<TokenEntity>& source) const
+    Diagnostics::Diagnostics(std::size_t cap): capacity(cap), dropped(0), stage(nullptr)
+    {
+        list.reserve(capacity);
+    }
+
+    void Diagnostics::report(Position pos,unsigned code,const char* message)
+    {
+        if (list.size() < capacity)
+        {
+            Diagnostic d;
+            d.pos = pos;
+            d.code = code;
+            d.message = message;
+            d.stage = stage;
+            d.stage_name = nullptr;
+            list.push_back(d);
+        }
+        else
+        {
+            ++dropped;
+        }
+    }
+
+    void Diagnostics::report(Position pos,const std::string& message)
+    {
+        if (list.size() < capacity)
+        {
+            details.push_back(message);
+            report(pos,Codes::RuleFailed,details.back().c_str());
+        }
+        else
+        {
+            ++dropped;
+        }
+    }
+
+    const std::vector<Diagnostics::Diagnostic>& Diagnostics::get() const
+    {
+        return list;
+    }
+
+    std::size_t Diagnostics::size() const
+    {
+        return list.size();
+    }
+
+    std::size_t Diagnostics::getDropped() const
+    {
+        return dropped;
+    }
+
+    bool Diagnostics::empty() const
+    {
+        return list.empty() && dropped == 0;
+    }
+
+    void Diagnostics::clear()
+    {
+        list.clear();
+        details.clear();
+        dropped = 0;
+    }
+
+    void Diagnostics::setStage(const Stage* s)
+    {
+        stage = s;
+    }
+
+    const Stage* Diagnostics::getStage() const
+    {
+        return stage;
+    }
+
+    void Diagnostics::detach(std::size_t from)
+    {
+        const Stage* last = nullptr;
+        for (std::size_t i=from; i < list.size(); ++i)
+        {
+            if (list[i].stage == nullptr)
+                continue;
+            //diagnostics of one stage come in a row, its name is stored once for them
+            if (list[i].stage != last)
+            {
+                last = list[i].stage;
+                details.push_back(last -> getName());
+            }
+            list[i].stage_name = details.back().c_str();
+            list[i].stage = nullptr;
+        }
+        stage = nullptr;
+    }
+
+    Fingerprint& Fingerprint::add(std::uint64_t v)
+    {
+        h ^= v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+        h *= 0xff51afd7ed558ccdull;
+        return *this;
+    }
+
+    Fingerprint& Fingerprint::add(const std::string& s)
+    {
+        std::uint64_t b = 14695981039346656037ull;
+        for (auto c: s)
+        {
+            b ^= static_cast<unsigned char>(c);
+            b *= 1099511628211ull;
+        }
+        return add(s.size()).add(b);
+    }
+
+    std::uint64_t Fingerprint::get() const
+    {
+        return h;
+    }
+
+    std::uint64_t Rule::fingerprint() const
+    {
+        return Fingerprint().add(typeid(*this).name()).get();
+    }
+
+    void Rule::apply(std::vector<TokenEntity>& data,Diagnostics& diagnostics) const
     {
         try
         {
-            for (const auto& rule: rules)
+            apply(data);
+        }
+        catch (TokenizerException& e)
+        {
+            diagnostics.report(e.getPos(),e.what());
+        }
+    }
+
+    void Rule::apply(std::vector<TokenEntity>& data,TokenizeContext& context) const
+    {
+        if (context.getDiagnostics() != nullptr)
+            apply(data,*context.getDiagnostics());
+        else
+            apply(data);
+    }
+
+    void Stage::compile()
+    {
+        plan.clear();
+        planned.clear();
+        compiled.clear();
+        std::vector<const LexicalRule*> lexers;
+        for (auto& rule: rules)
+            rule -> compile();
+        for (unsigned i=0; i <= rules.size(); ++i)
+        {
+            //subclasses may lex differently, so only plain lexical rules are fused
+            if (i < rules.size() && typeid(*rules[i]) == typeid(LexicalRule))
+            {
+                lexers.push_back(static_cast<const LexicalRule*>(rules[i].get()));
+                continue;
+            }
+            if (lexers.size() > 1)
+            {
+                compiled.emplace_back(new LexicalChain(lexers));
+                plan.push_back(compiled.back().get());
+            }
+            else if (lexers.size())
             {
-                rule -> apply(source);
+                plan.push_back(lexers.back());
             }
+            lexers.clear();
+            if (i < rules.size())
+                plan.push_back(rules[i].get());
+        }
+        for (const auto& rule: rules)
+            planned.push_back(rule.get());
+    }
+
+    bool Stage::isCompiled() const
+    {
+        if (planned.size() != rules.size())
+            return false;
+        for (unsigned i=0; i < rules.size(); ++i)
+        {
+            if (planned[i] != rules[i].get())
+                return false;
+        }
+        return true;
+    }
+
+    std::vector<const Rule*> Stage::getPlan() const
+    {
+        std::vector<const Rule*> ret;
+        forEach([&ret](const Rule& rule)
+        {
+            ret.push_back(&rule);
+        });
+        return ret;
+    }
+
+    void Stage::apply(std::vector<TokenEntity>& source) const
+    {
+        try
+        {
+            forEach([&source](const Rule& rule)
+            {
+                rule.apply(source);
+            });
         }
         catch (TokenizerException& e)
         {
-            std::string err = getName();
-            err += ": ";
-            err += e.what();
-            throw TokenizerException(err);
+            throw TokenizerException(getName() + ": ",e);
+        }
+    }
+
+    void Stage::apply(std::vector<TokenEntity>& source,Diagnostics& diagnostics) const
+    {
+        diagnostics.setStage(this);
+        forEach([&source,&diagnostics](const Rule& rule)
+        {
+            rule.apply(source,diagnostics);
+        });
+    }
+
+    void Stage::apply(std::vector<TokenEntity>& source,TokenizeContext& context) const
+    {
+        if (context.getDiagnostics() != nullptr)
+            context.getDiagnostics() -> setStage(this);
+        try
+        {
+            forEach([&source,&context](const Rule& rule)
+            {
+                rule.apply(source,context);
+            });
+        }
+        catch (TokenizerException& e)
+        {
+            throw TokenizerException(getName() + ": ",e);
         }
     }
 
@@ -52,6 +278,15 @@ namespace NULLSCR
         name_ = name;
     }
 
+    std::uint64_t Stage::fingerprint() const
+    {
+        Fingerprint ret;
+        ret.add(name_).add(rules.size());
+        for (const auto& rule: rules)
+            ret.add(rule -> fingerprint());
+        return ret.get();
+    }
+
     std::vector<TokenEntity> Tokenizer::tokenize(const std::string& source) const
     {
         std::vector<TokenEntity> ret;
@@ -61,13 +296,205 @@ namespace NULLSCR
 
         ret.emplace_back(std::unique_ptr<Token>(tmp),0);
 
-        for (const auto& stage: stages)
+        if (fused)
+        {
+            applyFused(ret,nullptr);
+        }
+        else
         {
-            stage -> apply(ret);
+            for (const auto& stage: stages)
+            {
+                stage -> apply(ret);
+            }
         }
         return std::move(ret);
     }
 
+    std::vector<TokenEntity> Tokenizer::tokenize(const std::string& source,Diagnostics& diagnostics) const
+    {
+        std::vector<TokenEntity> ret;
+
+        ret.emplace_back(std::unique_ptr<Token>(new StringToken(0,source)),0);
+
+        if (fused)
+        {
+            applyFused(ret,&diagnostics);
+        }
+        else
+        {
+            for (const auto& stage: stages)
+            {
+                stage -> apply(ret,diagnostics);
+            }
+        }
+        diagnostics.setStage(nullptr);
+        return ret;
+    }
+
+    std::vector<TokenEntity> Tokenizer::tokenize(const std::string& source,LineIndex& lines) const
+    {
+        lines.build(source);
+        return tokenize(source);
+    }
+
+    static const LexicalRule& rangeLexer(const std::vector<std::unique_ptr<Stage>>& stages)
+    {
+        const LexicalRule* ret = nullptr;
+        if (stages.size() && stages[0] -> rules.size())
+            ret = dynamic_cast<const LexicalRule*>(stages[0] -> rules[0].get());
+        if (ret == nullptr)
+            throw std::logic_error("Tokenizer exception: ranges need a LexicalRule as first rule");
+        return *ret;
+    }
+
+    void Tokenizer::index(const std::string& source,LexerCheckpoints& out,Position every,Diagnostics* diagnostics) const
+    {
+        const LexicalRule& lexer = rangeLexer(stages);
+        if (diagnostics != nullptr)
+            diagnostics -> setStage(stages[0].get());
+        try
+        {
+            lexer.index(source,out,every,diagnostics);
+        }
+        catch (TokenizerException& e)
+        {
+            throw TokenizerException(stages[0] -> getName() + ": ",e);
+        }
+        if (diagnostics != nullptr)
+            diagnostics -> setStage(nullptr);
+    }
+
+    std::vector<TokenEntity> Tokenizer::tokenizeRange(const std::string& source,const LexerCheckpoints& index,Position begin,Position end,Diagnostics* diagnostics) const
+    {
+        const LexicalRule& lexer = rangeLexer(stages);
+        const Stage& first = *stages[0];
+        std::vector<TokenEntity> ret;
+
+        if (diagnostics != nullptr)
+            diagnostics -> setStage(&first);
+        try
+        {
+            lexer.tokenizeRange(source,index,begin,end,ret,diagnostics);
+            for (std::size_t i=1; i<first.rules.size(); ++i)
+            {
+                if (diagnostics != nullptr)
+                    first.rules[i] -> apply(ret,*diagnostics);
+                else
+                    first.rules[i] -> apply(ret);
+            }
+        }
+        catch (TokenizerException& e)
+        {
+            throw TokenizerException(first.getName() + ": ",e);
+        }
+        for (std::size_t i=1; i<stages.size(); ++i)
+        {
+            if (diagnostics != nullptr)
+                stages[i] -> apply(ret,*diagnostics);
+            else
+                stages[i] -> apply(ret);
+        }
+        if (diagnostics != nullptr)
+            diagnostics -> setStage(nullptr);
+        return ret;
+    }
+
+    std::vector<TokenEntity>& Tokenizer::tokenize(const std::string& source,TokenizeContext& context) const
+    {
+        std::vector<TokenEntity>& ret = context.getTokens();
+        ret.clear();
+        ret.emplace_back(std::unique_ptr<Token>(new StringToken(0,source)),0);
+
+        if (context.getLineIndex() != nullptr)
+            context.getLineIndex() -> build(source);
+
+        if (fused)
+        {
+            applyFused(ret,context.getDiagnostics(),&context);
+        }
+        else
+        {
+            for (const auto& stage: stages)
+            {
+                stage -> apply(ret,context);
+            }
+        }
+        if (context.getDiagnostics() != nullptr)
+            context.getDiagnostics() -> setStage(nullptr);
+        return ret;
+    }
+
+    void Tokenizer::applyFused(std::vector<TokenEntity>& source,Diagnostics* diagnostics,TokenizeContext* context) const
+    {
+        //rules of all stages in order, so that lexer and merger may come from neighbouring stages
+        std::vector<std::pair<const Stage*,const Rule*>> rules;
+        for (const auto& stage: stages)
+        {
+            for (const Rule* rule: stage -> getPlan())
+                rules.emplace_back(stage.get(),rule);
+        }
+
+        for (unsigned i=0; i < rules.size(); ++i)
+        {
+            if (diagnostics != nullptr)
+                diagnostics -> setStage(rules[i].first);
+            try
+            {
+                //same as in Stage::compile, subclasses may lex differently
+                const LexicalRule* lexer = typeid(*rules[i].second) == typeid(LexicalRule) ? static_cast<const LexicalRule*>(rules[i].second) : nullptr;
+                const LayeredMergingRule* merger = i + 1 < rules.size() ? dynamic_cast<const LayeredMergingRule*>(rules[i + 1].second) : nullptr;
+                if (lexer != nullptr && merger != nullptr)
+                {
+                    merger -> applyFused(*lexer,source,diagnostics,context != nullptr ? context -> getSymbols() : nullptr);
+                    ++i;
+                }
+                else if (context != nullptr)
+                {
+                    rules[i].second -> apply(source,*context);
+                }
+                else if (diagnostics != nullptr)
+                {
+                    rules[i].second -> apply(source,*diagnostics);
+                }
+                else
+                {
+                    rules[i].second -> apply(source);
+                }
+            }
+            catch (TokenizerException& e)
+            {
+                if (diagnostics == nullptr)
+                    throw TokenizerException(rules[i].first -> getName() + ": ",e);
+                diagnostics -> report(e.getPos(),e.what());
+            }
+        }
+    }
+
+    void Tokenizer::setFused(bool f)
+    {
+        fused = f;
+    }
+
+    bool Tokenizer::isFused() const
+    {
+        return fused;
+    }
+
+    void Tokenizer::compile()
+    {
+        for (const auto& stage: stages)
+            stage -> compile();
+    }
+
+    std::uint64_t Tokenizer::fingerprint() const
+    {
+        Fingerprint ret;
+        ret.add(fused).add(stages.size());
+        for (const auto& stage: stages)
+            ret.add(stage -> fingerprint());
+        return ret.get();
+    }
+
     bool Tokenizer::addStage(const std::string& name)
     {
         for (const auto& i:stages)
@@ -1,149 +1,122 @@
 #include "nullscript/rules.h"
+#include "nullscript/utf8.h"
+#include "nullscript/context.h"
+#include "nullscript/traverse.h"
+#include "nullscript/symbols.h"
+#include "nullscript/serialize.h"
+#include <typeinfo>
+#include <cstring>
+#include <cctype>
+#include <map>
 #include <tuple>
+#include <limits>
+#include <thread>
+#include <exception>
 
 namespace NULLSCR
 {
-    std::unique_ptr<Token> LexicalRule::create(const std::string& source,unsigned id,unsigned pos) const
+    std::unique_ptr<LexicalRule::PointSource> LexicalRule::scan(const std::string& source,Scratch* scratch) const
     {
-        std::unique_ptr<Token> ret(std::move(creator(source,id)));
-        ret -> setPos(pos);
-        return std::move(ret);
+        if (longest)
+            return std::unique_ptr<PointSource>(new LongestScanner(*this,source));
+        return std::unique_ptr<PointSource>(new Scanner(*this,source,scratch));
     }
-    void LexicalRule::savePoints(const std::string& source, std::vector<SavedPoint>& ps) const
-    {
-        ps.clear();
-        auto send = std::sregex_iterator();
 
-        //use entry points
+    std::unique_ptr<LexicalRule::PointSource> LexicalRule::resume(const std::string& source,const Checkpoint& checkpoint) const
+    {
+        if (longest)
+            return std::unique_ptr<PointSource>(new LongestScanner(*this,source,checkpoint));
+        return std::unique_ptr<PointSource>(new Scanner(*this,source,checkpoint));
+    }
 
-        for (const auto& point: entry_points)
+    std::unique_ptr<Token> LexicalRule::create(const std::string& source,Position from,Position size,unsigned id,Position pos,SymbolTable* symbols) const
+    {
+        if (symbols != nullptr && isInterned(id))
         {
-            auto beg = std::sregex_iterator(source.begin(),source.end(),point.regex);
-            for (; beg != send; ++beg)
-            {
-                auto& i = *beg;
-                ps.emplace_back(    i.position(),
-                                    point.state,
-                                    point.id,
-                                    i.length(),
-                                    point.scoped);
-            }
+            unsigned sym = symbols -> intern(source.data() + from,size);
+            return std::unique_ptr<Token>(new SymbolToken(pos,sym,symbols -> get(sym)));
         }
+        std::unique_ptr<Token> ret(std::move(creator(source.substr(from,size),id)));
+        if (ret)
+            ret -> setPos(pos);
+        return std::move(ret);
+    }
 
-        //use keywords trie
+    LexicalRule::CharClass& LexicalRule::CharClass::add(unsigned char c)
+    {
+        table[c] = true;
+        return *this;
+    }
 
-        std::vector<const WordsTrieNode*> matches;
-        WordsTrieNode* tmp;
-        matches.emplace_back(&keyword_points.getRoot());
+    LexicalRule::CharClass& LexicalRule::CharClass::add(unsigned char from,unsigned char to)
+    {
+        for (unsigned c=from; c<=to; ++c)
+            table[c] = true;
+        return *this;
+    }
 
-        for (unsigned i=0; i < source.size(); ++i)
-        {
-            for (int j=0; j<static_cast<int>(matches.size()); ++j)
-            {
-                tmp = matches[j] -> step(source[i]);
-                if (tmp == nullptr || matches[j] -> value)
-                {
-                    //try adding previous state to points
+    LexicalRule::CharClass& LexicalRule::CharClass::add(const std::string& chars)
+    {
+        for (auto c: chars)
+            table[static_cast<unsigned char>(c)] = true;
+        return *this;
+    }
 
-                    if (matches[j] -> value)
-                    {
-                        //check mode, determine need to push, push
-                        bool insert = true;
-                        std::vector<WordPoint>* s = matches[j] -> value.get();
-                        for (auto v:*s)
-                        {
-                            if (i - v.size >= 1 && !WordPoint::checkChar(source[i -1 - v.size],v.mode))
-                            {
-                                insert = false;
-                            }
-                            if (!WordPoint::checkChar(source[i],v.mode))
-                            {
-                                insert = false;
-                            }
-                            if (insert)
-                            {
-                                ps.emplace_back(    i - v.size,
-                                                    v.state,
-                                                    v.id,
-                                                    v.size,
-                                                    v.scoped);
-                            }
-                        }
-                    }
-                    if (tmp == nullptr) //erase match
-                    {
-                        matches.erase(matches.begin()+j);
-                        --j;
-                    }
-                    else
-                    {
-                        matches[j] = tmp;
-                    }
-                }
-                else
-                {
-                    matches[j] = tmp;
-                }
-            }
-            matches.emplace_back(&keyword_points.getRoot());
-        }
-        for (int j=0; j<static_cast<int>(matches.size()); ++j)
-        {
-            std::vector<WordPoint>* s = matches[j] -> value.get();
-            if (s != nullptr)
-            {
-                for (auto v:*s)
-                {
-                    if (source.size() -1 - v.size < 0 || WordPoint::checkChar(source[source.size() -1 - v.size],v.mode))
-                    {
-                        ps.emplace_back(    source.size() - v.size,
-                                                        v.state,
-                                                        v.id,
-                                                        v.size,
-                                                        v.scoped);
-                    }
-                }
-            }
-        }
-        std::sort(ps.begin(),ps.end(),[](const SavedPoint& a,const SavedPoint& b)
-        {
-            return (a.pos == b.pos) ? (a.size > b.size) : (a.pos < b.pos);
-        });
+    LexicalRule::CharClass& LexicalRule::CharClass::remove(unsigned char c)
+    {
+        table[c] = false;
+        return *this;
     }
 
-    bool LexicalRule::WordPoint::checkChar(char c,unsigned mode)
+    LexicalRule::CharClass& LexicalRule::CharClass::remove(const std::string& chars)
     {
-        switch (mode)
+        for (auto c: chars)
+            table[static_cast<unsigned char>(c)] = false;
+        return *this;
+    }
+
+    LexicalRule::CharClass LexicalRule::CharClass::word()
+    {
+        return CharClass().add('a','z').add('A','Z').add('0','9').add(0x80,0xFF);
+    }
+
+    LexicalRule::CharClass LexicalRule::CharClass::keyword()
+    {
+        return word().add('_');
+    }
+
+    const LexicalRule::CharClass* LexicalRule::getBoundary(unsigned mode) const
+    {
+        static const CharClass builtin[] = {CharClass::word(),CharClass::keyword(),CharClass()};
+        if (mode < Modes::Custom)
+            return &builtin[mode];
+        if (mode - Modes::Custom < classes.size())
+            return &classes[mode - Modes::Custom];
+        return &builtin[Modes::String];
+    }
+
+    unsigned LexicalRule::addMode(const CharClass& word)
+    {
+        classes.push_back(word);
+        config.add(0);
+        for (unsigned i=0; i<256; i+=64)
         {
-        case Modes::Word:
-            {
-                return ((c < 'a' || c > 'z') && (c < 'A' || c > 'Z') && (c < '0' || c > '9'));
-                break;
-            }
-        case Modes::Keyword:
-            {
-                return ((c < 'a' || c > 'z') && (c < 'A' || c > 'Z') && (c < '0' || c > '9') && c != '_');
-                break;
-            }
+            std::uint64_t bits = 0;
+            for (unsigned k=0; k<64; ++k)
+                bits |= static_cast<std::uint64_t>(word.contains(static_cast<char>(i + k))) << k;
+            config.add(bits);
         }
-        return true;
+        return Modes::Custom + classes.size() - 1;
     }
 
     LexicalRule::WordsTrieNode* LexicalRule::WordsTrieNode::step(char c) const
     {
-        if (c > 0 && c < 128)
-        {
-            if (nodes[static_cast<unsigned char>(c)])
-                return nodes[static_cast<unsigned char>(c)].get();
-            return nullptr;
-        }
-        return nullptr;
+        return nodes[static_cast<unsigned char>(c)].get();
     }
 
     void LexicalRule::WordsTrieNode::add(LexicalRule::WordsTrieNode* node,char c)
     {
-        if (c > 0 && c < 128)
-            nodes[static_cast<unsigned char>(c)].reset(node);
+        nodes[static_cast<unsigned char>(c)].reset(node);
     }
 
     void LexicalRule::WordsTrie::add(const std::string& key,const WordPoint& value)
@@ -181,490 +154,2577 @@ namespace NULLSCR
         return root;
     }
 
-    void LexicalRule::apply(std::vector<TokenEntity>& source) const
+    LexicalRule::Scanner::Scanner(const LexicalRule& r,const std::string& s,Scratch* sc): rule(r), source(s), pending_at(0), scan(0), scratch(sc)
     {
-        if (creator)
+        if (scratch != nullptr)
         {
-            for (int i=0; i < static_cast<int>(source.size()); ++i)
-            {
-                if (source[i].token -> getType() == typeid(StringToken) && source[i].type == 0)
-                {
-                    StringToken* src = &source[i].token -> forceAs<StringToken>();
-                    std::vector<SavedPoint> points;
-                    savePoints(src -> str,points);
-                    if (points.size())
-                    {
-                        TokenEntity tmp = std::move(source[i]);
-                        std::vector<TokenEntity*> stack_list;
-                        source.erase(source.begin()+i);
-
-                        std::unique_ptr<UnscopedBlock> sb;
-
-                        unsigned offset = 0,lastOffset = 0;
-                        unsigned inserted = 0;
-                        i -= 1;
-                        bool advance,rush;
-                        for (unsigned j=0; j < points.size(); ++j)
-                        {
-                            if (offset <= points[j].pos )
-                            {
-                                advance = true;
-                                rush = true;
-                                if (sb)
-                                {
-                                    advance = false;
-                                    rush = false;
-                                    if (points[j].state == States::pop || points[j].state == States::silentpop || points[j].state == States::toggle)
-                                    {
-                                        if (points[j].id == sb -> id) //found pop corresponding to unscoped push
-                                        {
-                                            UnscopedBlock* sbp = sb.get();
-                                            sbp -> end = points[j].pos;
-                                            if (points[j].state != States::silentpop)
-                                            {
-                                                if (stack_list.size()) // push to back of stack
-                                                {
-                                                    std::unique_ptr<Token> tmpu = std::move(create(src -> str.substr(sbp -> start,sbp -> end - sbp -> start + points[j].size),points[j].id,points[j].pos+src -> getPos()));
-                                                    if (tmpu)
-                                                        stack_list.back() -> token -> forceAs<ScopeToken>().tokens.emplace_back(std::move(tmpu),points[j].id);
-                                                }
-                                                else // push to source
-                                                {
-                                                    std::unique_ptr<Token> tmpu = std::move(create(src -> str.substr(sbp -> start,sbp -> end - sbp -> start + points[j].size),points[j].id,points[j].pos+src -> getPos()));
-                                                    if (tmpu)
-                                                    {
-                                                        ++inserted;
-                                                        source.emplace(source.begin()+i+inserted,std::move(tmpu),points[j].id);
-                                                    }
-                                                }
-                                            }
-                                            sb.release();
-                                            advance = true;
-                                            rush = true;
-                                        }
-                                    }
-                                }
-                                else
-                                {
-                                    if ( lastOffset != points[j].pos && points[j].state != States::ignore) //found unmatched part
-                                    {
-                                        //insert raw string in between
-                                        if (stack_list.size()) //push to back of stack
-                                        {
-                                            std::unique_ptr<Token> tmpu = std::move(create(src -> str.substr(lastOffset,points[j].pos - lastOffset),0,lastOffset + src -> getPos()));
-                                            if (tmpu)
-                                                stack_list.back() -> token -> forceAs<ScopeToken>().tokens.emplace_back(std::move(tmpu),0);
-                                        }
-                                        else // push to source
-                                        {
-                                            std::unique_ptr<Token> tmpu = std::move(create(src -> str.substr(lastOffset,points[j].pos - lastOffset),0,lastOffset + src -> getPos()));
-                                            if (tmpu)
-                                            {
-                                                ++inserted;
-                                                source.emplace(source.begin()+i+inserted,std::move(tmpu),0);
-                                            }
-                                        }
-                                    }
-                                    //process point instruction
-                                    switch (points[j].state)
-                                    {
-                                    case States::push:
-                                        {
-                                            if (points[j].scoped) //push scope
-                                            {
-                                                if (stack_list.size()) //push to back of stack
-                                                {
-                                                    ScopeToken* st = &stack_list.back() -> token -> forceAs<ScopeToken>();
-                                                    std::unique_ptr<Token> tmpu = std::move(create(src -> str.substr(points[j].pos,points[j].size),points[j].id,points[j].pos+src -> getPos()));
-                                                    if (tmpu && dynamic_cast<ScopeToken*>(tmpu.get()) != nullptr)
-                                                    {
-                                                        st -> tokens.emplace_back(std::move(tmpu),points[j].id);
-                                                        stack_list.emplace_back(&st -> tokens.back());
-                                                    }
-                                                }
-                                                else //push to source
-                                                {
-                                                    std::unique_ptr<Token> tmpu = std::move(create(std::string(),points[j].id,points[j].pos+src -> getPos()));
-                                                    if (tmpu && dynamic_cast<ScopeToken*>(tmpu.get()) != nullptr)
-                                                    {
-                                                        ++inserted;
-                                                        source.emplace(source.begin()+i+inserted,std::move(tmpu),points[j].id);
-                                                        stack_list.emplace_back(&(*(source.begin()+i+inserted)) );
-                                                    }
-                                                }
-                                            }
-                                            else //prepare unscoped block
-                                            {
-                                                sb.reset(new UnscopedBlock(points[j].pos,points[j].id));
-                                            }
-                                            break;
-                                        }
-                                    case States::pop:
-                                        {
-                                            if (stack_list.size() && stack_list.back() -> type == points[j].id) //matching push pop
-                                            {
-                                                stack_list.pop_back();
-                                            }
-                                            else //error
-                                            {
-                                                throw TokenizerException(points[j].pos+src -> getPos(),"Scope boundaries type mismatch");
-                                            }
-                                            break;
-                                        }
-                                    case States::silentpop:
-                                        {
-                                            break;
-                                        }
-                                    case States::toggle:
-                                        {
-                                            sb.reset(new UnscopedBlock(points[j].pos,points[j].id));
-                                            break;
-                                        }
-                                    case States::insert: //insert token created from matched sequence
-                                        {
-                                            if (stack_list.size()) //push to back of stack
-                                            {
-                                                std::unique_ptr<Token> tmpu = std::move(create(src -> str.substr(points[j].pos,points[j].size),points[j].id,points[j].pos+src -> getPos()));
-                                                if (tmpu)
-                                                {
-                                                    stack_list.back() -> token -> forceAs<ScopeToken>().tokens.emplace_back(std::move(tmpu),points[j].id);
-                                                }
-                                            }
-                                            else //push to source
-                                            {
-                                                std::unique_ptr<Token> tmpu = std::move(create(src -> str.substr(points[j].pos,points[j].size),points[j].id,points[j].pos+src -> getPos()));
-                                                if (tmpu)
-                                                {
-                                                    ++inserted;
-                                                    source.emplace(source.begin()+i+inserted,std::move(tmpu),points[j].id);
-                                                }
-                                            }
-                                            break;
-                                        }
-                                    case States::forget:
-                                        {
-                                            break;
-                                        }
-                                    case States::ignore:
-                                        {
-                                            advance = false;
-                                            break;
-                                        }
-                                    }
-                                }
-                                if (rush)
-                                    offset = points[j].pos + points[j].size;
-                                else
-                                    offset = points[j].pos;
-                                if (advance)
-                                    lastOffset = offset;
-                            }
-                        }
-                        if (stack_list.size() || sb)
-                        {
-                            //err
-                        }
-                        if (offset != src -> str.size())
-                        {
-                            ++inserted;
-                            source.emplace(source.begin()+i+inserted,std::unique_ptr<Token>(new StringToken(offset + src -> getPos(),src -> str.substr(offset,src -> str.size() - offset))),0);
-                        }
-                        i += inserted;
-                    }
-                }
-            }
+            pending.swap(scratch -> pending);
+            words.swap(scratch -> words);
         }
+        heads.reserve(rule.entry_points.size());
+        for (const auto& point: rule.entry_points)
+            heads.emplace_back(std::sregex_iterator(source.begin(),source.end(),point.regex),&point);
     }
 
-    void LexicalRule::addParsePoint(const std::regex& reg,unsigned id,unsigned state,bool scoped)
+    LexicalRule::Scanner::Scanner(const LexicalRule& r,const std::string& s,const Checkpoint& c): rule(r), source(s), pending_at(0), scan(c.scan), scratch(nullptr)
     {
-        entry_points.emplace_back(reg,id,state,scoped);
-    }
-    void LexicalRule::addParsePoint(const std::string& key,unsigned id,unsigned mode,unsigned state,bool scoped)
-    {
-        keyword_points.add(key,WordPoint(id,state,mode,key.size(),scoped));
+        if (c.heads.size() != rule.entry_points.size())
+            throw std::logic_error("LexicalRule exception: checkpoint was taken with another rule");
+        heads.reserve(rule.entry_points.size());
+        for (unsigned i=0; i < c.heads.size(); ++i)
+        {
+            const RegexPoint* point = &rule.entry_points[i];
+            if (c.heads[i] == std::numeric_limits<Position>::max())
+            {
+                heads.emplace_back(std::sregex_iterator(),point);
+                continue;
+            }
+            auto flags = c.heads[i] ? std::regex_constants::match_prev_avail : std::regex_constants::match_default;
+            heads.emplace_back(std::sregex_iterator(source.begin() + c.heads[i],source.end(),point -> regex,flags),point);
+            heads.back().origin = c.heads[i];
+        }
     }
-    void LexicalRule::setTokenCreator(const std::function<std::unique_ptr<Token>(const std::string&,unsigned)>& f)
+
+    LexicalRule::Scanner::~Scanner()
     {
-        creator = f;
+        if (scratch != nullptr)
+        {
+            pending.clear();
+            words.clear();
+            pending.swap(scratch -> pending);
+            words.swap(scratch -> words);
+        }
     }
 
-    void ComplexRule::apply(std::vector<TokenEntity>& source) const
+    void LexicalRule::walk(const std::string& source,Position start,std::vector<SavedPoint>& out) const
     {
-        if (deep)
+        const WordsTrieNode* node = &keyword_points.getRoot();
+        Position i = start;
+        while (i < source.size())
         {
-            for (auto& i: source)
+            node = node -> step(source[i]);
+            ++i;
+            if (node == nullptr)
+                return;
+            if (node -> value)
             {
-                ScopeToken* sc = i.token -> as<ScopeToken>();
-                if (sc != nullptr)
+                //check boundaries of each keyword ending here
+                for (const auto& v: *(node -> value))
                 {
-                    apply(sc -> tokens);
+                    if (start >= 1 && v.boundary -> contains(source[start - 1]))
+                        continue;
+                    if (i < source.size() && v.boundary -> contains(source[i]))
+                        continue;
+                    out.emplace_back(start,v.state,v.id,v.size,v.scoped);
                 }
             }
         }
-        if (func)
-            func(source);
     }
 
-    MergingLayer::TypesTrieNode* MergingLayer::TypesTrieNode::step(unsigned k) const
+    void LexicalRule::Scanner::walk(Position start)
     {
-        if (k >= 128)
-            return nullptr;
-        return nodes[k];
+        rule.walk(source,start,words);
     }
 
-    void MergingLayer::TypesTrieNode::set(unsigned k,MergingLayer::TypesTrieNode* val)
+    bool LexicalRule::Scanner::next(SavedPoint& out,Position offset)
     {
-        if (k < 128)
-            nodes[k] = val;
-    }
+        for (; pending_at < pending.size(); ++pending_at)
+        {
+            if (pending[pending_at].pos >= offset)
+            {
+                out = pending[pending_at++];
+                return true;
+            }
+        }
+        pending.clear();
+        pending_at = 0;
 
-    const MergingLayer::TypesTrieNode* MergingLayer::TypesTrie::getRoot() const
-    {
-        return &root;
-    }
+        //regex matches keep the order of a full iteration, so they are advanced rather than searched from offset
+        const std::sregex_iterator send;
+        Position first = std::numeric_limits<Position>::max();
+        for (auto& h: heads)
+        {
+            while (h.it != send && h.origin + h.it -> position() < offset)
+                ++h.it;
+            if (h.it != send && h.origin + h.it -> position() < first)
+                first = h.origin + h.it -> position();
+        }
 
-    MergingLayer::TypesTrieNode* MergingLayer::TypesTrie::getRoot()
-    {
-        return &root;
-    }
+        //keywords only need to be looked for up to the nearest regex match
+        Position start = std::max(scan,offset);
+        for (; start < source.size() && start <= first; ++start)
+        {
+            walk(start);
+            if (words.size())
+            {
+                first = start++;
+                break;
+            }
+        }
+        scan = start;
 
-    MergingLayer::TypesTrieNode* MergingLayer::TypesTrie::add(const std::vector<unsigned>& path,int value)
-    {
-        return append(getRoot(),path,value);
-    }
+        if (first == std::numeric_limits<Position>::max())
+            return false;
 
-    MergingLayer::TypesTrieNode* MergingLayer::TypesTrie::append(MergingLayer::TypesTrieNode* target,const std::vector<unsigned>& path,int value)
-    {
-        for (auto i:path)
-            if (i >= 128)
-                return nullptr;
-        MergingLayer::TypesTrieNode *c = target,*n = target;
-        for (auto i:path)
+        for (auto& h: heads)
         {
-            n = c -> step(i);
-            if (n == nullptr)
+            if (h.it != send && h.origin + h.it -> position() == first)
             {
-                MergingLayer::TypesTrieNode* t = new MergingLayer::TypesTrieNode();
-                c -> set(i,t);
-                nodes.emplace(t);
-                c = t;
+                pending.emplace_back(first,h.point -> state,h.point -> id,h.it -> length(),h.point -> scoped);
+                ++h.it;
             }
-            else
+        }
+        pending.insert(pending.end(),words.begin(),words.end());
+        words.clear();
+        if (pending.size() > 1)
+        {
+            std::stable_sort(pending.begin(),pending.end(),[](const SavedPoint& a,const SavedPoint& b)
             {
-                c = n;
-            }
+                return a.size > b.size;
+            });
         }
-        c -> value = value;
-        return c;
-    }
-
-    void MergingLayer::TypesTrie::connect(const std::vector<unsigned>& path,MergingLayer::TypesTrieNode* target)
-    {
-        connect(getRoot(),path,target);
+        out = pending[pending_at++];
+        return true;
     }
 
-    void MergingLayer::TypesTrie::connect(MergingLayer::TypesTrieNode* start,const std::vector<unsigned>& path,MergingLayer::TypesTrieNode* target)
+    Position LexicalRule::findWord(const std::string& source,const std::string& word,const CharClass& boundary,Position from,Position to)
     {
-        for (auto i:path)
-            if (i >= 128)
-                return;
-        MergingLayer::TypesTrieNode *c = start,*n = start;
-        unsigned i=0;
-        for (; i+1<path.size(); ++i)
+        if (word.empty())
+            return to;
+        while (from < to)
         {
-            n = c -> step(path[i]);
-            if (n == nullptr)
-            {
-                MergingLayer::TypesTrieNode* t = new MergingLayer::TypesTrieNode();
-                c -> set(path[i],t);
-                nodes.emplace(t);
-                c = t;
-            }
-            else
+            const void* p = std::memchr(source.data() + from,word[0],to - from);
+            if (p == nullptr)
+                break;
+            from = static_cast<const char*>(p) - source.data();
+            //same checks as keyword walk, so no point it would report is passed over
+            if (source.compare(from,word.size(),word) == 0 && (from == 0 || !boundary.contains(source[from - 1])))
             {
-                c = n;
+                Position end = from + word.size();
+                if (end >= source.size() || !boundary.contains(source[end]))
+                    return from;
             }
+            ++from;
         }
-        c -> set(path[i],target);
+        return to;
     }
 
-
-    MergingLayer::TypesTrieNode& MergingLayer::TypesTrieNode::operator = (MergingLayer::TypesTrieNode&& t) noexcept
+    void LexicalRule::Scanner::skip(unsigned id,Position offset)
     {
-        refs = t.refs;
-        value = t.value;
-        for (unsigned i=0; i<128; ++i)
+        auto t = rule.terminators.find(id);
+        if (t == rule.terminators.end() || t -> second.regex || offset >= source.size())
+            return;
+
+        Position target = source.size();
+        for (const auto& w: t -> second.words)
+            target = findWord(source,w.first,*w.second.boundary,offset,target);
+
+        //without terminator remainder of source starts at last point inside block, so it is still scanned
+        if (target == source.size() || target <= std::max(scan,offset))
+            return;
+        pending.clear();
+        pending_at = 0;
+        scan = target;
+        const std::sregex_iterator send;
+        for (auto& h: heads)
         {
-            nodes[i] = t.nodes[i];
-            t.nodes[i] = nullptr;
+            if (h.it != send && h.origin + h.it -> position() >= target)
+                continue;
+            h.it = std::sregex_iterator(source.begin() + target,source.end(),h.point -> regex,std::regex_constants::match_prev_avail);
+            h.origin = target;
         }
-        return *this;
     }
 
-    MergingLayer::TypesTrie::TypesTrie(MergingLayer::TypesTrie&& t) noexcept
+    bool LexicalRule::Scanner::save(Checkpoint& out) const
     {
-        nodes = std::move(t.nodes);
-        t.nodes.clear();
-        root = std::move(t.root);
+        if (pending_at < pending.size())
+            return false;
+        const std::sregex_iterator send;
+        out.scan = scan;
+        out.heads.clear();
+        for (const auto& h: heads)
+            out.heads.push_back(h.it != send ? h.origin + h.it -> position() : std::numeric_limits<Position>::max());
+        out.skipped = false;
+        return true;
     }
 
-    MergingLayer::TypesTrie::~TypesTrie()
+    LexicalRule::LongestScanner::LongestScanner(const LexicalRule& r,const std::string& s): rule(r), source(s), block(nullptr), blockId(0), scan(0)
     {
-        for (auto i:nodes)
+        heads.reserve(rule.entry_points.size());
+        for (const auto& point: rule.entry_points)
         {
-            delete i;
+            heads.emplace_back(&point);
+            search(heads.back(),0);
         }
     }
 
-    void MergingLayer::savePoints(const std::vector<MergingLayer::TypePoint>& in,std::vector<MergingLayer::TypePoint>& out) const
+    LexicalRule::LongestScanner::LongestScanner(const LexicalRule& r,const std::string& s,const Checkpoint& c): rule(r), source(s), block(nullptr), blockId(c.block_id), scan(c.scan)
     {
-        out.clear();
-
-        std::vector<std::pair<unsigned,const MergingLayer::TypesTrieNode*>> states;
-
-        for (unsigned i=0; i<in.size(); ++i)
-        {
-            states.emplace_back(0,type_points.getRoot());
-            const MergingLayer::TypesTrieNode* next;
-            for (int j=0; static_cast<unsigned>(j) < states.size(); ++j)
-            {
-                next = states[j].second -> step(in[i].type);
-                if (states[j].second -> value != -1)
-                {
-                    out.emplace_back(i - states[j].first,i,states[j].second -> value);
-                }
-                if (next == nullptr)
-                {
-                    states.erase(states.begin()+j);
-                    --j;
-                }
-                else
-                {
-                    ++states[j].first;
-                    states[j].second = next;
-                }
-            }
-        }
-        for (const auto& i:states)
+        if (c.skipped)
+            skip(c.block_id,c.scan);
+        heads.reserve(rule.entry_points.size());
+        for (const auto& point: rule.entry_points)
         {
-            if (i.second != nullptr && i.second -> value != -1)
-            {
-                out.emplace_back(in.size() - i.first,in.size(),i.second -> value);
-            }
+            heads.emplace_back(&point);
+            search(heads.back(),scan);
         }
-        std::sort(out.begin(),out.end(),[](const MergingLayer::TypePoint& a,const MergingLayer::TypePoint& b)
-        {
-            return (a.begin < b.begin) ? true : (a.begin == b.begin ? (a.end - a.begin > b.end - b.begin) : false);
-        });
     }
 
-    MergingLayer::TypesTrieNode* MergingLayer::addTypePath(const std::vector<unsigned>& path,int v)
+    bool LexicalRule::LongestScanner::save(Checkpoint& out) const
     {
-        return type_points.add(path,v);
+        out.scan = scan;
+        out.heads.clear();
+        out.skipped = block != nullptr;
+        return true;
     }
 
-    MergingLayer::TypesTrieNode* MergingLayer::appendTypePath(MergingLayer::TypesTrieNode* target,const std::vector<unsigned>& path,int v)
+    void LexicalRule::LongestScanner::search(RegexHead& h,Position start)
     {
-        return type_points.append(target,path,v);
+        std::smatch m;
+        auto flags = start ? std::regex_constants::match_prev_avail : std::regex_constants::match_default;
+        if (start <= source.size() && std::regex_search(source.begin() + start,source.end(),m,h.point -> regex,flags))
+        {
+            h.at = start + m.position(0);
+            h.size = m.length(0);
+        }
+        else
+        {
+            h.at = std::numeric_limits<Position>::max();
+        }
     }
 
-    void MergingLayer::connectTypePath(const std::vector<unsigned>& path,MergingLayer::TypesTrieNode* node)
+    void LexicalRule::LongestScanner::consider(const SavedPoint& p,SavedPoint& best,bool& found)
     {
-        type_points.connect(path,node);
+        if (!found || p.size > best.size)
+        {
+            best = p;
+            found = true;
+        }
     }
 
-    void MergingLayer::connectTypePath(MergingLayer::TypesTrieNode* start,const std::vector<unsigned>& path,MergingLayer::TypesTrieNode* node)
+    void LexicalRule::LongestScanner::skip(unsigned id,Position)
     {
-        type_points.connect(start,path,node);
+        static const Terminators none;
+        auto t = rule.terminators.find(id);
+        block = t == rule.terminators.end() ? &none : &(t -> second);
+        blockId = id;
     }
 
-
-    std::vector<MergingLayer::TypePoint> MergingLayer::apply(const std::vector<MergingLayer::TypePoint>& in) const
+    bool LexicalRule::LongestScanner::next(SavedPoint& out,Position offset)
     {
-        //TODO: switch from list of changes to list after changes approach
-        std::vector<MergingLayer::TypePoint> ret;
-        std::vector<MergingLayer::TypePoint> tmp;
-        savePoints(in,tmp);
-        unsigned offset = 0;
+        const Position end = std::numeric_limits<Position>::max();
+        Position start = std::max(scan,offset);
+        Position first = end;
+        SavedPoint best(0,0,0,0,false);
+        bool found = false;
 
-        for (const auto& i:tmp)
+        if (block != nullptr)
         {
-            if (i.begin < offset)
-                continue;
-            for (unsigned j=offset; j<i.begin; ++j)
+            //only points closing the block are looked for
+            for (auto& h: heads)
+            {
+                if (h.point -> id != blockId || (h.point -> state != States::pop && h.point -> state != States::silentpop && h.point -> state != States::toggle))
+                    continue;
+                if (h.at < start)
+                    search(h,start);
+                first = std::min(first,h.at);
+            }
+            for (const auto& w: block -> words)
             {
-                ret.emplace_back(in[j]);
+                Position to = first == end ? source.size() : first + 1;
+                Position at = findWord(source,w.first,*w.second.boundary,start,std::min(to,source.size()));
+                if (at < to && at < source.size())
+                    first = at;
             }
-            offset = i.end;
-            ret.emplace_back(i);
+            if (first == end)
+                return false;
+
+            for (const auto& h: heads)
+            {
+                if (h.at == first && h.point -> id == blockId && (h.point -> state == States::pop || h.point -> state == States::silentpop || h.point -> state == States::toggle))
+                    consider(SavedPoint(first,h.point -> state,h.point -> id,h.size,h.point -> scoped),best,found);
+            }
+            for (const auto& w: block -> words)
+            {
+                if (findWord(source,w.first,*w.second.boundary,first,std::min(first + 1,source.size())) == first)
+                    consider(SavedPoint(first,w.second.state,w.second.id,w.second.size,w.second.scoped),best,found);
+            }
+            block = nullptr;
         }
+        else
+        {
+            for (auto& h: heads)
+            {
+                if (h.at < start)
+                    search(h,start);
+                first = std::min(first,h.at);
+            }
 
-        return std::move(ret);
-    }
+            //keywords only need to be looked for up to the nearest regex match
+            for (Position p = start; p < source.size() && p <= first; ++p)
+            {
+                rule.walk(source,p,words);
+                if (words.size())
+                {
+                    first = p;
+                    break;
+                }
+            }
+            if (first == end)
+                return false;
 
-    void LayeredMergingRule::setTokenMerger(const std::function<std::unique_ptr<Token>(unsigned,unsigned,unsigned,const std::vector<TokenEntity>&)>& f)
-    {
-        merger = f;
+            for (const auto& h: heads)
+            {
+                if (h.at == first)
+                    consider(SavedPoint(first,h.point -> state,h.point -> id,h.size,h.point -> scoped),best,found);
+            }
+            for (const auto& w: words)
+                consider(w,best,found);
+            words.clear();
+        }
+
+        out = best;
+        scan = first + std::max<Position>(best.size,1);
+        return true;
     }
 
-    std::unique_ptr<Token> LayeredMergingRule::merge(unsigned begin,unsigned end,unsigned type,const std::vector<TokenEntity>& source) const
+    LexicalRule::Machine::Machine(const LexicalRule& r,const std::string& s,Position b,PointSource& p,Diagnostics* d,Scratch* sc,SymbolTable* sy): rule(r), source(s), base(b), points(p), diagnostics(d), block(0,0), blocked(false), done(false), offset(0), lastOffset(0), scratch(nullptr), symbols(sy)
     {
-        std::unique_ptr<Token> tmp = std::move(merger(begin,end,type,source));
-        tmp -> setPos(source[begin].token -> getPos());
-        return std::move(tmp);
+        if (rule.utf8)
+        {
+            Position bad = Utf8::validate(source);
+            if (bad != source.size())
+            {
+                if (diagnostics == nullptr)
+                    throw TokenizerException(bad + base,"Invalid UTF-8 sequence");
+                diagnostics -> report(bad + base,Diagnostics::Codes::InvalidEncoding,"Invalid UTF-8 sequence");
+            }
+        }
+        if (sc != nullptr)
+        {
+            scratch = sc;
+            scopes.swap(scratch -> scopes);
+            opens.swap(scratch -> opens);
+            sizes.swap(scratch -> sizes);
+        }
+    }
+
+    LexicalRule::Machine::Machine(const LexicalRule& r,const std::string& s,Position b,PointSource& p,const Checkpoint& c,Diagnostics* d,SymbolTable* sy):
+        rule(r), source(s), base(b), points(p), diagnostics(d), scopes(c.scopes), opens(c.opens), sizes(c.sizes), block(c.block_start,c.block_id), blocked(c.blocked), done(false),
+        offset(c.offset), lastOffset(c.lastOffset), scratch(nullptr), symbols(sy)
+    {
+        if (scopes.size() != opens.size() || scopes.size() != sizes.size() || offset > source.size() || lastOffset > offset)
+            throw std::logic_error("LexicalRule exception: checkpoint does not fit source");
+    }
+
+    LexicalRule::Machine::~Machine()
+    {
+        if (scratch != nullptr)
+        {
+            scopes.clear();
+            opens.clear();
+            sizes.clear();
+            scopes.swap(scratch -> scopes);
+            opens.swap(scratch -> opens);
+            sizes.swap(scratch -> sizes);
+        }
+    }
+
+    void LexicalRule::Machine::mismatch(const SavedPoint& point,Sink& sink)
+    {
+        if (diagnostics == nullptr)
+            throw TokenizerException(point.pos + base,"Scope boundaries type mismatch");
+
+        //close scopes opened after the one this point ends, if there is one
+        unsigned match = scopes.size();
+        while (match > 0 && scopes[match - 1] != point.id)
+            --match;
+        if (match == 0)
+        {
+            diagnostics -> report(point.pos + base,Diagnostics::Codes::ScopeMismatch,"Scope end without matching start");
+            return;
+        }
+        while (scopes.size() >= match)
+        {
+            if (scopes.size() > match)
+                diagnostics -> report(opens.back(),Diagnostics::Codes::UnclosedScope,"Scope closed by end of outer scope");
+            scopes.pop_back();
+            opens.pop_back();
+            sizes.pop_back();
+            sink.close();
+        }
+    }
+
+    const std::vector<unsigned>& LexicalRule::Machine::getScopes() const
+    {
+        return scopes;
+    }
+
+    Position LexicalRule::Machine::getLastOffset() const
+    {
+        return lastOffset;
+    }
+
+    bool LexicalRule::Machine::save(Checkpoint& out) const
+    {
+        if (done || !points.save(out))
+            return false;
+        out.offset = offset;
+        out.lastOffset = lastOffset;
+        out.scopes = scopes;
+        out.opens = opens;
+        out.sizes = sizes;
+        out.blocked = blocked;
+        out.block_start = block.start;
+        out.block_id = block.id;
+        return true;
+    }
+
+    bool LexicalRule::Machine::step(Sink& sink)
+    {
+        if (done)
+            return false;
+
+        SavedPoint point(0,0,0,0,false);
+        do
+        {
+            if (!points.next(point,offset))
+            {
+                if (diagnostics != nullptr)
+                {
+                    for (auto i: opens)
+                        diagnostics -> report(i,Diagnostics::Codes::UnclosedScope,"Scope not closed before end of source");
+                    if (blocked)
+                        diagnostics -> report(block.start + base,Diagnostics::Codes::UnclosedBlock,"Block not closed before end of source");
+                }
+                if (offset != source.size())
+                {
+                    if (symbols != nullptr && rule.isInterned(0))
+                        sink.tail(rule.create(source,offset,source.size() - offset,0,offset + base,symbols));
+                    else
+                        sink.tail(std::unique_ptr<Token>(new StringToken(offset + base,source.substr(offset,source.size() - offset))));
+                }
+                done = true;
+                return true;
+            }
+        }
+        while (point.pos < offset);
+
+        bool advance = true,rush = true,opened = false;
+        if (blocked)
+        {
+            advance = false;
+            rush = false;
+            if (point.state == States::pop || point.state == States::silentpop || point.state == States::toggle)
+            {
+                if (point.id == block.id) //found pop corresponding to unscoped push
+                {
+                    block.end = point.pos;
+                    if (point.state != States::silentpop)
+                    {
+                        std::unique_ptr<Token> tmpu = rule.create(source,block.start,block.end - block.start + point.size,point.id,point.pos + base,symbols);
+                        if (tmpu)
+                            sink.insert(std::move(tmpu),point.id);
+                    }
+                    blocked = false;
+                    advance = true;
+                    rush = true;
+                }
+            }
+        }
+        else
+        {
+            if (lastOffset != point.pos && point.state != States::ignore) //found unmatched part
+            {
+                //insert raw string in between
+                std::unique_ptr<Token> tmpu = rule.create(source,lastOffset,point.pos - lastOffset,0,lastOffset + base,symbols);
+                if (tmpu)
+                    sink.insert(std::move(tmpu),0);
+            }
+            //process point instruction
+            switch (point.state)
+            {
+            case States::push:
+                {
+                    if (point.scoped) //push scope
+                    {
+                        Position size = scopes.size() ? point.size : 0;
+                        std::unique_ptr<Token> tmpu = rule.create(source,point.pos,size,point.id,point.pos + base);
+                        if (tmpu && dynamic_cast<ScopeToken*>(tmpu.get()) != nullptr)
+                        {
+                            scopes.push_back(point.id);
+                            opens.push_back(point.pos + base);
+                            sizes.push_back(size);
+                            sink.open(std::move(tmpu),point.id);
+                        }
+                    }
+                    else //prepare unscoped block
+                    {
+                        block = UnscopedBlock(point.pos,point.id);
+                        blocked = true;
+                        opened = true;
+                    }
+                    break;
+                }
+            case States::pop:
+                {
+                    if (scopes.size() && scopes.back() == point.id) //matching push pop
+                    {
+                        scopes.pop_back();
+                        opens.pop_back();
+                        sizes.pop_back();
+                        sink.close();
+                    }
+                    else //error
+                    {
+                        mismatch(point,sink);
+                    }
+                    break;
+                }
+            case States::silentpop:
+                {
+                    break;
+                }
+            case States::toggle:
+                {
+                    block = UnscopedBlock(point.pos,point.id);
+                    blocked = true;
+                    opened = true;
+                    break;
+                }
+            case States::insert: //insert token created from matched sequence
+                {
+                    std::unique_ptr<Token> tmpu = rule.create(source,point.pos,point.size,point.id,point.pos + base,symbols);
+                    if (tmpu)
+                        sink.insert(std::move(tmpu),point.id);
+                    break;
+                }
+            case States::forget:
+                {
+                    break;
+                }
+            case States::ignore:
+                {
+                    advance = false;
+                    break;
+                }
+            }
+        }
+        if (rush)
+            offset = point.pos + point.size;
+        else
+            offset = point.pos;
+        if (advance)
+            lastOffset = offset;
+        if (opened && (rule.skipping || rule.longest))
+            points.skip(block.id,offset);
+        return true;
+    }
+
+    class LexicalRule::Builder: public LexicalRule::Sink
+    {
+    private:
+        std::vector<TokenEntity>& top;
+        std::vector<std::vector<TokenEntity>*> stack;
+
+        std::vector<TokenEntity>& current()
+        {
+            return stack.size() ? *stack.back() : top;
+        }
+    public:
+        virtual void insert(std::unique_ptr<Token>&& token,unsigned id) override
+        {
+            current().emplace_back(std::move(token),id);
+        }
+        virtual void open(std::unique_ptr<Token>&& token,unsigned id) override
+        {
+            std::vector<TokenEntity>* children = &token -> as<ScopeToken>() -> tokens.edit();
+            current().emplace_back(std::move(token),id);
+            stack.push_back(children);
+        }
+        virtual void close() override
+        {
+            stack.pop_back();
+        }
+        virtual void tail(std::unique_ptr<Token>&& token) override
+        {
+            top.emplace_back(std::move(token),0);
+        }
+
+        Builder(std::vector<TokenEntity>& t): top(t) {};
+    };
+
+    //keeps only tokens starting in a range and scopes around them,
+    //scopes starting before it are put in their parents once they get a token of range
+    class LexicalRule::RangeBuilder: public LexicalRule::Sink
+    {
+    private:
+        struct Level
+        {
+            TokenEntity scope; //until it is put in its parent
+            std::vector<TokenEntity>* children;
+            Level(TokenEntity&& s,std::vector<TokenEntity>* c): scope(std::move(s)), children(c) {};
+        };
+
+        std::vector<TokenEntity>& top;
+        std::vector<Level> stack;
+        std::size_t placed; //levels of stack put in their parents, always the outermost ones
+        Position begin,end;
+
+        std::vector<TokenEntity>& current()
+        {
+            for (; placed < stack.size(); ++placed)
+            {
+                std::vector<TokenEntity>& parent = placed ? *stack[placed - 1].children : top;
+                parent.push_back(std::move(stack[placed].scope));
+            }
+            return stack.size() ? *stack.back().children : top;
+        }
+        bool inside(const Token& token) const
+        {
+            return token.getPos() >= begin && token.getPos() < end;
+        }
+    public:
+        virtual void insert(std::unique_ptr<Token>&& token,unsigned id) override
+        {
+            if (inside(*token))
+                current().emplace_back(std::move(token),id);
+        }
+        virtual void open(std::unique_ptr<Token>&& token,unsigned id) override
+        {
+            std::vector<TokenEntity>* children = &token -> as<ScopeToken>() -> tokens.edit();
+            if (inside(*token))
+                current().emplace_back(std::move(token),id);
+            stack.emplace_back(TokenEntity(std::move(token),id),children);
+            if (!stack.back().scope.token)
+                placed = stack.size();
+        }
+        virtual void close() override
+        {
+            stack.pop_back();
+            placed = std::min(placed,stack.size());
+        }
+        virtual void tail(std::unique_ptr<Token>&& token) override
+        {
+            if (inside(*token))
+                top.emplace_back(std::move(token),0);
+        }
+
+        RangeBuilder(std::vector<TokenEntity>& t,Position b,Position e): top(t), placed(0), begin(b), end(e) {};
+    };
+
+    void LexicalRule::apply(std::vector<TokenEntity>& source) const
+    {
+        lex(source,nullptr);
+    }
+
+    void LexicalRule::apply(std::vector<TokenEntity>& source,Diagnostics& diagnostics) const
+    {
+        lex(source,&diagnostics);
+    }
+
+    void LexicalRule::apply(std::vector<TokenEntity>& source,TokenizeContext& context) const
+    {
+        lex(source,context.getDiagnostics(),&context.getLexer(),context.getSymbols());
+    }
+
+    void LexicalRule::lex(std::vector<TokenEntity>& source,Diagnostics* diagnostics,Scratch* scratch,SymbolTable* symbols) const
+    {
+        if (creator)
+        {
+            std::vector<TokenEntity> ret;
+            std::vector<std::pair<unsigned,unsigned>> moved;
+            if (scratch != nullptr)
+            {
+                ret.swap(scratch -> tokens);
+                moved.swap(scratch -> moved);
+            }
+            ret.reserve(source.size());
+            unsigned i = 0;
+            try
+            {
+                for (; i < source.size(); ++i)
+                {
+                    if (source[i].token -> getType() == typeid(StringToken) && source[i].type == 0 && source[i].token -> forceAs<StringToken>().str.size())
+                    {
+                        const StringToken& src = source[i].token -> forceAs<StringToken>();
+                        std::unique_ptr<PointSource> points = scan(src.str,scratch);
+                        Machine machine(*this,src.str,src.getPos(),*points,diagnostics,scratch,symbols);
+                        Builder builder(ret);
+                        while (machine.step(builder));
+                    }
+                    else
+                    {
+                        moved.emplace_back(i,ret.size());
+                        ret.emplace_back(std::move(source[i]));
+                    }
+                }
+            }
+            catch (...)
+            {
+                //leave source as it was
+                for (const auto& m: moved)
+                    source[m.first] = std::move(ret[m.second]);
+                if (scratch != nullptr)
+                {
+                    ret.clear();
+                    moved.clear();
+                    ret.swap(scratch -> tokens);
+                    moved.swap(scratch -> moved);
+                }
+                throw;
+            }
+            source.swap(ret);
+            if (scratch != nullptr)
+            {
+                //previous contents of source, keeping its capacity for next call
+                ret.clear();
+                moved.clear();
+                ret.swap(scratch -> tokens);
+                moved.swap(scratch -> moved);
+            }
+        }
+    }
+
+    void LexicalRule::index(const std::string& source,Checkpoints& out,Position every,Diagnostics* diagnostics) const
+    {
+        if (every == 0)
+            throw std::logic_error("LexicalRule exception: checkpoints need a distance between them");
+        out.clear();
+        out.size = source.size();
+        out.every = every;
+        if (!creator)
+            return;
+
+        std::vector<TokenEntity> none;
+        RangeBuilder builder(none,0,0);
+        std::unique_ptr<PointSource> points = scan(source);
+        Machine machine(*this,source,0,*points,diagnostics);
+        Position mark = every;
+        Checkpoint checkpoint;
+        while (machine.step(builder))
+        {
+            //points of a position may still be pending, then next step is tried
+            if (machine.getLastOffset() >= mark && machine.save(checkpoint))
+            {
+                out.list.push_back(checkpoint);
+                mark = checkpoint.offset + every;
+            }
+        }
+    }
+
+    void LexicalRule::tokenizeRange(const std::string& source,const Checkpoints& index,Position begin,Position end,std::vector<TokenEntity>& out,Diagnostics* diagnostics,SymbolTable* symbols) const
+    {
+        if (source.size() != index.size)
+            throw std::logic_error("LexicalRule exception: checkpoints were taken for another source");
+        if (!creator || begin >= end)
+            return;
+
+        //tokens made before a checkpoint start at or before its offset, so none of them is in range
+        const Checkpoint start;
+        const Checkpoint* checkpoint = index.find(begin);
+        std::unique_ptr<PointSource> points = checkpoint != nullptr ? resume(source,*checkpoint) : scan(source);
+        Machine machine(*this,source,0,*points,checkpoint != nullptr ? *checkpoint : start,diagnostics,symbols);
+        RangeBuilder builder(out,begin,end);
+        if (checkpoint != nullptr)
+        {
+            //scopes open at checkpoint, made again as they were made when opened
+            for (std::size_t i=0; i<checkpoint -> scopes.size(); ++i)
+            {
+                std::unique_ptr<Token> scope = create(source,checkpoint -> opens[i],checkpoint -> sizes[i],checkpoint -> scopes[i],checkpoint -> opens[i]);
+                if (!scope || scope -> as<ScopeToken>() == nullptr)
+                    throw std::logic_error("LexicalRule exception: checkpoint does not fit rule");
+                builder.open(std::move(scope),checkpoint -> scopes[i]);
+            }
+        }
+        while (machine.getLastOffset() < end && machine.step(builder));
+    }
+
+    const LexicalRule::Checkpoint* LexerCheckpoints::find(Position pos) const
+    {
+        auto it = std::lower_bound(list.begin(),list.end(),pos,[](const LexicalRule::Checkpoint& c,Position p)
+        {
+            return c.offset < p;
+        });
+        return it == list.begin() ? nullptr : &*(it - 1);
+    }
+
+    std::size_t LexerCheckpoints::count() const
+    {
+        return list.size();
+    }
+
+    Position LexerCheckpoints::getSourceSize() const
+    {
+        return size;
+    }
+
+    Position LexerCheckpoints::getDistance() const
+    {
+        return every;
+    }
+
+    void LexerCheckpoints::clear()
+    {
+        list.clear();
+        size = 0;
+        every = 0;
+    }
+
+    static const char checkpoints_magic[4] = {'N','S','C','P'};
+
+    //npos as 0, others shifted by one
+    static void writePosition(Position pos,std::string& out)
+    {
+        TokenCodec::writeVarint(pos == std::numeric_limits<Position>::max() ? 0 : static_cast<std::uint64_t>(pos) + 1,out);
+    }
+
+    static bool readPosition(const char*& cur,const char* end,Position& pos)
+    {
+        std::uint64_t v;
+        if (!TokenCodec::readVarint(cur,end,v))
+            return false;
+        pos = v ? static_cast<Position>(v - 1) : std::numeric_limits<Position>::max();
+        return true;
+    }
+
+    void LexerCheckpoints::encode(std::string& out) const
+    {
+        out.append(checkpoints_magic,4);
+        out.push_back(static_cast<char>(version));
+        TokenCodec::writeVarint(size,out);
+        TokenCodec::writeVarint(every,out);
+        TokenCodec::writeVarint(list.size(),out);
+        for (const auto& c: list)
+        {
+            TokenCodec::writeVarint(c.offset,out);
+            TokenCodec::writeVarint(c.lastOffset,out);
+            TokenCodec::writeVarint(c.scan,out);
+            TokenCodec::writeVarint((c.blocked ? 1 : 0) | (c.skipped ? 2 : 0),out);
+            TokenCodec::writeVarint(c.block_start,out);
+            TokenCodec::writeVarint(c.block_id,out);
+            TokenCodec::writeVarint(c.scopes.size(),out);
+            for (std::size_t i=0; i < c.scopes.size(); ++i)
+            {
+                TokenCodec::writeVarint(c.scopes[i],out);
+                TokenCodec::writeVarint(c.opens[i],out);
+                TokenCodec::writeVarint(c.sizes[i],out);
+            }
+            TokenCodec::writeVarint(c.heads.size(),out);
+            for (auto h: c.heads)
+                writePosition(h,out);
+        }
+    }
+
+    bool LexerCheckpoints::decode(const char* data,std::size_t length)
+    {
+        clear();
+        const char* cur = data;
+        const char* end = data + length;
+        if (length < 5 || std::memcmp(data,checkpoints_magic,4) != 0 || static_cast<unsigned char>(data[4]) != version)
+            return false;
+        cur += 5;
+
+        std::uint64_t v,count;
+        bool ok = TokenCodec::readVarint(cur,end,v);
+        size = v;
+        ok = ok && TokenCodec::readVarint(cur,end,v);
+        every = v;
+        ok = ok && TokenCodec::readVarint(cur,end,count);
+        //every checkpoint takes at least 8 bytes
+        ok = ok && count <= static_cast<std::uint64_t>(end - cur) / 8;
+        for (std::uint64_t k=0; ok && k < count; ++k)
+        {
+            LexicalRule::Checkpoint c;
+            std::uint64_t fields[6];
+            for (auto& f: fields)
+                ok = ok && TokenCodec::readVarint(cur,end,f);
+            if (!ok)
+                break;
+            c.offset = fields[0];
+            c.lastOffset = fields[1];
+            c.scan = fields[2];
+            c.blocked = fields[3] & 1;
+            c.skipped = fields[3] & 2;
+            c.block_start = fields[4];
+            c.block_id = fields[5];
+            ok = TokenCodec::readVarint(cur,end,v) && v <= static_cast<std::uint64_t>(end - cur) / 3;
+            for (std::uint64_t i=0; ok && i < v; ++i)
+            {
+                std::uint64_t id,open,size;
+                ok = TokenCodec::readVarint(cur,end,id) && TokenCodec::readVarint(cur,end,open) && TokenCodec::readVarint(cur,end,size);
+                c.scopes.push_back(id);
+                c.opens.push_back(open);
+                c.sizes.push_back(size);
+            }
+            ok = ok && TokenCodec::readVarint(cur,end,v) && v <= static_cast<std::uint64_t>(end - cur);
+            for (std::uint64_t i=0; ok && i < v; ++i)
+            {
+                Position h;
+                ok = readPosition(cur,end,h);
+                c.heads.push_back(h);
+            }
+            ok = ok && c.offset <= size && (list.empty() || list.back().offset <= c.offset);
+            if (ok)
+                list.push_back(std::move(c));
+        }
+        if (!ok || cur != end)
+        {
+            clear();
+            return false;
+        }
+        return true;
+    }
+
+    bool LexerCheckpoints::decode(const std::string& data)
+    {
+        return decode(data.data(),data.size());
+    }
+
+    LexicalRule::Cursor::Cursor(const LexicalRule& rule,const std::string& source,Position base,Diagnostics* diagnostics,SymbolTable* symbols): points(rule.scan(source)), machine(rule,source,base,*points,diagnostics,nullptr,symbols), events_at(0), opened(0) {}
+
+    void LexicalRule::Cursor::insert(std::unique_ptr<Token>&& token,unsigned id)
+    {
+        events.emplace_back(Events::Insert,std::move(token),id);
+    }
+
+    void LexicalRule::Cursor::open(std::unique_ptr<Token>&& token,unsigned id)
+    {
+        events.emplace_back(Events::Open,std::move(token),id);
+        ++opened;
+    }
+
+    void LexicalRule::Cursor::close()
+    {
+        events.emplace_back(Events::Close,std::unique_ptr<Token>(),0);
+        --opened;
+    }
+
+    void LexicalRule::Cursor::closeAll()
+    {
+        while (opened)
+            close();
+    }
+
+    void LexicalRule::Cursor::tail(std::unique_ptr<Token>&& token)
+    {
+        closeAll();
+        events.emplace_back(Events::Insert,std::move(token),0);
+    }
+
+    bool LexicalRule::Cursor::next()
+    {
+        if (events_at < events.size())
+        {
+            if (events[events_at].event == Events::Close)
+                scopes.pop_back();
+            ++events_at;
+        }
+        if (events_at >= events.size())
+        {
+            events.clear();
+            events_at = 0;
+            while (events.empty() && machine.step(*this));
+            if (events.empty())
+                closeAll();
+            if (events.empty())
+                return false;
+        }
+        if (events[events_at].event == Events::Open)
+            scopes.push_back(events[events_at].entity.type);
+        return true;
+    }
+
+    unsigned LexicalRule::Cursor::getEvent() const
+    {
+        return events[events_at].event;
+    }
+
+    TokenEntity& LexicalRule::Cursor::get()
+    {
+        return events[events_at].entity;
+    }
+
+    unsigned LexicalRule::Cursor::getDepth() const
+    {
+        if (events[events_at].event != Events::Insert) //scope stays on the stack until its close is passed
+            return scopes.size() - 1;
+        return scopes.size();
+    }
+
+    const std::vector<unsigned>& LexicalRule::Cursor::getScopes() const
+    {
+        return scopes;
+    }
+
+    void LexicalRule::addParsePoint(const std::regex& reg,unsigned id,unsigned state,bool scoped)
+    {
+        entry_points.emplace_back(reg,id,state,scoped);
+        config.add(1).add(id).add(state).add(scoped);
+        if (state == States::pop || state == States::silentpop || state == States::toggle)
+            terminators[id].regex = true;
+    }
+    void LexicalRule::addParsePoint(const std::string& key,unsigned id,unsigned mode,unsigned state,bool scoped)
+    {
+        keyword_points.add(key,WordPoint(id,state,getBoundary(mode),key.size(),scoped));
+        config.add(2).add(key).add(id).add(mode).add(state).add(scoped);
+        if (state == States::pop || state == States::silentpop || state == States::toggle)
+            terminators[id].words.emplace_back(key,WordPoint(id,state,getBoundary(mode),key.size(),scoped));
+    }
+    void LexicalRule::addParsePattern(const std::string& pattern,unsigned id,unsigned state,bool scoped)
+    {
+        entry_points.emplace_back(std::regex(pattern),id,state,scoped,pattern);
+        config.add(3).add(pattern).add(id).add(state).add(scoped);
+        if (state == States::pop || state == States::silentpop || state == States::toggle)
+            terminators[id].regex = true;
+    }
+    void LexicalRule::setTokenCreator(const std::function<std::unique_ptr<Token>(const std::string&,unsigned)>& f)
+    {
+        creator = f;
+    }
+
+    bool LexicalRule::hasTokenCreator() const
+    {
+        return static_cast<bool>(creator);
+    }
+
+    const std::function<std::unique_ptr<Token>(const std::string&,unsigned)>& LexicalRule::getTokenCreator() const
+    {
+        return creator;
+    }
+
+    void LexicalRule::setInterned(unsigned id,bool v)
+    {
+        if (interned.size() <= id)
+            interned.resize(id + 1,false);
+        interned[id] = v;
+        config.add(4).add(id).add(v);
+    }
+
+    bool LexicalRule::isInterned(unsigned id) const
+    {
+        return id < interned.size() && interned[id];
+    }
+
+    void LexicalRule::setUtf8Validation(bool v)
+    {
+        utf8 = v;
+    }
+
+    bool LexicalRule::hasUtf8Validation() const
+    {
+        return utf8;
+    }
+
+    void LexicalRule::setBlockSkipping(bool v)
+    {
+        skipping = v;
+    }
+
+    bool LexicalRule::hasBlockSkipping() const
+    {
+        return skipping;
+    }
+
+    void LexicalRule::setLongestMatch(bool v)
+    {
+        longest = v;
+    }
+
+    bool LexicalRule::hasLongestMatch() const
+    {
+        return longest;
+    }
+
+    std::uint64_t LexicalRule::fingerprint() const
+    {
+        return Fingerprint(Rule::fingerprint()).add(config.get()).add(utf8).add(skipping).add(longest).add(static_cast<bool>(creator)).get();
+    }
+
+    //raw keyword matches of all chained rules, by position in outermost source
+    class LexicalChain::Walker
+    {
+    private:
+        typedef Scratch::Entry Entry;
+
+        const LexicalRule::WordsTrie& keywords;
+        const std::string& root;
+        std::vector<Entry>& entries; //sorted by position, ones before dead are released
+        std::vector<const LexicalRule::WordPoint*>& hits;
+        std::vector<const LexicalRule::WordPoint*>& found;
+        std::size_t dead;
+
+        void walk(Position start,std::vector<const LexicalRule::WordPoint*>& out) const
+        {
+            const LexicalRule::WordsTrieNode* node = &keywords.getRoot();
+            Position i = start;
+            while (i < root.size())
+            {
+                node = node -> step(root[i]);
+                ++i;
+                if (node == nullptr)
+                    return;
+                if (node -> value)
+                {
+                    for (const auto& v: *(node -> value))
+                        out.push_back(&v);
+                }
+            }
+        }
+    public:
+        //whether text is a copy of root from offset on, so that walks of root hold for it
+        bool covers(const std::string& text,Position offset) const
+        {
+            if (&text == &root)
+                return offset == 0;
+            return offset <= root.size() && root.size() - offset >= text.size() && root.compare(offset,text.size(),text) == 0;
+        }
+
+        //boundaries are left to caller, as they depend on the text it scans
+        void at(Position pos,const LexicalRule::WordPoint* const*& begin,const LexicalRule::WordPoint* const*& end)
+        {
+            if (entries.empty() || entries.back().pos < pos)
+            {
+                std::size_t first = hits.size();
+                walk(pos,hits);
+                entries.emplace_back(pos,first,hits.size());
+            }
+            else
+            {
+                auto it = std::lower_bound(entries.begin() + dead,entries.end(),pos,[](const Entry& e,Position p)
+                {
+                    return e.pos < p;
+                });
+                if (it == entries.end() || it -> pos != pos)
+                {
+                    //skipped by outer rule, only inner ones ask for it
+                    found.clear();
+                    walk(pos,found);
+                    begin = found.data();
+                    end = begin + found.size();
+                    return;
+                }
+                begin = hits.data() + it -> first;
+                end = hits.data() + it -> last;
+                return;
+            }
+            begin = hits.data() + entries.back().first;
+            end = hits.data() + entries.back().last;
+        }
+
+        //positions before pos are not asked for any more
+        void release(Position pos)
+        {
+            while (dead < entries.size() && entries[dead].pos < pos)
+                ++dead;
+            if (dead > 64 && dead * 2 > entries.size())
+            {
+                std::size_t cut = dead < entries.size() ? entries[dead].first : hits.size();
+                hits.erase(hits.begin(),hits.begin() + cut);
+                entries.erase(entries.begin(),entries.begin() + dead);
+                for (auto& e: entries)
+                {
+                    e.first -= cut;
+                    e.last -= cut;
+                }
+                dead = 0;
+            }
+        }
+
+        Walker(const LexicalRule::WordsTrie& k,const std::string& r,Scratch& s): keywords(k), root(r), entries(s.entries), hits(s.hits), found(s.found), dead(0)
+        {
+            entries.clear();
+            hits.clear();
+        }
+    };
+
+    //takes keywords of its rule from shared walks instead of walking the trie of the rule
+    class LexicalChain::Scanner: public LexicalRule::Scanner
+    {
+    private:
+        Walker& walker;
+        unsigned level;
+        Position offset; //of source in walked text
+
+        virtual void walk(Position start) override
+        {
+            const LexicalRule::WordPoint* const* i;
+            const LexicalRule::WordPoint* const* end;
+            walker.at(offset + start,i,end);
+            for (; i != end; ++i)
+            {
+                const LexicalRule::WordPoint& v = **i;
+                //walked text goes on past end of source
+                if (v.rule != level || v.size > source.size() - start)
+                    continue;
+                if (start >= 1 && v.boundary -> contains(source[start - 1]))
+                    continue;
+                if (start + v.size < source.size() && v.boundary -> contains(source[start + v.size]))
+                    continue;
+                words.emplace_back(start,v.state,v.id,v.size,v.scoped);
+            }
+        }
+    public:
+        Scanner(const LexicalRule& r,const std::string& s,Walker& w,unsigned l,Position o,LexicalRule::Scratch* sc): LexicalRule::Scanner(r,s,sc), walker(w), level(l), offset(o) {};
+    };
+
+    class LexicalChain::Builder: public LexicalRule::Sink
+    {
+    private:
+        const LexicalChain& chain;
+        Walker& walker;
+        unsigned level;
+        Position offset,base; //of source in walked text and of its tokens
+        Diagnostics* diagnostics;
+        TokenizeContext* context;
+        std::vector<TokenEntity>& top;
+        std::vector<std::vector<TokenEntity>*> stack;
+
+        std::vector<TokenEntity>& current()
+        {
+            return stack.size() ? *stack.back() : top;
+        }
+
+        //raw text at top level goes to next rule in place, where it would be found when applied after this one
+        bool forward(std::unique_ptr<Token>& token)
+        {
+            Position at = offset + (token -> getPos() - base);
+            walker.release(at);
+            unsigned next = chain.next(level + 1);
+            if (next == chain.rules.size() || token -> getType() != typeid(StringToken) || token -> forceAs<StringToken>().str.empty())
+                return false;
+            std::unique_ptr<Token> keep(std::move(token));
+            chain.run(next,keep -> forceAs<StringToken>(),at,walker,top,diagnostics,context);
+            return true;
+        }
+    public:
+        virtual void insert(std::unique_ptr<Token>&& token,unsigned id) override
+        {
+            if (stack.empty() && id == 0 && forward(token))
+                return;
+            walker.release(offset + (token -> getPos() - base));
+            current().emplace_back(std::move(token),id);
+        }
+        virtual void open(std::unique_ptr<Token>&& token,unsigned id) override
+        {
+            walker.release(offset + (token -> getPos() - base));
+            std::vector<TokenEntity>* children = &token -> as<ScopeToken>() -> tokens.edit();
+            current().emplace_back(std::move(token),id);
+            stack.push_back(children);
+        }
+        virtual void close() override
+        {
+            stack.pop_back();
+        }
+        virtual void tail(std::unique_ptr<Token>&& token) override
+        {
+            if (!forward(token))
+                top.emplace_back(std::move(token),0);
+        }
+
+        Builder(const LexicalChain& c,Walker& w,unsigned l,Position o,Position b,std::vector<TokenEntity>& t,Diagnostics* d,TokenizeContext* ctx): chain(c), walker(w), level(l), offset(o), base(b), diagnostics(d), context(ctx), top(t) {};
+    };
+
+    LexicalChain::LexicalChain(const std::vector<const LexicalRule*>& r): rules(r)
+    {
+        std::string key;
+        for (unsigned i=0; i < rules.size(); ++i)
+            copyKeywords(rules[i] -> keyword_points.getRoot(),key,i,keywords);
+    }
+
+    void LexicalChain::copyKeywords(const LexicalRule::WordsTrieNode& node,std::string& key,unsigned rule,LexicalRule::WordsTrie& out)
+    {
+        if (node.value)
+        {
+            for (const auto& v: *node.value)
+                out.add(key,LexicalRule::WordPoint(v.id,v.state,v.boundary,v.size,v.scoped,rule));
+        }
+        for (unsigned c=0; c < 256; ++c)
+        {
+            if (node.nodes[c])
+            {
+                key.push_back(static_cast<char>(c));
+                copyKeywords(*node.nodes[c],key,rule,out);
+                key.pop_back();
+            }
+        }
+    }
+
+    unsigned LexicalChain::next(unsigned level) const
+    {
+        while (level < rules.size() && !rules[level] -> creator)
+            ++level;
+        return level;
+    }
+
+    const std::vector<const LexicalRule*>& LexicalChain::getRules() const
+    {
+        return rules;
+    }
+
+    void LexicalChain::run(unsigned level,const StringToken& source,Position offset,Walker& walker,std::vector<TokenEntity>& out,Diagnostics* diagnostics,TokenizeContext* context) const
+    {
+        const LexicalRule& rule = *rules[level];
+        //rules of the chain run nested, so each has buffers of its own
+        LexicalRule::Scratch* scratch = context != nullptr ? &context -> getLexer(level) : nullptr;
+        std::unique_ptr<LexicalRule::PointSource> points;
+        //token creator may have changed text, then it is scanned on its own
+        if (rule.longest || !walker.covers(source.str,offset))
+            points = rule.scan(source.str,scratch);
+        else
+            points.reset(new Scanner(rule,source.str,walker,level,offset,scratch));
+        LexicalRule::Machine machine(rule,source.str,source.getPos(),*points,diagnostics,scratch,context != nullptr ? context -> getSymbols() : nullptr);
+        Builder builder(*this,walker,level,offset,source.getPos(),out,diagnostics,context);
+        while (machine.step(builder));
+    }
+
+    void LexicalChain::apply(std::vector<TokenEntity>& source) const
+    {
+        lex(source,nullptr,nullptr);
+    }
+
+    void LexicalChain::apply(std::vector<TokenEntity>& source,Diagnostics& diagnostics) const
+    {
+        lex(source,&diagnostics,nullptr);
+    }
+
+    void LexicalChain::apply(std::vector<TokenEntity>& source,TokenizeContext& context) const
+    {
+        lex(source,context.getDiagnostics(),&context);
+    }
+
+    void LexicalChain::lex(std::vector<TokenEntity>& source,Diagnostics* diagnostics,TokenizeContext* context) const
+    {
+        unsigned first = next(0);
+        if (first == rules.size())
+            return;
+        Scratch local;
+        Scratch& walks = context != nullptr ? context -> getChain() : local;
+        std::vector<TokenEntity> ret;
+        std::vector<std::pair<unsigned,unsigned>> moved;
+        LexicalRule::Scratch* scratch = context != nullptr ? &context -> getLexer() : nullptr;
+        if (scratch != nullptr)
+        {
+            ret.swap(scratch -> tokens);
+            moved.swap(scratch -> moved);
+        }
+        ret.reserve(source.size());
+        unsigned i = 0;
+        try
+        {
+            for (; i < source.size(); ++i)
+            {
+                if (source[i].token -> getType() == typeid(StringToken) && source[i].type == 0 && source[i].token -> forceAs<StringToken>().str.size())
+                {
+                    const StringToken& src = source[i].token -> forceAs<StringToken>();
+                    Walker walker(keywords,src.str,walks);
+                    run(first,src,0,walker,ret,diagnostics,context);
+                }
+                else
+                {
+                    moved.emplace_back(i,ret.size());
+                    ret.emplace_back(std::move(source[i]));
+                }
+            }
+        }
+        catch (...)
+        {
+            //leave source as it was, also for rules that came before the one that failed
+            for (const auto& m: moved)
+                source[m.first] = std::move(ret[m.second]);
+            if (scratch != nullptr)
+            {
+                ret.clear();
+                moved.clear();
+                ret.swap(scratch -> tokens);
+                moved.swap(scratch -> moved);
+            }
+            throw;
+        }
+        source.swap(ret);
+        if (scratch != nullptr)
+        {
+            ret.clear();
+            moved.clear();
+            ret.swap(scratch -> tokens);
+            moved.swap(scratch -> moved);
+        }
+    }
+
+    void ComplexRule::apply(std::vector<TokenEntity>& source) const
+    {
+        if (!func)
+            return;
+        if (deep)
+            postOrder(source,func);
+        else
+            func(source);
+    }
+
+    MergingLayer::TypesTrieNode* MergingLayer::TypesTrieNode::step(unsigned k) const
+    {
+        if (k >= 256)
+            return nullptr;
+        return nodes[k];
+    }
+
+    void MergingLayer::TypesTrieNode::set(unsigned k,MergingLayer::TypesTrieNode* val)
+    {
+        if (k < 256)
+            nodes[k] = val;
+    }
+
+    const MergingLayer::TypesTrieNode* MergingLayer::TypesTrie::getRoot() const
+    {
+        return &root;
+    }
+
+    MergingLayer::TypesTrieNode* MergingLayer::TypesTrie::getRoot()
+    {
+        return &root;
+    }
+
+    unsigned MergingLayer::TypesTrie::size() const
+    {
+        return count;
+    }
+
+    MergingLayer::TypesTrieNode* MergingLayer::TypesTrie::create()
+    {
+        MergingLayer::TypesTrieNode* t = new MergingLayer::TypesTrieNode();
+        t -> id = count++;
+        nodes.emplace(t);
+        return t;
+    }
+
+    MergingLayer::TypesTrieNode* MergingLayer::TypesTrie::add(const std::vector<unsigned>& path,int value)
+    {
+        return append(getRoot(),path,value);
+    }
+
+    MergingLayer::TypesTrieNode* MergingLayer::TypesTrie::append(MergingLayer::TypesTrieNode* target,const std::vector<unsigned>& path,int value)
+    {
+        for (auto i:path)
+            if (i >= 256)
+                return nullptr;
+        MergingLayer::TypesTrieNode *c = target,*n = target;
+        for (auto i:path)
+        {
+            n = c -> step(i);
+            if (n == nullptr)
+            {
+                MergingLayer::TypesTrieNode* t = create();
+                c -> set(i,t);
+                c = t;
+            }
+            else
+            {
+                c = n;
+            }
+        }
+        c -> value = value;
+        return c;
+    }
+
+    void MergingLayer::TypesTrie::connect(const std::vector<unsigned>& path,MergingLayer::TypesTrieNode* target)
+    {
+        connect(getRoot(),path,target);
+    }
+
+    void MergingLayer::TypesTrie::connect(MergingLayer::TypesTrieNode* start,const std::vector<unsigned>& path,MergingLayer::TypesTrieNode* target)
+    {
+        for (auto i:path)
+            if (i >= 256)
+                return;
+        MergingLayer::TypesTrieNode *c = start,*n = start;
+        unsigned i=0;
+        for (; i+1<path.size(); ++i)
+        {
+            n = c -> step(path[i]);
+            if (n == nullptr)
+            {
+                MergingLayer::TypesTrieNode* t = create();
+                c -> set(path[i],t);
+                c = t;
+            }
+            else
+            {
+                c = n;
+            }
+        }
+        c -> set(path[i],target);
+    }
+
+
+    MergingLayer::TypesTrieNode& MergingLayer::TypesTrieNode::operator = (MergingLayer::TypesTrieNode&& t) noexcept
+    {
+        refs = t.refs;
+        value = t.value;
+        id = t.id;
+        for (unsigned i=0; i<256; ++i)
+        {
+            nodes[i] = t.nodes[i];
+            t.nodes[i] = nullptr;
+        }
+        return *this;
+    }
+
+    MergingLayer::TypesTrie::TypesTrie(MergingLayer::TypesTrie&& t) noexcept
+    {
+        nodes = std::move(t.nodes);
+        t.nodes.clear();
+        root = std::move(t.root);
+        count = t.count;
+    }
+
+    MergingLayer::TypesTrie::~TypesTrie()
+    {
+        for (auto i:nodes)
+        {
+            delete i;
+        }
+    }
+
+    static void addPath(Fingerprint& f,const std::vector<unsigned>& path)
+    {
+        f.add(path.size());
+        for (auto i: path)
+            f.add(i);
+    }
+
+    //nodes are told apart by their place in trie, and by value for those made outside of it
+    static void addNode(Fingerprint& f,const MergingLayer::TypesTrieNode* node)
+    {
+        f.add(node -> id).add(static_cast<std::uint64_t>(node -> value));
+    }
+
+    static void addPattern(Fingerprint& f,const MergingLayer::TypePattern& pattern)
+    {
+        f.add(pattern.kind).add(pattern.type).add(pattern.min).add(pattern.max).add(pattern.items.size());
+        for (const auto& i: pattern.items)
+            addPattern(f,i);
+    }
+
+    MergingLayer::TypesTrieNode* MergingLayer::addTypePath(const std::vector<unsigned>& path,int v)
+    {
+        compiled = false;
+        config.add(0).add(static_cast<std::uint64_t>(v));
+        addPath(config,path);
+        return type_points.add(path,v);
+    }
+
+    MergingLayer::TypesTrieNode* MergingLayer::appendTypePath(MergingLayer::TypesTrieNode* target,const std::vector<unsigned>& path,int v)
+    {
+        compiled = false;
+        config.add(1).add(static_cast<std::uint64_t>(v));
+        addNode(config,target);
+        addPath(config,path);
+        return type_points.append(target,path,v);
+    }
+
+    void MergingLayer::connectTypePath(const std::vector<unsigned>& path,MergingLayer::TypesTrieNode* node)
+    {
+        compiled = false;
+        config.add(2);
+        addPath(config,path);
+        addNode(config,node);
+        type_points.connect(path,node);
+    }
+
+    void MergingLayer::connectTypePath(MergingLayer::TypesTrieNode* start,const std::vector<unsigned>& path,MergingLayer::TypesTrieNode* node)
+    {
+        compiled = false;
+        config.add(3);
+        addNode(config,start);
+        addPath(config,path);
+        addNode(config,node);
+        type_points.connect(start,path,node);
+    }
+
+    void MergingLayer::addTypePattern(const MergingLayer::TypePattern& pattern,int v)
+    {
+        compiled = false;
+        config.add(4).add(static_cast<std::uint64_t>(v));
+        addPattern(config,pattern);
+        patterns.emplace_back(pattern,v);
+    }
+
+    std::uint64_t MergingLayer::fingerprint() const
+    {
+        return config.get();
+    }
+
+
+    const unsigned MergingLayer::TypesTrieNode::npos;
+    const unsigned MergingLayer::TypePattern::many;
+    const std::size_t MergingLayer::memo_after;
+    const std::size_t LayeredMergingRule::split_after;
+
+    MergingLayer::TypePattern MergingLayer::TypePattern::of(unsigned t)
+    {
+        if (t >= 256)
+            throw std::logic_error("TypePattern exception: type " + std::to_string(t) + " out of range");
+        TypePattern ret;
+        ret.type = t;
+        return ret;
+    }
+
+    MergingLayer::TypePattern MergingLayer::TypePattern::path(const std::vector<unsigned>& types)
+    {
+        std::vector<TypePattern> items;
+        for (auto i: types)
+            items.push_back(of(i));
+        return sequence(items);
+    }
+
+    MergingLayer::TypePattern MergingLayer::TypePattern::sequence(const std::vector<MergingLayer::TypePattern>& items)
+    {
+        TypePattern ret;
+        ret.kind = Sequence;
+        ret.items = items;
+        return ret;
+    }
+
+    MergingLayer::TypePattern MergingLayer::TypePattern::either(const std::vector<MergingLayer::TypePattern>& items)
+    {
+        TypePattern ret;
+        ret.kind = Either;
+        ret.items = items;
+        return ret;
+    }
+
+    MergingLayer::TypePattern MergingLayer::TypePattern::repeat(const MergingLayer::TypePattern& p,unsigned min,unsigned max)
+    {
+        if (min > max)
+            throw std::logic_error("TypePattern exception: repetition with minimum above maximum");
+        TypePattern ret;
+        ret.kind = Repeat;
+        ret.min = min;
+        ret.max = max;
+        ret.items.push_back(p);
+        return ret;
+    }
+
+    static void skipSpaces(const std::string& text,std::size_t& pos)
+    {
+        while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos])))
+            ++pos;
+    }
+
+    static unsigned parseNumber(const std::string& text,std::size_t& pos)
+    {
+        skipSpaces(text,pos);
+        if (pos == text.size() || !std::isdigit(static_cast<unsigned char>(text[pos])))
+            throw std::logic_error("TypePattern exception: expected number at " + std::to_string(pos));
+        unsigned ret = 0;
+        for (; pos < text.size() && std::isdigit(static_cast<unsigned char>(text[pos])); ++pos)
+        {
+            ret = ret * 10 + (text[pos] - '0');
+            if (ret >= (1u << 16))
+                throw std::logic_error("TypePattern exception: number too large at " + std::to_string(pos));
+        }
+        return ret;
+    }
+
+    static MergingLayer::TypePattern parseEither(const std::string& text,std::size_t& pos);
+
+    static MergingLayer::TypePattern parseAtom(const std::string& text,std::size_t& pos)
+    {
+        skipSpaces(text,pos);
+        MergingLayer::TypePattern ret;
+        if (pos < text.size() && text[pos] == '(')
+        {
+            ++pos;
+            ret = parseEither(text,pos);
+            skipSpaces(text,pos);
+            if (pos == text.size() || text[pos] != ')')
+                throw std::logic_error("TypePattern exception: expected ) at " + std::to_string(pos));
+            ++pos;
+        }
+        else
+        {
+            ret = MergingLayer::TypePattern::of(parseNumber(text,pos));
+        }
+        for (skipSpaces(text,pos); pos < text.size(); skipSpaces(text,pos))
+        {
+            char c = text[pos];
+            if (c == '*')
+                ret = MergingLayer::TypePattern::repeat(ret,0);
+            else if (c == '+')
+                ret = MergingLayer::TypePattern::repeat(ret,1);
+            else if (c == '?')
+                ret = MergingLayer::TypePattern::repeat(ret,0,1);
+            else if (c != '{')
+                break;
+            ++pos;
+            if (c != '{')
+                continue;
+            unsigned min = parseNumber(text,pos),max = min;
+            skipSpaces(text,pos);
+            if (pos < text.size() && text[pos] == ',')
+            {
+                ++pos;
+                skipSpaces(text,pos);
+                max = (pos < text.size() && text[pos] == '}') ? MergingLayer::TypePattern::many : parseNumber(text,pos);
+                skipSpaces(text,pos);
+            }
+            if (pos == text.size() || text[pos] != '}')
+                throw std::logic_error("TypePattern exception: expected } at " + std::to_string(pos));
+            ++pos;
+            ret = MergingLayer::TypePattern::repeat(ret,min,max);
+        }
+        return ret;
+    }
+
+    static MergingLayer::TypePattern parseSequence(const std::string& text,std::size_t& pos)
+    {
+        std::vector<MergingLayer::TypePattern> items;
+        for (skipSpaces(text,pos); pos < text.size() && text[pos] != '|' && text[pos] != ')'; skipSpaces(text,pos))
+            items.push_back(parseAtom(text,pos));
+        if (items.size() == 1)
+            return items.back();
+        return MergingLayer::TypePattern::sequence(items);
+    }
+
+    static MergingLayer::TypePattern parseEither(const std::string& text,std::size_t& pos)
+    {
+        std::vector<MergingLayer::TypePattern> items;
+        items.push_back(parseSequence(text,pos));
+        while (pos < text.size() && text[pos] == '|')
+        {
+            ++pos;
+            items.push_back(parseSequence(text,pos));
+        }
+        if (items.size() == 1)
+            return items.back();
+        return MergingLayer::TypePattern::either(items);
+    }
+
+    MergingLayer::TypePattern MergingLayer::TypePattern::parse(const std::string& text)
+    {
+        std::size_t pos = 0;
+        TypePattern ret = parseEither(text,pos);
+        if (pos != text.size())
+            throw std::logic_error("TypePattern exception: unexpected " + std::string(1,text[pos]) + " at " + std::to_string(pos));
+        return ret;
+    }
+
+    //patterns expanded into states joined by types and empty edges
+    struct MergingLayer::Nfa
+    {
+        static const std::size_t limit = 1 << 16;
+
+        struct State
+        {
+            std::vector<std::pair<unsigned,unsigned>> edges; //type and target
+            std::vector<unsigned> empty;
+            int value;
+            State(): value(-1) {};
+        };
+        std::vector<State> states;
+
+        unsigned create()
+        {
+            if (states.size() >= limit)
+                throw std::logic_error("TypePattern exception: pattern too large");
+            states.emplace_back();
+            return states.size() - 1;
+        }
+
+        //adds states matching p from start, returns state it ends in
+        unsigned add(const TypePattern& p,unsigned start)
+        {
+            unsigned end = start;
+            switch (p.kind)
+            {
+            case TypePattern::Type:
+                end = create();
+                states[start].edges.emplace_back(p.type,end);
+                break;
+            case TypePattern::Sequence:
+                for (const auto& i: p.items)
+                    end = add(i,end);
+                break;
+            case TypePattern::Either:
+                end = create();
+                for (const auto& i: p.items)
+                {
+                    unsigned s = create();
+                    states[start].empty.push_back(s);
+                    states[add(i,s)].empty.push_back(end);
+                }
+                break;
+            case TypePattern::Repeat:
+                if (p.items.size() != 1 || p.min > p.max)
+                    throw std::logic_error("TypePattern exception: invalid repetition");
+                for (unsigned i=0; i<p.min; ++i)
+                    end = add(p.items[0],end);
+                if (p.max == TypePattern::many)
+                {
+                    //loop through single state, which is also the exit
+                    unsigned s = create();
+                    states[end].empty.push_back(s);
+                    states[add(p.items[0],s)].empty.push_back(s);
+                    end = s;
+                }
+                else if (p.max > p.min)
+                {
+                    unsigned e = create();
+                    states[end].empty.push_back(e);
+                    for (unsigned i=p.min; i<p.max; ++i)
+                    {
+                        end = add(p.items[0],end);
+                        states[end].empty.push_back(e);
+                    }
+                    end = e;
+                }
+                break;
+            default:
+                throw std::logic_error("TypePattern exception: invalid kind");
+            }
+            return end;
+        }
+    };
+
+    void MergingLayer::build(MergingLayer::TypesTrie& out) const
+    {
+        //number nodes of paths, including ones they were connected to
+        std::vector<const TypesTrieNode*> graph;
+        std::map<const TypesTrieNode*,unsigned> ids;
+        graph.push_back(type_points.getRoot());
+        ids[graph.back()] = 0;
+        for (std::size_t i=0; i<graph.size(); ++i)
+        {
+            for (unsigned t=0; t<256; ++t)
+            {
+                const TypesTrieNode* n = graph[i] -> step(t);
+                if (n != nullptr && ids.emplace(n,graph.size()).second)
+                    graph.push_back(n);
+            }
+        }
+        const unsigned base = graph.size();
+
+        Nfa nfa;
+        std::vector<unsigned> start;
+        start.push_back(0);
+        for (const auto& i: patterns)
+        {
+            unsigned s = nfa.create();
+            nfa.states[nfa.add(i.first,s)].value = i.second;
+            start.push_back(base + s);
+        }
+
+        //subset construction, states are sorted sets of graph nodes and pattern states
+        auto closure = [&nfa,base](std::vector<unsigned>& set)
+        {
+            std::vector<unsigned> stack(set.begin(),set.end());
+            while (!stack.empty())
+            {
+                unsigned s = stack.back();
+                stack.pop_back();
+                if (s < base)
+                    continue;
+                for (auto e: nfa.states[s - base].empty)
+                {
+                    if (std::find(set.begin(),set.end(),e + base) == set.end())
+                    {
+                        set.push_back(e + base);
+                        stack.push_back(e + base);
+                    }
+                }
+            }
+            std::sort(set.begin(),set.end());
+            set.erase(std::unique(set.begin(),set.end()),set.end());
+        };
+
+        std::map<std::vector<unsigned>,TypesTrieNode*> known;
+        std::vector<std::pair<std::vector<unsigned>,TypesTrieNode*>> pending;
+        closure(start);
+        known[start] = out.getRoot();
+        pending.emplace_back(start,out.getRoot());
+
+        std::vector<std::vector<unsigned>> moves(256);
+        std::vector<unsigned> used;
+        while (!pending.empty())
+        {
+            std::vector<unsigned> set = std::move(pending.back().first);
+            TypesTrieNode* node = pending.back().second;
+            pending.pop_back();
+
+            //value of earliest member, so paths win over patterns and patterns keep their order
+            for (auto s: set)
+            {
+                int v = s < base ? graph[s] -> value : nfa.states[s - base].value;
+                if (v != -1)
+                {
+                    node -> value = v;
+                    break;
+                }
+            }
+
+            used.clear();
+            for (auto s: set)
+            {
+                if (s < base)
+                {
+                    for (unsigned t=0; t<256; ++t)
+                    {
+                        const TypesTrieNode* n = graph[s] -> step(t);
+                        if (n == nullptr)
+                            continue;
+                        if (moves[t].empty())
+                            used.push_back(t);
+                        moves[t].push_back(ids[n]);
+                    }
+                }
+                else
+                {
+                    for (const auto& e: nfa.states[s - base].edges)
+                    {
+                        if (moves[e.first].empty())
+                            used.push_back(e.first);
+                        moves[e.first].push_back(e.second + base);
+                    }
+                }
+            }
+            for (auto t: used)
+            {
+                closure(moves[t]);
+                auto it = known.find(moves[t]);
+                if (it == known.end())
+                {
+                    if (known.size() >= Nfa::limit)
+                        throw std::logic_error("TypePattern exception: automaton too large");
+                    it = known.emplace(moves[t],out.create()).first;
+                    pending.emplace_back(moves[t],it -> second);
+                }
+                node -> set(t,it -> second);
+                moves[t].clear();
+            }
+        }
+    }
+
+    void MergingLayer::compile()
+    {
+        if (patterns.empty())
+        {
+            automaton.reset();
+        }
+        else
+        {
+            std::unique_ptr<TypesTrie> tmp(new TypesTrie());
+            build(*tmp);
+            automaton = std::move(tmp);
+        }
+        compiled = true;
     }
 
-    void LayeredMergingRule::apply(std::vector<TokenEntity>& source) const
+    bool MergingLayer::isCompiled() const
     {
-        if (merger)
+        return compiled;
+    }
+
+    bool MergingLayer::stopsAt(std::vector<bool>& ends) const
+    {
+        std::unique_ptr<TypesTrie> local;
+        const TypesTrieNode* root = type_points.getRoot();
+        if (!patterns.empty())
         {
-            if (deep)
+            if (!compiled)
+            {
+                local.reset(new TypesTrie());
+                build(*local);
+            }
+            root = local ? local -> getRoot() : automaton -> getRoot();
+        }
+
+        std::vector<unsigned> found;
+        std::unordered_set<const TypesTrieNode*> seen;
+        std::vector<const TypesTrieNode*> stack(1,root);
+        seen.insert(root);
+        while (!stack.empty())
+        {
+            const TypesTrieNode* node = stack.back();
+            stack.pop_back();
+            for (unsigned k=0; k<256; ++k)
             {
-                for (auto& i: source)
+                const TypesTrieNode* next = node -> nodes[k];
+                if (next == nullptr)
+                    continue;
+                if (k < ends.size() && ends[k])
                 {
-                    ScopeToken* sc = i.token -> as<ScopeToken>();
-                    if (sc != nullptr)
+                    for (auto i: next -> nodes)
                     {
-                        apply(sc -> tokens);
+                        if (i != nullptr)
+                            return false;
                     }
+                    if (next -> value != -1)
+                        found.push_back(next -> value);
+                }
+                if (seen.insert(next).second)
+                    stack.push_back(next);
+            }
+        }
+        for (auto i: found)
+        {
+            if (ends.size() <= i)
+                ends.resize(i + 1,false);
+            ends[i] = true;
+        }
+        return true;
+    }
+
+    std::vector<MergingLayer::TypePoint> MergingLayer::apply(const std::vector<MergingLayer::TypePoint>& in) const
+    {
+        std::vector<MergingLayer::TypePoint> ret;
+        Scratch scratch;
+        apply(in,ret,scratch);
+        return std::move(ret);
+    }
+
+    void MergingLayer::apply(const std::vector<MergingLayer::TypePoint>& in,std::vector<MergingLayer::TypePoint>& ret,MergingLayer::Scratch& scratch) const
+    {
+        ret.clear();
+        std::unique_ptr<TypesTrie> local;
+        const TypesTrieNode* root = type_points.getRoot();
+        if (!patterns.empty())
+        {
+            if (!compiled)
+            {
+                local.reset(new TypesTrie());
+                build(*local);
+            }
+            root = local ? local -> getRoot() : automaton -> getRoot();
+        }
+
+        //pairs of position and node a walk passed without reaching a value afterwards,
+        //automaton is deterministic so later walks through them can stop right away
+        scratch.failed.clear();
+        scratch.visited.clear();
+
+        for (std::size_t at=0; at<in.size();)
+        {
+            const TypesTrieNode* node = root;
+            std::size_t best = 0;
+            int value = -1;
+            for (std::size_t i=at; i<in.size(); ++i)
+            {
+                node = node -> step(in[i].type);
+                if (node == nullptr)
+                    break;
+                if (node -> value != -1)
+                {
+                    best = i - at + 1;
+                    value = node -> value;
+                    scratch.visited.clear();
+                }
+                if (i + 1 - at >= memo_after && node -> id != TypesTrieNode::npos)
+                {
+                    std::uint64_t key = (static_cast<std::uint64_t>(i + 1) << 32) | node -> id;
+                    if (scratch.failed.count(key))
+                        break;
+                    scratch.visited.push_back(key);
                 }
             }
+            scratch.failed.insert(scratch.visited.begin(),scratch.visited.end());
+            scratch.visited.clear();
+
+            if (best)
+            {
+                ret.emplace_back(in[at].begin,in[at + best - 1].end,value);
+                at += best;
+            }
+            else
+            {
+                ret.emplace_back(in[at++]);
+            }
+        }
+    }
+
+    bool LayeredMergingRule::hasTokenMerger() const
+    {
+        return static_cast<bool>(merger);
+    }
+
+    void LayeredMergingRule::setTokenMerger(const std::function<std::unique_ptr<Token>(std::size_t,std::size_t,unsigned,const std::vector<TokenEntity>&)>& f)
+    {
+        merger = f;
+    }
+
+    std::unique_ptr<Token> LayeredMergingRule::merge(std::size_t begin,std::size_t end,unsigned type,const std::vector<TokenEntity>& source) const
+    {
+        std::unique_ptr<Token> tmp = std::move(merger(begin,end,type,source));
+        tmp -> setPos(source[begin].token -> getPos());
+        return std::move(tmp);
+    }
 
-            std::vector<MergingLayer::TypePoint> types;
-            types.resize(source.size());
+    void LayeredMergingRule::compile()
+    {
+        split = false;
+        for (auto& i: layers)
+            i.compile();
+        if (barriers.empty())
+            return;
+        //tokens a list is cut after, as they are seen by each layer
+        std::vector<bool> ends = barriers;
+        for (const auto& i: layers)
+        {
+            if (!i.stopsAt(ends))
+                throw std::logic_error("LayeredMergingRule exception: type path goes on past a barrier");
+        }
+        split = true;
+    }
+
+    void LayeredMergingRule::addBarrier(unsigned type)
+    {
+        if (barriers.size() <= type)
+            barriers.resize(type + 1,false);
+        barriers[type] = true;
+        split = false;
+    }
+
+    std::uint64_t LayeredMergingRule::fingerprint() const
+    {
+        Fingerprint ret(Rule::fingerprint());
+        ret.add(deep).add(static_cast<bool>(merger)).add(layers.size());
+        for (const auto& i: layers)
+            ret.add(i.fingerprint());
+        for (std::size_t i=0; i<barriers.size(); ++i)
+        {
+            if (barriers[i])
+                ret.add(i);
+        }
+        return ret.get();
+    }
+
+    bool LayeredMergingRule::isBarrier(unsigned type) const
+    {
+        return type < barriers.size() && barriers[type];
+    }
+
+    void LayeredMergingRule::setThreads(unsigned n)
+    {
+        threads = n;
+    }
+
+    unsigned LayeredMergingRule::getThreads() const
+    {
+        return threads;
+    }
+
+    void LayeredMergingRule::apply(std::vector<TokenEntity>& source) const
+    {
+        Scratch scratch;
+        reduce(source,scratch);
+    }
 
-            //get types as TypePoint array
+    void LayeredMergingRule::apply(std::vector<TokenEntity>& source,TokenizeContext& context) const
+    {
+        if (context.getDiagnostics() == nullptr)
+        {
+            reduce(source,context.getMerger());
+            return;
+        }
+        try
+        {
+            reduce(source,context.getMerger());
+        }
+        catch (TokenizerException& e)
+        {
+            context.getDiagnostics() -> report(e.getPos(),e.what());
+        }
+    }
 
-            for (unsigned i=0; i<source.size(); ++i)
+    void LayeredMergingRule::reduce(std::vector<TokenEntity>& source,Scratch& scratch) const
+    {
+        if (merger)
+        {
+            if (deep)
+            {
+                postOrder(source,[this,&scratch](std::vector<TokenEntity>& list)
+                {
+                    reduceList(list,scratch);
+                });
+            }
+            else
             {
-                types[i] = MergingLayer::TypePoint(i,i+1,source[i].type);
+                reduceList(source,scratch);
             }
+        }
+    }
+
+    void LayeredMergingRule::mergeRange(const std::vector<TokenEntity>& source,std::size_t from,std::size_t to,Scratch& scratch) const
+    {
+        std::vector<MergingLayer::TypePoint>& types = scratch.types;
+
+        types.resize(to - from);
+
+        //get types as TypePoint array
+
+        for (std::size_t i=from; i<to; ++i)
+        {
+            types[i - from] = MergingLayer::TypePoint(i,i+1,source[i].type);
+        }
+
+        //pass through layers
+
+        for (const auto& i: layers)
+        {
+            i.apply(types,scratch.next,scratch.layer);
+            types.swap(scratch.next);
+        }
+
+        //tokens are made before source is touched, so that a throwing merger leaves it intact
+
+        scratch.merged.clear();
+        for (const auto& i: types)
+        {
+            if (i.begin + 1 != i.end)
+                scratch.merged.push_back(merge(i.begin,i.end,i.type,source));
+        }
+    }
 
-            //pass through layers
+    std::size_t LayeredMergingRule::place(std::vector<TokenEntity>& source,std::size_t at,Scratch& scratch)
+    {
+        //points are ordered and at never passes begin of current one, so entities are moved down in place
+        std::size_t merged = 0;
+        for (const auto& i: scratch.types)
+        {
+            if (i.begin + 1 != i.end)
+                source[at++] = TokenEntity(std::move(scratch.merged[merged++]),i.type);
+            else if (at != i.begin)
+                source[at++] = std::move(source[i.begin]);
+            else
+                ++at;
+        }
+        scratch.merged.clear();
+        return at;
+    }
 
+    void LayeredMergingRule::cut(const std::vector<TokenEntity>& source,std::vector<std::size_t>& ends) const
+    {
+        unsigned parts = threads ? threads : std::max(1u,std::thread::hardware_concurrency());
+        ends.clear();
+        if (parts > 1 && split && source.size() >= split_after)
+        {
             for (const auto& i: layers)
             {
-                types = std::move(i.apply(types));
+                if (!i.isCompiled()) //changed since rule was compiled
+                    parts = 1;
+            }
+        }
+        else
+        {
+            parts = 1;
+        }
+        for (unsigned p=1; p<parts; ++p)
+        {
+            std::size_t at = std::max(ends.empty() ? 0 : ends.back(),source.size() / parts * p);
+            while (at < source.size() && !isBarrier(source[at].type))
+                ++at;
+            if (at + 1 >= source.size())
+                break;
+            ends.push_back(at + 1);
+        }
+        ends.push_back(source.size());
+    }
+
+    void LayeredMergingRule::reduceList(std::vector<TokenEntity>& source,Scratch& scratch) const
+    {
+        std::vector<std::size_t> ends;
+        cut(source,ends);
+        if (ends.size() == 1)
+        {
+            mergeRange(source,0,source.size(),scratch);
+            source.resize(place(source,0,scratch));
+            return;
+        }
+
+        //first part on calling thread, no path crosses a cut so parts are merged as if they were whole lists
+        std::vector<Scratch> parts(ends.size() - 1);
+        std::vector<std::exception_ptr> errors(ends.size());
+        std::vector<std::thread> workers;
+        for (std::size_t p=1; p<ends.size(); ++p)
+        {
+            workers.emplace_back([this,&source,&ends,&parts,&errors,p]()
+            {
+                try
+                {
+                    mergeRange(source,ends[p - 1],ends[p],parts[p - 1]);
+                }
+                catch (...)
+                {
+                    errors[p] = std::current_exception();
+                }
+            });
+        }
+        try
+        {
+            mergeRange(source,0,ends[0],scratch);
+        }
+        catch (...)
+        {
+            errors[0] = std::current_exception();
+        }
+        for (auto& i: workers)
+            i.join();
+        for (const auto& i: errors)
+        {
+            if (i)
+                std::rethrow_exception(i);
+        }
+
+        std::size_t at = place(source,0,scratch);
+        for (auto& i: parts)
+            at = place(source,at,i);
+        source.resize(at);
+    }
+
+    MergingLayer::Stream::Stream(const MergingLayer& l): layer(&l), automaton(&l.type_points), at(0), dropped(0)
+    {
+        if (!l.patterns.empty())
+        {
+            if (l.compiled)
+            {
+                automaton = l.automaton.get();
+            }
+            else
+            {
+                local.reset(new TypesTrie());
+                l.build(*local);
+                automaton = local.get();
             }
+        }
+        restart();
+    }
+
+    void MergingLayer::Stream::restart()
+    {
+        node = automaton -> getRoot();
+        reached = at;
+        best = 0;
+        value = -1;
+        stopped = false;
+    }
 
-            //merge on array difference
+    void MergingLayer::Stream::push(const MergingLayer::TypePoint& p)
+    {
+        buffer.push_back(p);
+    }
 
-            unsigned offset = 0;
+    bool MergingLayer::Stream::pop(MergingLayer::TypePoint& out,bool finished)
+    {
+        if (at == buffer.size())
+            return false;
 
-            for (const auto& i:types)
+        //longest path starting at front of the buffer, continued from where last call stopped
+        for (; !stopped && reached < buffer.size(); ++reached)
+        {
+            node = node -> step(buffer[reached].type);
+            if (node == nullptr)
+            {
+                stopped = true;
+                break;
+            }
+            if (node -> value != -1)
+            {
+                best = reached - at + 1;
+                value = node -> value;
+                memo.visited.clear();
+            }
+            if (reached + 1 - at >= memo_after && node -> id != TypesTrieNode::npos)
             {
-                if (i.begin + 1 != i.end)
+                std::uint64_t key = (static_cast<std::uint64_t>(dropped + reached + 1) << 32) | node -> id;
+                if (memo.failed.count(key))
                 {
-                    //merge
-                    std::unique_ptr<Token> tmp = merge(i.begin - offset,i.end - offset,i.type,source);
+                    stopped = true;
+                    break;
+                }
+                memo.visited.push_back(key);
+            }
+        }
+        if (!stopped && !finished) //path may continue
+            return false;
+        memo.failed.insert(memo.visited.begin(),memo.visited.end());
+        memo.visited.clear();
+
+        if (best)
+        {
+            out = MergingLayer::TypePoint(buffer[at].begin,buffer[at + best - 1].end,value);
+            at += best;
+        }
+        else
+        {
+            out = buffer[at++];
+        }
+
+        if (at == buffer.size() || (at > 64 && at * 2 > buffer.size()))
+        {
+            buffer.erase(buffer.begin(),buffer.begin() + at);
+            dropped += at;
+            at = 0;
+            if (!memo.failed.empty())
+                memo.failed.clear();
+        }
+        restart();
+        return true;
+    }
 
-                    source.erase(source.begin() + i.begin - offset,source.begin() + i.end - offset);
-                    source.emplace(source.begin() + i.begin - offset,std::move(tmp),i.type);
+    LayeredMergingRule::Stream::Stream(const LayeredMergingRule& r): rule(&r), base(0), count(0)
+    {
+        layers.reserve(rule -> layers.size());
+        for (const auto& i: rule -> layers)
+            layers.emplace_back(i);
+    }
+
+    void LayeredMergingRule::Stream::emit(const MergingLayer::TypePoint& p,std::vector<TokenEntity>& out)
+    {
+        if (p.begin + 1 != p.end)
+        {
+            std::unique_ptr<Token> tmp = rule -> merge(p.begin - base,p.end - base,p.type,window);
+            out.emplace_back(std::move(tmp),p.type);
+        }
+        else
+        {
+            out.emplace_back(std::move(window[p.begin - base]));
+        }
+
+        //everything before end is consumed
+        std::size_t used = p.end - base;
+        if (used == window.size())
+        {
+            window.clear();
+            base = p.end;
+        }
+        else if (used > 64 && used * 2 > window.size())
+        {
+            window.erase(window.begin(),window.begin() + used);
+            base = p.end;
+        }
+    }
+
+    void LayeredMergingRule::Stream::drain(std::vector<TokenEntity>& out,bool finished)
+    {
+        MergingLayer::TypePoint p;
+        for (unsigned l=0; l+1 < layers.size(); ++l)
+        {
+            while (layers[l].pop(p,finished))
+                layers[l + 1].push(p);
+        }
+        while (layers.back().pop(p,finished))
+            emit(p,out);
+    }
+
+    void LayeredMergingRule::Stream::push(TokenEntity&& entity,std::vector<TokenEntity>& out)
+    {
+        if (layers.empty())
+        {
+            out.emplace_back(std::move(entity));
+            return;
+        }
+        layers[0].push(MergingLayer::TypePoint(count,count + 1,entity.type));
+        window.emplace_back(std::move(entity));
+        ++count;
+        drain(out,false);
+    }
+
+    void LayeredMergingRule::Stream::finish(std::vector<TokenEntity>& out)
+    {
+        if (layers.size())
+            drain(out,true);
+    }
+
+    void LayeredMergingRule::applyFused(const LexicalRule& lexer,std::vector<TokenEntity>& source,Diagnostics* diagnostics,SymbolTable* symbols) const
+    {
+        if (!lexer.hasTokenCreator() || !merger)
+        {
+            if (diagnostics != nullptr)
+            {
+                lexer.apply(source,*diagnostics);
+                apply(source,*diagnostics);
+            }
+            else
+            {
+                lexer.apply(source);
+                apply(source);
+            }
+            return;
+        }
+
+        //scope opened by lexer, children are merged as they arrive when deep
+        struct Level
+        {
+            TokenEntity scope;
+            Stream stream;
+            Level(TokenEntity&& s,const LayeredMergingRule& r): scope(std::move(s)), stream(r) {};
+        };
+
+        std::vector<TokenEntity> ret;
+        std::vector<Level> levels;
+        Stream top(*this);
+
+        auto feed = [&](TokenEntity&& entity)
+        {
+            if (levels.empty())
+            {
+                top.push(std::move(entity),ret);
+            }
+            else
+            {
+                std::vector<TokenEntity>& children = levels.back().scope.token -> as<ScopeToken>() -> tokens.edit();
+                if (deep)
+                    levels.back().stream.push(std::move(entity),children);
+                else
+                    children.emplace_back(std::move(entity));
+            }
+        };
 
-                    offset += (i.end - i.begin - 1);
+        for (const auto& i: source)
+        {
+            if (i.token -> getType() == typeid(StringToken) && i.type == 0 && i.token -> forceAs<StringToken>().str.size())
+            {
+                const StringToken& src = i.token -> forceAs<StringToken>();
+                LexicalRule::Cursor cursor(lexer,src.str,src.getPos(),diagnostics,symbols);
+                while (cursor.next())
+                {
+                    switch (cursor.getEvent())
+                    {
+                    case LexicalRule::Cursor::Insert:
+                        {
+                            feed(std::move(cursor.get()));
+                            break;
+                        }
+                    case LexicalRule::Cursor::Open:
+                        {
+                            levels.emplace_back(std::move(cursor.get()),*this);
+                            break;
+                        }
+                    case LexicalRule::Cursor::Close:
+                        {
+                            TokenEntity scope = std::move(levels.back().scope);
+                            if (deep)
+                                levels.back().stream.finish(scope.token -> as<ScopeToken>() -> tokens.edit());
+                            levels.pop_back();
+                            feed(std::move(scope));
+                            break;
+                        }
+                    }
+                }
+            }
+            else
+            {
+                //copied, so that source stays whole when lexing of a later entity throws
+                TokenEntity copy(i.token -> clone(),i.type);
+                if (deep)
+                {
+                    ScopeToken* sc = copy.token -> as<ScopeToken>();
+                    if (sc != nullptr)
+                        apply(sc -> tokens.edit());
                 }
+                top.push(std::move(copy),ret);
             }
         }
+        top.finish(ret);
+        source.swap(ret);
     }
 }
@@ -0,0 +1,420 @@
+#include "nullscript/serialize.h"
+#include "nullscript/traverse.h"
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace NULLSCR
+{
+    static const char magic[4] = {'N','S','T','B'};
+
+    static std::uint64_t zigzag(std::int64_t v)
+    {
+        return (static_cast<std::uint64_t>(v) << 1) ^ static_cast<std::uint64_t>(v >> 63);
+    }
+
+    static std::int64_t unzigzag(std::uint64_t v)
+    {
+        return static_cast<std::int64_t>(v >> 1) ^ -static_cast<std::int64_t>(v & 1);
+    }
+
+    unsigned TokenView::getKind() const
+    {
+        return kind_;
+    }
+
+    unsigned TokenView::getType() const
+    {
+        return type_;
+    }
+
+    std::uint64_t TokenView::getPos() const
+    {
+        return pos_;
+    }
+
+    bool TokenView::isString() const
+    {
+        return kind_ == TokenKinds::String;
+    }
+
+    bool TokenView::isScope() const
+    {
+        return kind_ == TokenKinds::Scope;
+    }
+
+    const char* TokenView::data() const
+    {
+        return data_;
+    }
+
+    std::size_t TokenView::size() const
+    {
+        return size_;
+    }
+
+    std::string TokenView::str() const
+    {
+        if (kind_ == TokenKinds::Scope)
+            return std::string();
+        return std::string(data_,size_);
+    }
+
+    unsigned TokenView::getScopeType() const
+    {
+        return scopeType_;
+    }
+
+    TokenReader TokenView::children() const
+    {
+        if (kind_ != TokenKinds::Scope)
+            return TokenReader(data_,data_,pos_);
+        return TokenReader(data_,data_ + size_,pos_);
+    }
+
+    TokenReader::TokenReader(const char* data,std::size_t size): cur_(data), end_(data + size), last_(0), good_(false)
+    {
+        if (size >= 5 && std::memcmp(data,magic,4) == 0 && static_cast<unsigned char>(data[4]) == TokenCodec::version)
+        {
+            cur_ += 5;
+            good_ = true;
+        }
+        else
+        {
+            cur_ = end_;
+        }
+    }
+
+    bool TokenReader::next(TokenView& out)
+    {
+        if (!good_ || cur_ == end_)
+            return false;
+        std::uint64_t kind,type,delta,size,scopeType = 0;
+        if (!TokenCodec::readVarint(cur_,end_,kind) || !TokenCodec::readVarint(cur_,end_,type) || !TokenCodec::readVarint(cur_,end_,delta))
+        {
+            good_ = false;
+            return false;
+        }
+        if (kind == TokenKinds::Scope && !TokenCodec::readVarint(cur_,end_,scopeType))
+        {
+            good_ = false;
+            return false;
+        }
+        if (!TokenCodec::readVarint(cur_,end_,size) || size > static_cast<std::uint64_t>(end_ - cur_))
+        {
+            good_ = false;
+            return false;
+        }
+        last_ += unzigzag(delta);
+        out.kind_ = static_cast<unsigned>(kind);
+        out.type_ = static_cast<unsigned>(type);
+        out.scopeType_ = static_cast<unsigned>(scopeType);
+        out.pos_ = last_;
+        out.data_ = cur_;
+        out.size_ = static_cast<std::size_t>(size);
+        cur_ += size;
+        return true;
+    }
+
+    bool TokenReader::good() const
+    {
+        return good_;
+    }
+
+    bool TokenReader::atEnd() const
+    {
+        return cur_ == end_;
+    }
+
+    void TokenCodec::writeVarint(std::uint64_t v,std::string& out)
+    {
+        while (v >= 0x80)
+        {
+            out.push_back(static_cast<char>((v & 0x7F) | 0x80));
+            v >>= 7;
+        }
+        out.push_back(static_cast<char>(v));
+    }
+
+    void TokenCodec::writeString(const char* data,std::size_t size,std::string& out)
+    {
+        writeVarint(size,out);
+        out.append(data,size);
+    }
+
+    void TokenCodec::writeString(const std::string& s,std::string& out)
+    {
+        writeString(s.data(),s.size(),out);
+    }
+
+    bool TokenCodec::readVarint(const char*& cur,const char* end,std::uint64_t& v)
+    {
+        v = 0;
+        for (unsigned shift = 0; cur != end && shift < 64; shift += 7)
+        {
+            unsigned char c = static_cast<unsigned char>(*cur++);
+            v |= static_cast<std::uint64_t>(c & 0x7F) << shift;
+            if ((c & 0x80) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    bool TokenCodec::readString(const char*& cur,const char* end,std::string& s)
+    {
+        std::uint64_t size;
+        if (!readVarint(cur,end,size) || size > static_cast<std::uint64_t>(end - cur))
+            return false;
+        s.assign(cur,static_cast<std::size_t>(size));
+        cur += size;
+        return true;
+    }
+
+    bool TokenCodec::registerToken(std::type_index type,unsigned kind,const Encoder& encoder,const Decoder& decoder)
+    {
+        if (kind < TokenKinds::Custom || !encoder || !decoder || by_kind.count(kind) || by_type.count(type))
+            return false;
+        Hooks& h = by_type[type];
+        h.kind = kind;
+        h.encoder = encoder;
+        h.decoder = decoder;
+        by_kind[kind] = &h;
+        return true;
+    }
+
+    void TokenCodec::encode(const std::vector<TokenEntity>& tokens,std::uint64_t base,std::string& out) const
+    {
+        //position of previous sibling on every level, and where lengths of open scopes go
+        std::vector<std::uint64_t> last(1,base);
+        std::vector<std::size_t> lengths;
+        std::string payload;
+        visit(tokens,[this,&out,&last,&lengths,&payload](const TokenEntity& i,std::size_t)
+        {
+            std::type_index t = i.token -> getType();
+            std::uint64_t pos = i.token -> getPos();
+            std::uint64_t delta = zigzag(static_cast<std::int64_t>(pos - last.back()));
+            last.back() = pos;
+            if (t == typeid(StringToken))
+            {
+                writeVarint(TokenKinds::String,out);
+                writeVarint(i.type,out);
+                writeVarint(delta,out);
+                writeString(i.token -> forceAs<StringToken>().str,out);
+            }
+            else if (t == typeid(SymbolToken)) //table is not stored, names come back as strings
+            {
+                writeVarint(TokenKinds::String,out);
+                writeVarint(i.type,out);
+                writeVarint(delta,out);
+                writeString(*i.token -> forceAs<SymbolToken>().str,out);
+            }
+            else if (t == typeid(ScopeToken))
+            {
+                writeVarint(TokenKinds::Scope,out);
+                writeVarint(i.type,out);
+                writeVarint(delta,out);
+                writeVarint(i.token -> forceAs<ScopeToken>().type,out);
+
+                //children are written in place behind a padded 5 byte length, patched when scope is left
+                lengths.push_back(out.size());
+                out.append(5,'\x80');
+                last.push_back(pos);
+                return true;
+            }
+            else
+            {
+                auto h = by_type.find(t);
+                if (h == by_type.end())
+                    throw std::logic_error("Serializer exception: unregistered token type");
+                writeVarint(h -> second.kind,out);
+                writeVarint(i.type,out);
+                writeVarint(delta,out);
+                payload.clear();
+                h -> second.encoder(*i.token,payload);
+                writeString(payload,out);
+            }
+            return false;
+        },[&out,&last,&lengths](const TokenEntity&,std::size_t)
+        {
+            last.pop_back();
+            std::size_t at = lengths.back();
+            lengths.pop_back();
+            std::uint64_t size = out.size() - at - 5;
+            if (size < (static_cast<std::uint64_t>(1) << 35))
+            {
+                for (unsigned k=0; k<5; ++k)
+                    out[at + k] = static_cast<char>(((size >> (7 * k)) & 0x7F) | (k < 4 ? 0x80 : 0));
+            }
+            else
+            {
+                std::string len;
+                writeVarint(size,len);
+                out.replace(at,5,len);
+            }
+        });
+    }
+
+    void TokenCodec::encode(const std::vector<TokenEntity>& tokens,std::string& out) const
+    {
+        out.append(magic,4);
+        out.push_back(static_cast<char>(version));
+        encode(tokens,0,out);
+    }
+
+    std::unique_ptr<Token> TokenCodec::decode(const TokenView& view) const
+    {
+        std::unique_ptr<Token> ret;
+        switch (view.getKind())
+        {
+        case TokenKinds::String:
+            {
+                ret.reset(new StringToken(0,view.str()));
+                break;
+            }
+        case TokenKinds::Scope:
+            {
+                ScopeToken* sc = new ScopeToken(0,view.getScopeType());
+                ret.reset(sc);
+                if (!decode(view.children(),sc -> tokens.edit()))
+                    return std::unique_ptr<Token>();
+                break;
+            }
+        default:
+            {
+                auto h = by_kind.find(view.getKind());
+                if (h == by_kind.end())
+                    return ret;
+                ret = h -> second -> decoder(view.data(),view.size());
+                break;
+            }
+        }
+        if (ret)
+            ret -> setPos(static_cast<Position>(view.getPos()));
+        return ret;
+    }
+
+    bool TokenCodec::decode(TokenReader reader,std::vector<TokenEntity>& out) const
+    {
+        //reader and list of every open scope, children are read before siblings of their scope
+        std::vector<std::pair<TokenReader,std::vector<TokenEntity>*>> open;
+        open.emplace_back(reader,&out);
+        TokenView view;
+        while (!open.empty())
+        {
+            if (!open.back().first.next(view))
+            {
+                if (!open.back().first.good())
+                    return false;
+                open.pop_back();
+                continue;
+            }
+            std::vector<TokenEntity>& list = *open.back().second;
+            if (view.isScope())
+            {
+                ScopeToken* sc = new ScopeToken(static_cast<Position>(view.getPos()),view.getScopeType());
+                list.emplace_back(std::unique_ptr<Token>(sc),view.getType());
+                open.emplace_back(view.children(),&sc -> tokens.edit());
+                continue;
+            }
+            std::unique_ptr<Token> t = decode(view);
+            if (!t)
+                return false;
+            list.emplace_back(std::move(t),view.getType());
+        }
+        return true;
+    }
+
+    bool TokenCodec::decode(const char* data,std::size_t size,std::vector<TokenEntity>& out) const
+    {
+        TokenReader reader(data,size);
+        if (!reader.good())
+            return false;
+        return decode(reader,out);
+    }
+
+    bool TokenCodec::decode(const std::string& data,std::vector<TokenEntity>& out) const
+    {
+        return decode(data.data(),data.size(),out);
+    }
+
+    bool MappedFile::open(const std::string& path)
+    {
+        close();
+#ifndef _WIN32
+        int fd = ::open(path.c_str(),O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd,&st) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        size_ = static_cast<std::size_t>(st.st_size);
+        if (size_ == 0)
+        {
+            ::close(fd);
+            data_ = buffer_.data();
+            return true;
+        }
+        void* p = mmap(nullptr,size_,PROT_READ,MAP_PRIVATE,fd,0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+        {
+            size_ = 0;
+            return false;
+        }
+        data_ = static_cast<const char*>(p);
+        return true;
+#else
+        std::ifstream in(path,std::ios::binary);
+        if (!in)
+            return false;
+        std::ostringstream s;
+        s << in.rdbuf();
+        buffer_ = s.str();
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+        return true;
+#endif
+    }
+
+    void MappedFile::close()
+    {
+#ifndef _WIN32
+        if (data_ != nullptr && size_ != 0)
+            munmap(const_cast<char*>(data_),size_);
+#endif
+        buffer_.clear();
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    bool MappedFile::isOpen() const
+    {
+        return data_ != nullptr;
+    }
+
+    const char* MappedFile::data() const
+    {
+        return data_;
+    }
+
+    std::size_t MappedFile::size() const
+    {
+        return size_;
+    }
+
+    MappedFile::~MappedFile()
+    {
+        close();
+    }
+}
@@ -0,0 +1,79 @@
+#include "nullscript/symbols.h"
+#include <cstring>
+#include <cstdint>
+
+namespace NULLSCR
+{
+    const unsigned SymbolTable::npos;
+
+    std::size_t SymbolTable::KeyHash::operator () (const Key& key) const
+    {
+        //FNV-1a, names are short
+        std::uint64_t h = 14695981039346656037ull;
+        for (std::size_t i=0; i<key.size; ++i)
+        {
+            h ^= static_cast<unsigned char>(key.data[i]);
+            h *= 1099511628211ull;
+        }
+        return static_cast<std::size_t>(h);
+    }
+
+    bool SymbolTable::KeyEqual::operator () (const Key& a,const Key& b) const
+    {
+        return a.size == b.size && std::memcmp(a.data,b.data,a.size) == 0;
+    }
+
+    unsigned SymbolTable::intern(const char* data,std::size_t size)
+    {
+        auto it = ids.find(Key{data,size});
+        if (it != ids.end())
+            return it -> second;
+        if (names.size() == npos)
+            throw std::logic_error("SymbolTable exception: too many symbols");
+        names.emplace_back(data,size);
+        bytes += size;
+        unsigned id = names.size() - 1;
+        ids.emplace(Key{names.back().data(),size},id);
+        return id;
+    }
+
+    unsigned SymbolTable::intern(const std::string& name)
+    {
+        return intern(name.data(),name.size());
+    }
+
+    unsigned SymbolTable::find(const char* data,std::size_t size) const
+    {
+        auto it = ids.find(Key{data,size});
+        return it != ids.end() ? it -> second : npos;
+    }
+
+    unsigned SymbolTable::find(const std::string& name) const
+    {
+        return find(name.data(),name.size());
+    }
+
+    const std::string& SymbolTable::get(unsigned id) const
+    {
+        if (id >= names.size())
+            throw std::logic_error("SymbolTable exception: unknown symbol");
+        return names[id];
+    }
+
+    std::size_t SymbolTable::size() const
+    {
+        return names.size();
+    }
+
+    std::size_t SymbolTable::getBytes() const
+    {
+        return bytes;
+    }
+
+    void SymbolTable::clear()
+    {
+        ids.clear();
+        names.clear();
+        bytes = 0;
+    }
+}
@@ -1,45 +1,72 @@
 #include "nullscript/tokens.h"
+#include "nullscript/writer.h"
+#include <atomic>
 
 namespace NULLSCR
 {
-    ScopeToken::ScopeToken(const ScopeToken& target)
+    const std::vector<TokenEntity>& TokenList::get() const
     {
-        setPos(target.getPos());
-        type = target.type;
-        tokens.reserve(target.tokens.size());
-        for (const auto& i: target.tokens)
-            tokens.emplace_back(std::unique_ptr<Token>(i.token->clone()),i.type);
+        static const std::vector<TokenEntity> empty;
+        if (data_)
+            return *data_;
+        return empty;
     }
 
-    void printTokens(const std::vector<TokenEntity>& tokens,std::ostream& out,bool recursive,unsigned offset)
+    std::vector<TokenEntity>& TokenList::edit()
     {
-        for (const auto& i:tokens)
+        if (!data_)
         {
-            std::type_index t = i.token -> getType();
-            out << std::string(offset,' ') << "(";
-            if (i.token -> getName()[0] != '\0')
-            {
-                out << i.token -> getName();
-            }
-            else
-            {
-                out << t.name();
-            }
-            out << ":" << i.type << ")";
-            if (i.token -> as<StringToken>() != nullptr)
-            {
-                out << " " << i.token -> as<StringToken>() -> str;
-            }
-            else if (i.token -> as<ScopeToken>() != nullptr)
+            data_.reset(new std::vector<TokenEntity>());
+        }
+        else if (data_.use_count() == 1)
+        {
+            //count is read relaxed, this orders edits after whatever owners that let go of list did with it
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+        else
+        {
+            //clone this level only, scope children share their own lists
+            std::shared_ptr<std::vector<TokenEntity>> copy(new std::vector<TokenEntity>());
+            copy -> reserve(data_ -> size());
+            for (const auto& i: *data_)
+                copy -> emplace_back(i.token -> clone(),i.type);
+            data_ = std::move(copy);
+        }
+        return *data_;
+    }
+
+    bool TokenList::isShared() const
+    {
+        return data_ && data_.use_count() > 1;
+    }
+
+    ScopeToken::~ScopeToken()
+    {
+        //lists of nested scopes are taken out before they are destroyed, so destruction does not recurse
+        if (tokens.empty() || tokens.isShared())
+            return;
+        std::vector<TokenList> pending;
+        pending.push_back(std::move(tokens));
+        while (!pending.empty())
+        {
+            TokenList list = std::move(pending.back());
+            pending.pop_back();
+            if (list.isShared()) //other owners keep it alive
+                continue;
+            for (const auto& i: list.get())
             {
-                if (recursive)
-                {
-                    out << ":\n";
-                    printTokens(i.token -> as<ScopeToken>() -> tokens,out,true,offset+2);
-                }
-                out << std::string(offset,' ') << "end\n";
+                ScopeToken* sc = i.token -> as<ScopeToken>();
+                if (sc != nullptr && !sc -> tokens.empty())
+                    pending.push_back(std::move(sc -> tokens));
             }
-            out << "\n";
         }
     }
+
+    void printTokens(const std::vector<TokenEntity>& tokens,std::ostream& out,bool recursive,unsigned offset)
+    {
+        TokenWriter writer(out,TokenWriter::Text,1 << 12);
+        writer.setRecursive(recursive);
+        writer.setIndent(offset);
+        writer.write(tokens);
+    }
 }
@@ -0,0 +1,15 @@
+#include "nullscript/traverse.h"
+
+namespace NULLSCR
+{
+    void TokenVisitor::visit(const std::vector<TokenEntity>& tokens)
+    {
+        NULLSCR::visit(tokens,[this](const TokenEntity& entity,std::size_t depth)
+        {
+            return enter(entity,depth);
+        },[this](const TokenEntity& entity,std::size_t depth)
+        {
+            leave(entity,depth);
+        });
+    }
+}
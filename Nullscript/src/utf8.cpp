@@ -0,0 +1,94 @@
+#include "nullscript/utf8.h"
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NULLSCR_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace NULLSCR
+{
+    namespace Utf8
+    {
+        std::size_t asciiPrefix(const char* data,std::size_t size)
+        {
+            std::size_t i = 0;
+#ifdef NULLSCR_SSE2
+            //high bits of 16 bytes at once
+            for (; i + 16 <= size; i += 16)
+            {
+                __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+                if (_mm_movemask_epi8(chunk) != 0)
+                    break;
+            }
+#endif
+            for (; i + 8 <= size; i += 8)
+            {
+                std::uint64_t chunk;
+                std::memcpy(&chunk,data + i,8);
+                if (chunk & 0x8080808080808080ULL)
+                    break;
+            }
+            while (i < size && static_cast<unsigned char>(data[i]) < 0x80)
+                ++i;
+            return i;
+        }
+
+        Position validate(const char* data,std::size_t size)
+        {
+            std::size_t i = 0;
+            while (true)
+            {
+                i += asciiPrefix(data + i,size - i);
+                if (i == size)
+                    return size;
+
+                unsigned char c = static_cast<unsigned char>(data[i]);
+                unsigned length;
+                unsigned char low = 0x80,high = 0xBF; //range of second byte
+                if (c >= 0xC2 && c <= 0xDF)
+                {
+                    length = 2;
+                }
+                else if (c >= 0xE0 && c <= 0xEF)
+                {
+                    length = 3;
+                    if (c == 0xE0)
+                        low = 0xA0;
+                    else if (c == 0xED)
+                        high = 0x9F;
+                }
+                else if (c >= 0xF0 && c <= 0xF4)
+                {
+                    length = 4;
+                    if (c == 0xF0)
+                        low = 0x90;
+                    else if (c == 0xF4)
+                        high = 0x8F;
+                }
+                else
+                {
+                    return i;
+                }
+
+                if (size - i < length)
+                    return i;
+                unsigned char b = static_cast<unsigned char>(data[i + 1]);
+                if (b < low || b > high)
+                    return i;
+                for (unsigned k=2; k<length; ++k)
+                {
+                    if ((static_cast<unsigned char>(data[i + k]) & 0xC0) != 0x80)
+                        return i;
+                }
+                i += length;
+            }
+        }
+
+        Position validate(const std::string& source)
+        {
+            return validate(source.data(),source.size());
+        }
+    }
+}
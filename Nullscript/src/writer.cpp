@@ -0,0 +1,276 @@
+#include "nullscript/writer.h"
+#include "nullscript/traverse.h"
+#include <cstring>
+#include <cerrno>
+
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+namespace NULLSCR
+{
+    static const char spaces[] = "                                                                ";
+
+    TokenWriter::TokenWriter(int descriptor,unsigned f,std::size_t size): buffer(new char[size < 64 ? 64 : size]), capacity(size < 64 ? 64 : size), used(0),
+        fd(descriptor), stream(nullptr), format(f), indent(0), recursive(true), failed(false) {}
+
+    TokenWriter::TokenWriter(std::ostream& out,unsigned f,std::size_t size): buffer(new char[size < 64 ? 64 : size]), capacity(size < 64 ? 64 : size), used(0),
+        fd(-1), stream(&out), format(f), indent(0), recursive(true), failed(false) {}
+
+    TokenWriter::~TokenWriter()
+    {
+        flush();
+    }
+
+    void TokenWriter::setRecursive(bool r)
+    {
+        recursive = r;
+    }
+
+    void TokenWriter::setIndent(unsigned i)
+    {
+        indent = i;
+    }
+
+    bool TokenWriter::good() const
+    {
+        return !failed;
+    }
+
+    void TokenWriter::send(const char* data,std::size_t size)
+    {
+        if (failed)
+            return;
+        if (stream != nullptr)
+        {
+            stream -> write(data,size);
+            failed = !*stream;
+            return;
+        }
+        while (size)
+        {
+#ifndef _WIN32
+            ssize_t n = ::write(fd,data,size);
+#else
+            int n = _write(fd,data,static_cast<unsigned>(size));
+#endif
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                failed = true;
+                return;
+            }
+            data += n;
+            size -= n;
+        }
+    }
+
+    bool TokenWriter::flush()
+    {
+        if (used)
+            send(buffer.get(),used);
+        used = 0;
+        return !failed;
+    }
+
+    void TokenWriter::put(const char* data,std::size_t size)
+    {
+        if (size > capacity - used)
+        {
+            send(buffer.get(),used);
+            used = 0;
+            if (size >= capacity) //too big to be worth copying
+            {
+                send(data,size);
+                return;
+            }
+        }
+        std::memcpy(buffer.get() + used,data,size);
+        used += size;
+    }
+
+    void TokenWriter::put(char c)
+    {
+        if (used == capacity)
+        {
+            send(buffer.get(),used);
+            used = 0;
+        }
+        buffer[used++] = c;
+    }
+
+    void TokenWriter::put(const char* s)
+    {
+        put(s,std::strlen(s));
+    }
+
+    void TokenWriter::putNumber(std::uint64_t v)
+    {
+        char tmp[20];
+        char* p = tmp + sizeof(tmp);
+        do
+        {
+            *--p = '0' + v % 10;
+            v /= 10;
+        }
+        while (v);
+        put(p,tmp + sizeof(tmp) - p);
+    }
+
+    void TokenWriter::putSpaces(std::size_t n)
+    {
+        for (; n > sizeof(spaces) - 1; n -= sizeof(spaces) - 1)
+            put(spaces,sizeof(spaces) - 1);
+        put(spaces,n);
+    }
+
+    void TokenWriter::putEscaped(const char* data,std::size_t size)
+    {
+        static const char hex[] = "0123456789abcdef";
+        std::size_t begin = 0;
+        for (std::size_t i=0; i<size; ++i)
+        {
+            unsigned char c = static_cast<unsigned char>(data[i]);
+            if (c >= 0x20 && c != '"' && c != '\\')
+                continue;
+            put(data + begin,i - begin);
+            begin = i + 1;
+            switch (c)
+            {
+            case '"':
+                put("\\\"",2);
+                break;
+            case '\\':
+                put("\\\\",2);
+                break;
+            case '\n':
+                put("\\n",2);
+                break;
+            case '\r':
+                put("\\r",2);
+                break;
+            case '\t':
+                put("\\t",2);
+                break;
+            default:
+                {
+                    char tmp[6] = {'\\','u','0','0',hex[c >> 4],hex[c & 15]};
+                    put(tmp,6);
+                }
+            }
+        }
+        put(data + begin,size - begin);
+    }
+
+    void TokenWriter::putName(const Token& token)
+    {
+        const char* name = token.getName();
+        if (name[0] == '\0')
+            name = token.getType().name();
+        if (format == Json)
+            putEscaped(name,std::strlen(name));
+        else
+            put(name);
+    }
+
+    void TokenWriter::writeText(const std::vector<TokenEntity>& tokens)
+    {
+        visit(tokens,[this](const TokenEntity& i,std::size_t depth)
+        {
+            std::type_index t = i.token -> getType();
+            putSpaces(indent + depth * 2);
+            put('(');
+            putName(*i.token);
+            put(':');
+            putNumber(i.type);
+            put(')');
+            if (t == typeid(StringToken))
+            {
+                put(' ');
+                const std::string& str = i.token -> forceAs<StringToken>().str;
+                put(str.data(),str.size());
+            }
+            else if (t == typeid(SymbolToken))
+            {
+                put(' ');
+                const std::string& str = *i.token -> forceAs<SymbolToken>().str;
+                put(str.data(),str.size());
+            }
+            else if (recursive && t == typeid(ScopeToken))
+            {
+                put(":\n",2);
+                return true;
+            }
+            put('\n');
+            return false;
+        },[this](const TokenEntity&,std::size_t depth)
+        {
+            putSpaces(indent + depth * 2);
+            put("end\n\n",5);
+        });
+    }
+
+    void TokenWriter::writeJson(const std::vector<TokenEntity>& tokens)
+    {
+        bool first = true;
+        put('[');
+        visit(tokens,[this,&first](const TokenEntity& i,std::size_t)
+        {
+            std::type_index t = i.token -> getType();
+            if (!first)
+                put(',');
+            first = false;
+            put("{\"name\":\"",9);
+            putName(*i.token);
+            put("\",\"type\":",9);
+            putNumber(i.type);
+            put(",\"pos\":",7);
+            putNumber(i.token -> getPos());
+            if (t == typeid(StringToken))
+            {
+                put(",\"str\":\"",8);
+                const std::string& str = i.token -> forceAs<StringToken>().str;
+                putEscaped(str.data(),str.size());
+                put('"');
+            }
+            else if (t == typeid(SymbolToken))
+            {
+                const SymbolToken& sym = i.token -> forceAs<SymbolToken>();
+                put(",\"symbol\":",10);
+                putNumber(sym.id);
+                put(",\"str\":\"",8);
+                putEscaped(sym.str -> data(),sym.str -> size());
+                put('"');
+            }
+            else if (t == typeid(ScopeToken))
+            {
+                put(",\"scope\":",9);
+                putNumber(i.token -> forceAs<ScopeToken>().type);
+                if (recursive)
+                {
+                    put(",\"tokens\":[",11);
+                    first = true;
+                    return true;
+                }
+            }
+            put('}');
+            return false;
+        },[this,&first](const TokenEntity&,std::size_t)
+        {
+            put("]}",2);
+            first = false;
+        });
+        put("]\n",2);
+    }
+
+    void TokenWriter::write(const std::vector<TokenEntity>& tokens)
+    {
+        if (format == Json)
+            writeJson(tokens);
+        else
+            writeText(tokens);
+    }
+}